@@ -9,8 +9,15 @@
 #include "ev-config.h"
 
 #include "ev-application.h"
+#include "ev-db.h"
+#include "ev-import.h"
+#include "ev-loop-monitor.h"
 #include "ev-prompt.h"
 #include "ev-matrix.h"
+#include "ev-startup-profile.h"
+#include "ev-sync-log.h"
+
+#include <glib/gi18n.h>
 
 #define BLURP "A matrix client for the terminal"
 
@@ -33,6 +40,8 @@ struct _EvApplication {
 
   char          *data_dir;
   char          *cache_dir;
+  GStrv          accounts;
+  gboolean       offline;
   EvDebugFlags   debug_flags;
 };
 G_DEFINE_TYPE (EvApplication, ev_application, G_TYPE_APPLICATION)
@@ -59,14 +68,32 @@ ev_application_startup (GApplication *app)
   EvApplication *self = EV_APPLICATION (app);
   g_autoptr (GPtrArray) commands = g_ptr_array_new ();
 
-  if ((self->debug_flags & EV_DEBUG_FLAG_NO_MATRIX) == 0) {
-    ev_matrix_init (self->data_dir, self->cache_dir);
+  if (self->offline) {
+    ev_db_add_commands (commands, TRUE);
+    ev_import_add_commands (commands);
+  } else if ((self->debug_flags & EV_DEBUG_FLAG_NO_MATRIX) == 0) {
     ev_matrix_add_commands (commands);
+    ev_sync_log_add_commands (commands);
+    ev_db_add_commands (commands, FALSE);
   }
 
   ev_prompt_add_commands (commands);
+  ev_startup_profile_add_commands (commands);
+  ev_loop_monitor_add_commands (commands);
+
+  ev_loop_monitor_init ();
+
+  /* The prompt doesn't need to wait for anything matrix related, the
+   * history and database load in the background */
   ev_prompt_init (commands, self->cache_dir);
 
+  if (self->offline) {
+    ev_db_init (self->data_dir, (const char * const *)self->accounts, TRUE);
+  } else if ((self->debug_flags & EV_DEBUG_FLAG_NO_MATRIX) == 0) {
+    ev_db_init (self->data_dir, NULL, FALSE);
+    ev_matrix_init (self->data_dir, self->cache_dir, (const char * const *)self->accounts);
+  }
+
   G_APPLICATION_CLASS (ev_application_parent_class)->startup (app);
 }
 
@@ -74,8 +101,12 @@ ev_application_startup (GApplication *app)
 static void
 ev_application_shutdown (GApplication *app)
 {
+  ev_startup_profile_save (EV_APPLICATION (app)->cache_dir);
   ev_prompt_destroy (EV_APPLICATION (app)->cache_dir);
   ev_matrix_destroy ();
+  ev_db_destroy ();
+  ev_import_destroy ();
+  ev_loop_monitor_destroy ();
 
   G_APPLICATION_CLASS (ev_application_parent_class)->shutdown (app);
 }
@@ -100,6 +131,9 @@ ev_application_handle_local_options (GApplication *app, GVariantDict *options)
     return 0;
   }
 
+  g_variant_dict_lookup (options, "account", "^as", &EV_APPLICATION (app)->accounts);
+  EV_APPLICATION (app)->offline = g_variant_dict_contains (options, "offline");
+
   return app_class->handle_local_options (app, options);
 }
 
@@ -111,6 +145,7 @@ ev_application_finalize (GObject *object)
 
   g_free (self->cache_dir);
   g_free (self->data_dir);
+  g_strfreev (self->accounts);
 
   G_OBJECT_CLASS (ev_application_parent_class)->finalize (object);
 }
@@ -141,6 +176,14 @@ ev_application_init (EvApplication *self)
 
   g_application_set_option_context_parameter_string (G_APPLICATION (self), BLURP);
   g_application_set_version (G_APPLICATION (self), EV_VERSION);
+  g_application_add_main_option (G_APPLICATION (self), "account", 'a',
+                                 G_OPTION_FLAG_NONE, G_OPTION_ARG_STRING_ARRAY,
+                                 _("Only start the given account, can be given multiple times"),
+                                 "ACCOUNT");
+  g_application_add_main_option (G_APPLICATION (self), "offline", 'o',
+                                 G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE,
+                                 _("Browse the stored database without connecting to any server"),
+                                 NULL);
 
   debugenv = g_getenv ("EV_DEBUG");
   if (debugenv)
@@ -0,0 +1,1847 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "ev-config.h"
+
+#include "ev-db.h"
+#include "ev-format-builder.h"
+#include "ev-import.h"
+#include "ev-prompt.h"
+#include "ev-startup-profile.h"
+
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+
+#include <sqlite3.h>
+#include <stdio.h>
+
+#include "cmatrix.h"
+
+#define DB_DEFAULT_EVENTS    20
+#define DB_DEFAULT_RESULTS   20
+#define DB_STATS_TOP_ROOMS   10
+#define DB_BUSY_TIMEOUT      5000 /* ms */
+#define DB_STREAM_ROWS       50
+#define EXPORT_PAGE_EVENTS   500
+#define EXPORT_MEMBER_EVENTS 10000 /* Events per gzip member, the resume granularity */
+
+/**
+ * EvDb:
+ *
+ * Read only access to the database libcmatrix keeps in the data dir.
+ * Used in offline mode to look at rooms and events without restoring
+ * any client, so nothing touches the network and startup doesn't wait
+ * for libcmatrix.
+ *
+ * Stats and maintenance run on a worker thread with a connection of
+ * their own so they work next to libcmatrix without blocking sync.
+ *
+ * The queries follow libcmatrix' schema: `users` holds the user ids,
+ * `accounts` the clients, `rooms` the rooms of each account (with the
+ * room id in `room_name`) and `room_events` the events with their JSON
+ * in `json_data`.
+ */
+
+/* JSON stored by libcmatrix isn't guaranteed to be valid and json_extract ()
+ * fails the whole query on invalid input */
+#define SQL_BODY "CASE WHEN json_valid (e.json_data) THEN json_extract (e.json_data, '$.content.body') END"
+
+static sqlite3 *db;
+static char *db_path;
+static GError *open_error;
+static GStrv only_accounts;
+static gboolean db_job_running;
+
+
+/**
+ * ev_db_init:
+ * @data_dir: The data dir holding the database
+ * @only_accounts:(nullable): The user ids to limit the offline commands to
+ * @offline: Whether to open the database for the offline commands
+ */
+void
+ev_db_init (const char *data_dir, const char * const *only_accounts_, gboolean offline)
+{
+  int rc;
+
+  db_path = g_build_filename (data_dir, "matrix.db", NULL);
+  if (!offline)
+    return;
+
+  ev_startup_profile_begin (EV_STARTUP_PHASE_DB_OPEN);
+
+  only_accounts = g_strdupv ((GStrv) only_accounts_);
+
+  /* Read only so a copied data dir stays untouched */
+  rc = sqlite3_open_v2 (db_path, &db, SQLITE_OPEN_READONLY, NULL);
+  if (rc != SQLITE_OK) {
+    g_set_error (&open_error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to open %s: %s", db_path, db ? sqlite3_errmsg (db) : sqlite3_errstr (rc));
+    g_clear_pointer (&db, sqlite3_close);
+  }
+
+  ev_startup_profile_end (EV_STARTUP_PHASE_DB_OPEN);
+}
+
+
+void
+ev_db_destroy (void)
+{
+  g_clear_pointer (&db, sqlite3_close);
+  g_clear_pointer (&db_path, g_free);
+  g_clear_pointer (&only_accounts, g_strfreev);
+  g_clear_error (&open_error);
+}
+
+
+static gboolean
+check_db (GError **err)
+{
+  if (db)
+    return TRUE;
+
+  if (open_error)
+    g_propagate_error (err, g_error_copy (open_error));
+  else
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_INITIALIZED, "Database not opened");
+
+  return FALSE;
+}
+
+
+static gboolean
+account_selected (const char *user_id)
+{
+  if (!only_accounts || !only_accounts[0])
+    return TRUE;
+
+  return g_strv_contains ((const char * const *) only_accounts, user_id);
+}
+
+
+static sqlite3_stmt *
+prepare (const char *sql, GError **err)
+{
+  sqlite3_stmt *stmt = NULL;
+
+  if (sqlite3_prepare_v2 (db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to query %s: %s",
+                 db_path, sqlite3_errmsg (db));
+    return NULL;
+  }
+
+  return stmt;
+}
+
+
+static gboolean
+step_done (sqlite3_stmt *stmt, int rc, GError **err)
+{
+  if (rc == SQLITE_DONE)
+    return TRUE;
+
+  g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to query %s: %s",
+               db_path, sqlite3_errmsg (db));
+  return FALSE;
+}
+
+
+/**
+ * ev_db_format_ts:
+ * @ts: A timestamp in ms
+ *
+ * Returns: The timestamp as local date and time
+ */
+char *
+ev_db_format_ts (gint64 ts)
+{
+  g_autoptr (GDateTime) dt = g_date_time_new_from_unix_local (ts / 1000);
+
+  if (!dt)
+    return g_strdup ("?");
+
+  return g_date_time_format (dt, "%F %T");
+}
+
+/* Finds the row id of a room of one of the selected accounts */
+static gboolean
+lookup_room (const char *room_id, gint64 *id, GError **err)
+{
+  sqlite3_stmt *stmt;
+  int rc;
+
+  stmt = prepare ("SELECT rooms.id, users.username FROM rooms "
+                  "JOIN accounts ON rooms.account_id = accounts.id "
+                  "JOIN users ON accounts.user_id = users.id "
+                  "WHERE rooms.room_name = ?1", err);
+  if (!stmt)
+    return FALSE;
+
+  sqlite3_bind_text (stmt, 1, room_id, -1, SQLITE_TRANSIENT);
+  while ((rc = sqlite3_step (stmt)) == SQLITE_ROW) {
+    if (!account_selected ((const char *) sqlite3_column_text (stmt, 1)))
+      continue;
+
+    *id = sqlite3_column_int64 (stmt, 0);
+    sqlite3_finalize (stmt);
+    return TRUE;
+  }
+
+  if (step_done (stmt, rc, err))
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", room_id);
+  sqlite3_finalize (stmt);
+
+  return FALSE;
+}
+
+
+static GString *
+ev_db_list_rooms (GStrv args, GError **err)
+{
+  g_autoptr (GString) out = g_string_new ("");
+  sqlite3_stmt *stmt;
+  guint n_rooms = 0;
+  int rc;
+
+  if (!check_db (err))
+    return NULL;
+
+  stmt = prepare ("SELECT users.username, rooms.room_name FROM rooms "
+                  "JOIN accounts ON rooms.account_id = accounts.id "
+                  "JOIN users ON accounts.user_id = users.id "
+                  "ORDER BY users.username, rooms.room_name", err);
+  if (!stmt)
+    return NULL;
+
+  while ((rc = sqlite3_step (stmt)) == SQLITE_ROW) {
+    const char *user_id = (const char *) sqlite3_column_text (stmt, 0);
+
+    if (!account_selected (user_id))
+      continue;
+
+    g_string_append_printf (out, "  Account: %s, room id: %s\n",
+                            user_id, (const char *) sqlite3_column_text (stmt, 1));
+    n_rooms++;
+  }
+
+  if (!step_done (stmt, rc, err)) {
+    sqlite3_finalize (stmt);
+    return NULL;
+  }
+  sqlite3_finalize (stmt);
+
+  if (!n_rooms)
+    g_string_append (out, "No stored rooms\n");
+
+  return g_steal_pointer (&out);
+}
+
+
+static GString *
+ev_db_room_details (GStrv args, GError **err)
+{
+  g_autoptr (EvFormatBuilder) builder = ev_format_builder_new ();
+  sqlite3_stmt *stmt;
+  gint64 room;
+  int rc;
+
+  if (!check_db (err))
+    return NULL;
+
+  if (g_strv_length (args) < 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+    return NULL;
+  }
+
+  if (!lookup_room (args[0], &room, err))
+    return NULL;
+
+  stmt = prepare ("SELECT COUNT(*), MIN(origin_server_ts), MAX(origin_server_ts), "
+                  "COUNT(DISTINCT sender_id) FROM room_events WHERE room_id = ?1", err);
+  if (!stmt)
+    return NULL;
+
+  sqlite3_bind_int64 (stmt, 1, room);
+  rc = sqlite3_step (stmt);
+  if (rc != SQLITE_ROW) {
+    step_done (stmt, rc, err);
+    sqlite3_finalize (stmt);
+    return NULL;
+  }
+
+  ev_format_builder_set_indent (builder, INFO_INDENT);
+  ev_format_builder_add (builder, _("Room Id"), args[0]);
+  ev_format_builder_take_value (builder, _("Events"),
+                                g_strdup_printf ("%" G_GINT64_FORMAT, (gint64) sqlite3_column_int64 (stmt, 0)));
+  if (sqlite3_column_int64 (stmt, 0)) {
+    ev_format_builder_take_value (builder, _("Oldest event"), ev_db_format_ts (sqlite3_column_int64 (stmt, 1)));
+    ev_format_builder_take_value (builder, _("Newest event"), ev_db_format_ts (sqlite3_column_int64 (stmt, 2)));
+  }
+  ev_format_builder_take_value (builder, _("Senders"),
+                                g_strdup_printf ("%" G_GINT64_FORMAT, (gint64) sqlite3_column_int64 (stmt, 3)));
+  sqlite3_finalize (stmt);
+
+  return ev_format_builder_end (builder);
+}
+
+
+/**
+ * ev_db_append_event:
+ * @out: The string to append to
+ * @ts: The event's timestamp in ms
+ * @sender:(nullable): The sender's user id
+ * @body:(nullable): The message body
+ * @event_id:(nullable): The event id
+ *
+ * Formats an event the way the offline commands show them.
+ */
+void
+ev_db_append_event (GString    *out,
+                    gint64      ts,
+                    const char *sender,
+                    const char *body,
+                    const char *event_id)
+{
+  g_autofree char *time = ev_db_format_ts (ts);
+
+  g_string_append_printf (out, "  [%s] <%s> %s\n    %s\n", time, sender ?: "?",
+                          body ?: "(no body)", event_id ?: "?");
+}
+
+
+/**
+ * ev_db_search_hit_new:
+ * @ts: The time of the event in ms
+ * @text:(transfer full): The formatted result
+ *
+ * Returns: A new search hit
+ */
+EvDbSearchHit *
+ev_db_search_hit_new (gint64 ts, GString *text)
+{
+  EvDbSearchHit *hit = g_new0 (EvDbSearchHit, 1);
+
+  hit->ts = ts;
+  hit->text = g_string_free (text, FALSE);
+
+  return hit;
+}
+
+
+void
+ev_db_search_hit_free (EvDbSearchHit *hit)
+{
+  g_free (hit->text);
+  g_free (hit);
+}
+
+
+static void
+append_event (GString *out, sqlite3_stmt *stmt, int col)
+{
+  ev_db_append_event (out, sqlite3_column_int64 (stmt, col + 1),
+                      (const char *) sqlite3_column_text (stmt, col + 2),
+                      (const char *) sqlite3_column_text (stmt, col + 3),
+                      (const char *) sqlite3_column_text (stmt, col));
+}
+
+
+/* Parses YYYY-MM-DD as the start of that day in local time, in ms */
+static gboolean
+parse_day (const char *str, gboolean next_day, gint64 *ts, GError **err)
+{
+  g_autoptr (GDateTime) dt = NULL;
+  int year, month, day;
+  char end;
+
+  if (sscanf (str, "%d-%d-%d%c", &year, &month, &day, &end) == 3)
+    dt = g_date_time_new_local (year, month, day, 0, 0, 0);
+
+  if (!dt) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Invalid date '%s', need YYYY-MM-DD", str);
+    return FALSE;
+  }
+
+  if (next_day) {
+    g_autoptr (GDateTime) next = g_date_time_add_days (dt, 1);
+
+    *ts = g_date_time_to_unix (next) * 1000;
+  } else {
+    *ts = g_date_time_to_unix (dt) * 1000;
+  }
+
+  return TRUE;
+}
+
+
+static GString *
+ev_db_room_events (GStrv args, GError **err)
+{
+  g_autoptr (GString) out = g_string_new ("");
+  guint64 limit = DB_DEFAULT_EVENTS;
+  sqlite3_stmt *stmt;
+  gint64 room;
+  int rc;
+
+  if (g_strv_length (args) < 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+    return NULL;
+  }
+
+  if (args[1] && !g_ascii_string_to_unsigned (args[1], 10, 1, G_MAXINT, &limit, err))
+    return NULL;
+
+  /* Imported events take precedence, they don't need the database */
+  if (ev_import_has_room (args[0])) {
+    ev_import_append_room_events (out, args[0], limit);
+    return g_steal_pointer (&out);
+  }
+
+  if (!check_db (err))
+    return NULL;
+
+  if (!lookup_room (args[0], &room, err))
+    return NULL;
+
+  /* The newest events, oldest first */
+  stmt = prepare ("SELECT * FROM ("
+                  " SELECT e.event_uid, e.origin_server_ts, users.username, " SQL_BODY ", e.sorted_id "
+                  " FROM room_events e "
+                  " LEFT JOIN room_members ON e.sender_id = room_members.id "
+                  " LEFT JOIN users ON room_members.user_id = users.id "
+                  " WHERE e.room_id = ?1 ORDER BY e.sorted_id DESC LIMIT ?2"
+                  ") ORDER BY sorted_id ASC", err);
+  if (!stmt)
+    return NULL;
+
+  sqlite3_bind_int64 (stmt, 1, room);
+  sqlite3_bind_int64 (stmt, 2, limit);
+  while ((rc = sqlite3_step (stmt)) == SQLITE_ROW)
+    append_event (out, stmt, 0);
+
+  if (!step_done (stmt, rc, err)) {
+    sqlite3_finalize (stmt);
+    return NULL;
+  }
+  sqlite3_finalize (stmt);
+
+  if (!out->len)
+    g_string_append (out, "No stored events\n");
+
+  return g_steal_pointer (&out);
+}
+
+
+static GString *
+ev_db_search (GStrv args, GError **err)
+{
+  g_autoptr (GString) out = g_string_new ("");
+  g_autoptr (GHashTable) found = NULL;
+  g_autoptr (GPtrArray) db_hits = NULL;
+  g_autoptr (GPtrArray) import_hits = NULL;
+  const char *room_id = NULL, *sender_id = NULL, *text = NULL;
+  guint64 limit = DB_DEFAULT_RESULTS;
+  guint n_results = 0, i = 0, j = 0;
+  sqlite3_stmt *stmt;
+  gint64 room = 0, start, since = 0, until = 0;
+  gboolean search_db = TRUE;
+  int rc = SQLITE_DONE;
+
+  for (guint i = 0; args[i]; i++) {
+    if (g_str_equal (args[i], "--room") && args[i + 1]) {
+      room_id = args[++i];
+    } else if (g_str_equal (args[i], "--sender") && args[i + 1]) {
+      sender_id = args[++i];
+    } else if (g_str_equal (args[i], "--since") && args[i + 1]) {
+      if (!parse_day (args[++i], FALSE, &since, err))
+        return NULL;
+    } else if (g_str_equal (args[i], "--until") && args[i + 1]) {
+      if (!parse_day (args[++i], TRUE, &until, err))
+        return NULL;
+    } else if (g_str_equal (args[i], "--limit") && args[i + 1]) {
+      if (!g_ascii_string_to_unsigned (args[++i], 10, 1, G_MAXINT, &limit, err))
+        return NULL;
+    } else if (!text) {
+      text = args[i];
+    } else {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown argument '%s'", args[i]);
+      return NULL;
+    }
+  }
+
+  if (!text) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+    return NULL;
+  }
+
+  /* Without a database only imported events are searched */
+  if (!db || (room_id && ev_import_has_room (room_id))) {
+    if (!ev_import_get_n_events () && !check_db (err))
+      return NULL;
+    search_db = FALSE;
+  }
+
+  if (search_db && room_id && !lookup_room (room_id, &room, err))
+    return NULL;
+
+  start = g_get_monotonic_time ();
+  db_hits = g_ptr_array_new_with_free_func ((GDestroyNotify) ev_db_search_hit_free);
+  import_hits = g_ptr_array_new_with_free_func ((GDestroyNotify) ev_db_search_hit_free);
+  if (!search_db) {
+    ev_import_search (import_hits, text, room_id, sender_id, since, until, NULL, limit);
+    goto merge;
+  }
+
+  stmt = prepare ("SELECT rooms.room_name, owner.username, "
+                  " e.event_uid, e.origin_server_ts, sender.username, " SQL_BODY
+                  " FROM room_events e "
+                  " JOIN rooms ON e.room_id = rooms.id "
+                  " JOIN accounts ON rooms.account_id = accounts.id "
+                  " JOIN users owner ON accounts.user_id = owner.id "
+                  " LEFT JOIN room_members ON e.sender_id = room_members.id "
+                  " LEFT JOIN users sender ON room_members.user_id = sender.id "
+                  " WHERE (?2 = 0 OR e.room_id = ?2) "
+                  " AND (?3 IS NULL OR sender.username = ?3) "
+                  " AND (?4 = 0 OR e.origin_server_ts >= ?4) "
+                  " AND (?5 = 0 OR e.origin_server_ts < ?5) "
+                  " AND instr (lower (" SQL_BODY "), lower (?1)) > 0 "
+                  " ORDER BY e.origin_server_ts DESC", err);
+  if (!stmt)
+    return NULL;
+
+  sqlite3_bind_text (stmt, 1, text, -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int64 (stmt, 2, room);
+  if (sender_id)
+    sqlite3_bind_text (stmt, 3, sender_id, -1, SQLITE_TRANSIENT);
+  else
+    sqlite3_bind_null (stmt, 3);
+  sqlite3_bind_int64 (stmt, 4, since);
+  sqlite3_bind_int64 (stmt, 5, until);
+  found = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  while (db_hits->len < limit && (rc = sqlite3_step (stmt)) == SQLITE_ROW) {
+    GString *hit;
+
+    if (!account_selected ((const char *) sqlite3_column_text (stmt, 1)))
+      continue;
+
+    hit = g_string_new ((const char *) sqlite3_column_text (stmt, 0));
+    g_string_append_c (hit, '\n');
+    append_event (hit, stmt, 2);
+    g_ptr_array_add (db_hits, ev_db_search_hit_new (sqlite3_column_int64 (stmt, 3), hit));
+    g_hash_table_add (found, g_strdup ((const char *) sqlite3_column_text (stmt, 2)));
+  }
+
+  if (db_hits->len < limit && !step_done (stmt, rc, err)) {
+    sqlite3_finalize (stmt);
+    return NULL;
+  }
+  sqlite3_finalize (stmt);
+
+  /* An export of the same database imported next to it would report
+   * the database's matches again. Duplicates of matches past the limit
+   * are older than all database results so they can't make the cut. */
+  if (!room_id)
+    ev_import_search (import_hits, text, NULL, sender_id, since, until, found, limit);
+
+ merge:
+  /* Both are newest first */
+  while (n_results < limit && (i < db_hits->len || j < import_hits->len)) {
+    EvDbSearchHit *db_hit = i < db_hits->len ? g_ptr_array_index (db_hits, i) : NULL;
+    EvDbSearchHit *import_hit = j < import_hits->len ? g_ptr_array_index (import_hits, j) : NULL;
+
+    if (db_hit && (!import_hit || db_hit->ts >= import_hit->ts)) {
+      g_string_append (out, db_hit->text);
+      i++;
+    } else {
+      g_string_append (out, import_hit->text);
+      j++;
+    }
+    n_results++;
+  }
+
+  g_string_append_printf (out, "%u results in %" G_GINT64_FORMAT " ms", n_results,
+                          (g_get_monotonic_time () - start) / 1000);
+
+  return g_steal_pointer (&out);
+}
+
+
+typedef enum {
+  EV_DB_JOB_STATS,
+  EV_DB_JOB_MAINTAIN,
+  EV_DB_JOB_QUERY,
+} EvDbJobKind;
+
+typedef struct {
+  const char *name;
+  const char *desc;
+  const char *header;
+  const char *sql;       /* ?1 is the limit, ?2 the room id or NULL */
+  gboolean    event_type; /* First column is a CmEventType */
+} EvDbQuery;
+
+typedef struct {
+  EvDbJobKind      kind;
+  char            *path;
+  char            *action;  /* The maintenance step */
+  const EvDbQuery *query;
+  char            *room;
+  guint64          limit;
+} EvDbJob;
+
+#define SQL_DAY "date (e.origin_server_ts / 1000, 'unixepoch', 'localtime')"
+#define SQL_ROOM_FILTER "(?2 IS NULL OR rooms.room_name = ?2)"
+/* Limited to the selected accounts like the other offline commands */
+#define SQL_ACCOUNT_JOIN "JOIN accounts ON rooms.account_id = accounts.id " \
+                         "JOIN users owner ON accounts.user_id = owner.id "
+#define SQL_ACCOUNT_FILTER "ev_account_selected (owner.username)"
+
+static const EvDbQuery db_queries[] = {
+  {
+    .name = "rooms",
+    .desc = "Largest rooms by stored events",
+    .header = "Room|Events|First|Last",
+    .sql = "SELECT rooms.room_name, COUNT(e.id) AS n, "
+           " date (MIN(e.origin_server_ts) / 1000, 'unixepoch', 'localtime'), "
+           " date (MAX(e.origin_server_ts) / 1000, 'unixepoch', 'localtime') "
+           "FROM rooms LEFT JOIN room_events e ON e.room_id = rooms.id "
+           SQL_ACCOUNT_JOIN
+           "WHERE " SQL_ROOM_FILTER " AND " SQL_ACCOUNT_FILTER " "
+           "GROUP BY rooms.id ORDER BY n DESC LIMIT ?1",
+  },
+  {
+    .name = "daily",
+    .desc = "Events per room per day, newest first",
+    .header = "Room|Day|Events",
+    .sql = "SELECT rooms.room_name, " SQL_DAY " AS day, COUNT(*) AS n "
+           "FROM room_events e JOIN rooms ON e.room_id = rooms.id "
+           SQL_ACCOUNT_JOIN
+           "WHERE " SQL_ROOM_FILTER " AND " SQL_ACCOUNT_FILTER " "
+           "GROUP BY rooms.id, day ORDER BY day DESC, n DESC LIMIT ?1",
+  },
+  {
+    .name = "senders",
+    .desc = "Most active senders",
+    .header = "Sender|Events|Rooms",
+    .sql = "SELECT IFNULL (users.username, '?'), COUNT(*) AS n, COUNT(DISTINCT e.room_id) "
+           "FROM room_events e JOIN rooms ON e.room_id = rooms.id "
+           SQL_ACCOUNT_JOIN
+           "LEFT JOIN room_members ON e.sender_id = room_members.id "
+           "LEFT JOIN users ON room_members.user_id = users.id "
+           "WHERE " SQL_ROOM_FILTER " AND " SQL_ACCOUNT_FILTER " "
+           "GROUP BY users.id ORDER BY n DESC LIMIT ?1",
+  },
+  {
+    .name = "types",
+    .desc = "Stored events by type",
+    .header = "Type|Events",
+    .sql = "SELECT e.event_type, COUNT(*) AS n "
+           "FROM room_events e JOIN rooms ON e.room_id = rooms.id "
+           SQL_ACCOUNT_JOIN
+           "WHERE " SQL_ROOM_FILTER " AND " SQL_ACCOUNT_FILTER " "
+           "GROUP BY e.event_type ORDER BY n DESC LIMIT ?1",
+    .event_type = TRUE,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static void
+db_job_free (EvDbJob *job)
+{
+  g_free (job->path);
+  g_free (job->action);
+  g_free (job->room);
+  g_free (job);
+}
+
+
+static goffset
+get_file_size (const char *path)
+{
+  GStatBuf st;
+
+  if (g_stat (path, &st) < 0)
+    return 0;
+
+  return st.st_size;
+}
+
+
+static gboolean
+exec_int64 (sqlite3 *conn, const char *sql, gint64 *value, GError **err)
+{
+  sqlite3_stmt *stmt = NULL;
+  int rc;
+
+  if (sqlite3_prepare_v2 (conn, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "'%s' failed: %s", sql, sqlite3_errmsg (conn));
+    return FALSE;
+  }
+
+  rc = sqlite3_step (stmt);
+  if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "'%s' failed: %s", sql, sqlite3_errmsg (conn));
+    sqlite3_finalize (stmt);
+    return FALSE;
+  }
+
+  *value = rc == SQLITE_ROW ? sqlite3_column_int64 (stmt, 0) : 0;
+  sqlite3_finalize (stmt);
+
+  return TRUE;
+}
+
+
+static sqlite3 *
+open_connection (const char *path, int flags, GError **err)
+{
+  sqlite3 *conn = NULL;
+  int rc;
+
+  rc = sqlite3_open_v2 (path, &conn, flags, NULL);
+  if (rc != SQLITE_OK) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to open %s: %s",
+                 path, conn ? sqlite3_errmsg (conn) : sqlite3_errstr (rc));
+    g_clear_pointer (&conn, sqlite3_close);
+    return NULL;
+  }
+
+  /* libcmatrix holds its own connection, wait for it rather than failing */
+  sqlite3_busy_timeout (conn, DB_BUSY_TIMEOUT);
+
+  return conn;
+}
+
+
+static GString *
+collect_stats (const char *path, GError **err)
+{
+  g_autoptr (GString) out = g_string_new ("");
+  g_autoptr (GPtrArray) tables = g_ptr_array_new_with_free_func (g_free);
+  g_autofree char *wal = g_strdup_printf ("%s-wal", path);
+  gint64 page_size, page_count, freelist;
+  sqlite3_stmt *stmt = NULL;
+  sqlite3 *conn;
+  int rc;
+
+  conn = open_connection (path, SQLITE_OPEN_READONLY, err);
+  if (!conn)
+    return NULL;
+
+  if (!exec_int64 (conn, "PRAGMA page_size", &page_size, err) ||
+      !exec_int64 (conn, "PRAGMA page_count", &page_count, err) ||
+      !exec_int64 (conn, "PRAGMA freelist_count", &freelist, err)) {
+    sqlite3_close (conn);
+    return NULL;
+  }
+
+  g_string_append_printf (out, "%*sFile: %s\n", INFO_INDENT, "", path);
+  g_string_append_printf (out, "%*sSize: %" G_GOFFSET_FORMAT " bytes, WAL %" G_GOFFSET_FORMAT " bytes\n",
+                          INFO_INDENT, "", get_file_size (path), get_file_size (wal));
+  g_string_append_printf (out, "%*sPages: %" G_GINT64_FORMAT " of %" G_GINT64_FORMAT " bytes, "
+                          "%" G_GINT64_FORMAT " free (%" G_GINT64_FORMAT " bytes reclaimable)\n",
+                          INFO_INDENT, "", page_count, page_size, freelist, freelist * page_size);
+
+  sqlite3_prepare_v2 (conn, "SELECT name FROM sqlite_master WHERE type = 'table' ORDER BY name",
+                      -1, &stmt, NULL);
+  while (stmt && sqlite3_step (stmt) == SQLITE_ROW)
+    g_ptr_array_add (tables, g_strdup ((const char *) sqlite3_column_text (stmt, 0)));
+  g_clear_pointer (&stmt, sqlite3_finalize);
+
+  g_string_append_printf (out, "\n%*s%-30s  %10s\n", INFO_INDENT, "", "Table", "Rows");
+  for (guint i = 0; i < tables->len; i++) {
+    const char *table = g_ptr_array_index (tables, i);
+    gboolean success;
+    gint64 rows;
+    char *sql;
+
+    /* Table names come from the schema, quote them anyway */
+    sql = sqlite3_mprintf ("SELECT COUNT(*) FROM \"%w\"", table);
+    success = exec_int64 (conn, sql, &rows, err);
+    sqlite3_free (sql);
+    if (!success) {
+      sqlite3_close (conn);
+      return NULL;
+    }
+
+    g_string_append_printf (out, "%*s%-30s  %10" G_GINT64_FORMAT "\n", INFO_INDENT, "", table, rows);
+  }
+
+  rc = sqlite3_prepare_v2 (conn,
+                           "SELECT rooms.room_name, COUNT(room_events.id) AS n FROM rooms "
+                           "LEFT JOIN room_events ON room_events.room_id = rooms.id "
+                           "GROUP BY rooms.id ORDER BY n DESC LIMIT " G_STRINGIFY (DB_STATS_TOP_ROOMS),
+                           -1, &stmt, NULL);
+  /* Not a libcmatrix database, the generic stats are still useful */
+  if (rc == SQLITE_OK) {
+    g_string_append_printf (out, "\n%*s%-50s  %10s\n", INFO_INDENT, "", "Room", "Events");
+    while (sqlite3_step (stmt) == SQLITE_ROW) {
+      g_string_append_printf (out, "%*s%-50s  %10" G_GINT64_FORMAT "\n", INFO_INDENT, "",
+                              (const char *) sqlite3_column_text (stmt, 0),
+                              (gint64) sqlite3_column_int64 (stmt, 1));
+    }
+  }
+  g_clear_pointer (&stmt, sqlite3_finalize);
+
+  sqlite3_close (conn);
+
+  return g_steal_pointer (&out);
+}
+
+
+static GString *
+maintain (const char *path, const char *action, GError **err)
+{
+  g_autofree char *wal = g_strdup_printf ("%s-wal", path);
+  goffset before, after;
+  char *errmsg = NULL;
+  const char *sql;
+  sqlite3 *conn;
+
+  if (g_str_equal (action, "vacuum"))
+    sql = "VACUUM";
+  else if (g_str_equal (action, "analyze"))
+    sql = "ANALYZE";
+  else
+    sql = "PRAGMA wal_checkpoint(TRUNCATE)";
+
+  conn = open_connection (path, SQLITE_OPEN_READWRITE, err);
+  if (!conn)
+    return NULL;
+
+  before = get_file_size (path) + get_file_size (wal);
+  if (sqlite3_exec (conn, sql, NULL, NULL, &errmsg) != SQLITE_OK) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "%s failed: %s", action, errmsg);
+    sqlite3_free (errmsg);
+    sqlite3_close (conn);
+    return NULL;
+  }
+  sqlite3_close (conn);
+  after = get_file_size (path) + get_file_size (wal);
+
+  return g_string_new_take (g_strdup_printf ("%" G_GOFFSET_FORMAT " bytes before, %" G_GOFFSET_FORMAT
+                                             " after, %" G_GOFFSET_FORMAT " reclaimed",
+                                             before, after, before - after));
+}
+
+
+static void
+append_row (GString *out, sqlite3_stmt *stmt, gboolean event_type)
+{
+  int n_cols = sqlite3_column_count (stmt);
+
+  g_string_append_printf (out, "%*s", INFO_INDENT, "");
+  for (int i = 0; i < n_cols; i++) {
+    const char *text = (const char *) sqlite3_column_text (stmt, i);
+    g_autofree char *nick = NULL;
+
+    if (i == 0 && event_type) {
+      g_autoptr (GEnumClass) klass = g_type_class_ref (CM_TYPE_EVENT_TYPE);
+      GEnumValue *value = g_enum_get_value (klass, sqlite3_column_int (stmt, 0));
+
+      nick = value ? g_strdup (value->value_nick) : g_strdup (text);
+      text = nick;
+    }
+
+    if (i == 0)
+      g_string_append_printf (out, "%-50s", text ?: "");
+    else
+      g_string_append_printf (out, "  %12s", text ?: "");
+  }
+  g_string_append_c (out, '\n');
+}
+
+
+static gboolean
+print_chunk (gpointer user_data)
+{
+  ev_prompt_print ("%s", (const char *) user_data);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Hands rows to the main thread as they come in */
+static void
+flush_rows (GString *rows)
+{
+  if (!rows->len)
+    return;
+
+  g_idle_add_full (G_PRIORITY_DEFAULT, print_chunk, g_strdup (rows->str), g_free);
+  g_string_truncate (rows, 0);
+}
+
+
+static void
+sql_account_selected (sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  const char *user_id = (const char *) sqlite3_value_text (argv[0]);
+
+  sqlite3_result_int (ctx, user_id && account_selected (user_id));
+}
+
+
+static GString *
+run_query (EvDbJob *job, GError **err)
+{
+  g_autoptr (GString) rows = g_string_new ("");
+  g_auto (GStrv) columns = g_strsplit (job->query->header, "|", -1);
+  sqlite3_stmt *stmt = NULL;
+  guint n_rows = 0;
+  sqlite3 *conn;
+  int rc;
+
+  conn = open_connection (job->path, SQLITE_OPEN_READONLY, err);
+  if (!conn)
+    return NULL;
+
+  sqlite3_create_function (conn, "ev_account_selected", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC,
+                           NULL, sql_account_selected, NULL, NULL);
+
+  if (sqlite3_prepare_v2 (conn, job->query->sql, -1, &stmt, NULL) != SQLITE_OK) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Query failed: %s", sqlite3_errmsg (conn));
+    sqlite3_close (conn);
+    return NULL;
+  }
+
+  sqlite3_bind_int64 (stmt, 1, job->limit);
+  if (job->room)
+    sqlite3_bind_text (stmt, 2, job->room, -1, SQLITE_TRANSIENT);
+  else
+    sqlite3_bind_null (stmt, 2);
+
+  g_string_append_printf (rows, "%*s%-50s", INFO_INDENT, "", columns[0]);
+  for (guint i = 1; columns[i]; i++)
+    g_string_append_printf (rows, "  %12s", columns[i]);
+  g_string_append_c (rows, '\n');
+
+  while ((rc = sqlite3_step (stmt)) == SQLITE_ROW) {
+    append_row (rows, stmt, job->query->event_type);
+    if (++n_rows % DB_STREAM_ROWS == 0)
+      flush_rows (rows);
+  }
+  flush_rows (rows);
+
+  if (rc != SQLITE_DONE) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Query failed: %s", sqlite3_errmsg (conn));
+    sqlite3_finalize (stmt);
+    sqlite3_close (conn);
+    return NULL;
+  }
+
+  sqlite3_finalize (stmt);
+  sqlite3_close (conn);
+
+  return g_string_new_take (g_strdup_printf ("%u rows", n_rows));
+}
+
+
+static void
+string_free (GString *str)
+{
+  g_string_free (str, TRUE);
+}
+
+
+static void
+db_job_thread (GTask        *task,
+               gpointer      source_object,
+               gpointer      task_data,
+               GCancellable *cancellable)
+{
+  EvDbJob *job = task_data;
+  GError *err = NULL;
+  GString *out;
+
+  switch (job->kind) {
+  case EV_DB_JOB_STATS:
+    out = collect_stats (job->path, &err);
+    break;
+  case EV_DB_JOB_MAINTAIN:
+    out = maintain (job->path, job->action, &err);
+    break;
+  case EV_DB_JOB_QUERY:
+    out = run_query (job, &err);
+    break;
+  default:
+    g_assert_not_reached ();
+  }
+
+  if (!out) {
+    g_task_return_error (task, err);
+    return;
+  }
+
+  g_task_return_pointer (task, out, (GDestroyNotify) string_free);
+}
+
+
+static void
+on_db_job_done (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+  EvDbJob *job = g_task_get_task_data (G_TASK (result));
+  gint64 started = GPOINTER_TO_SIZE (user_data);
+  g_autoptr (GString) out = NULL;
+  g_autoptr (GError) err = NULL;
+  double duration = (double) (g_get_monotonic_time () - started) / G_USEC_PER_SEC;
+
+  db_job_running = FALSE;
+
+  out = g_task_propagate_pointer (G_TASK (result), &err);
+  if (!out) {
+    ev_prompt_print ("Database %s failed after %.1f s: %s\n",
+                     job->action ?: job->query ? job->query->name : "stats",
+                     duration, err->message);
+    return;
+  }
+
+  switch (job->kind) {
+  case EV_DB_JOB_STATS:
+    ev_prompt_print ("%s%*sCollected in %.1f s\n", out->str, INFO_INDENT, "", duration);
+    break;
+  case EV_DB_JOB_MAINTAIN:
+    ev_prompt_print ("Database %s done in %.1f s: %s\n", job->action, duration, out->str);
+    break;
+  case EV_DB_JOB_QUERY:
+    ev_prompt_print ("%*s%s in %.1f s\n", INFO_INDENT, "", out->str, duration);
+    break;
+  default:
+    g_assert_not_reached ();
+  }
+}
+
+/* Runs on a worker thread with its own connection so sync isn't blocked */
+static gboolean
+run_db_job (EvDbJob *job, GError **err)
+{
+  g_autoptr (GTask) task = NULL;
+
+  if (db_job_running) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_BUSY, "A database job is already running");
+    db_job_free (job);
+    return FALSE;
+  }
+
+  if (!g_file_test (db_path, G_FILE_TEST_IS_REGULAR)) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No database at %s", db_path);
+    db_job_free (job);
+    return FALSE;
+  }
+
+  job->path = g_strdup (db_path);
+
+  db_job_running = TRUE;
+  task = g_task_new (NULL, NULL, on_db_job_done, GSIZE_TO_POINTER (g_get_monotonic_time ()));
+  g_task_set_task_data (task, job, (GDestroyNotify) db_job_free);
+  g_task_run_in_thread (task, db_job_thread);
+
+  return TRUE;
+}
+
+
+static GString *
+ev_db_stats (GStrv args, GError **err)
+{
+  EvDbJob *job;
+
+  if (args[0]) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown argument '%s'", args[0]);
+    return NULL;
+  }
+
+  job = g_new0 (EvDbJob, 1);
+  job->kind = EV_DB_JOB_STATS;
+  if (!run_db_job (job, err))
+    return NULL;
+
+  return g_string_new ("Collecting database stats");
+}
+
+
+static GString *
+ev_db_maintain (GStrv args, GError **err)
+{
+  const char *actions[] = { "vacuum", "analyze", "checkpoint", NULL };
+  EvDbJob *job;
+
+  if (g_strv_length (args) != 1 || !g_strv_contains (actions, args[0])) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Need one of vacuum, analyze or checkpoint");
+    return NULL;
+  }
+
+  job = g_new0 (EvDbJob, 1);
+  job->kind = EV_DB_JOB_MAINTAIN;
+  job->action = g_strdup (args[0]);
+  if (!run_db_job (job, err))
+    return NULL;
+
+  return g_string_new_take (g_strdup_printf ("Running %s on %s", args[0], db_path));
+}
+
+
+static GString *
+ev_db_stats_db (GStrv args, GError **err)
+{
+  const EvDbQuery *query = NULL;
+  g_autofree char *room = NULL;
+  guint64 limit = DB_DEFAULT_RESULTS;
+  EvDbJob *job;
+
+  if (!args[0]) {
+    g_autoptr (GString) out = g_string_new ("");
+
+    for (int i = 0; db_queries[i].name; i++)
+      g_string_append_printf (out, "%*s%-10s %s\n", INFO_INDENT, "", db_queries[i].name, db_queries[i].desc);
+    return g_steal_pointer (&out);
+  }
+
+  for (int i = 0; db_queries[i].name; i++) {
+    if (g_str_equal (db_queries[i].name, args[0]))
+      query = &db_queries[i];
+  }
+  if (!query) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Unknown query '%s'", args[0]);
+    return NULL;
+  }
+
+  for (guint i = 1; args[i]; i++) {
+    if (g_str_equal (args[i], "--room") && args[i + 1]) {
+      g_free (room);
+      room = g_strdup (args[++i]);
+    } else if (g_str_equal (args[i], "--limit") && args[i + 1]) {
+      if (!g_ascii_string_to_unsigned (args[++i], 10, 1, G_MAXINT, &limit, err))
+        return NULL;
+    } else {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown argument '%s'", args[i]);
+      return NULL;
+    }
+  }
+
+  job = g_new0 (EvDbJob, 1);
+  job->kind = EV_DB_JOB_QUERY;
+  job->query = query;
+  job->room = g_steal_pointer (&room);
+  job->limit = limit;
+  if (!run_db_job (job, err))
+    return NULL;
+
+  return g_string_new_take (g_strdup_printf ("Running query '%s'", query->name));
+}
+
+
+static GStrv
+db_stats_db_opt_get_completion (const char *word, int pos)
+{
+  g_autoptr (GStrvBuilder) builder = g_strv_builder_new ();
+
+  for (int i = 0; db_queries[i].name; i++) {
+    if (strncmp (db_queries[i].name, word, pos) == 0)
+      g_strv_builder_add (builder, db_queries[i].name);
+  }
+
+  return g_strv_builder_end (builder);
+}
+
+
+static GStrv
+db_maintain_opt_get_completion (const char *word, int pos)
+{
+  const char *actions[] = { "vacuum", "analyze", "checkpoint", NULL };
+  g_autoptr (GStrvBuilder) builder = g_strv_builder_new ();
+
+  for (int i = 0; actions[i]; i++) {
+    if (strncmp (actions[i], word, pos) == 0)
+      g_strv_builder_add (builder, actions[i]);
+  }
+
+  return g_strv_builder_end (builder);
+}
+
+
+/*
+ * Export: Pages through the stored events room by room in timeline
+ * order (sorted_id, like /room-events) on a worker thread and writes
+ * them as NDJSON through a gzip compressor. Only one
+ * page is in flight so memory stays bounded and a slow disk throttles
+ * the queries. The output consists of several gzip members, after each
+ * one the position is checkpointed so an interrupted export continues
+ * from there.
+ */
+
+/* Position in the export, rows are ordered by these */
+typedef struct {
+  gint64 room;
+  gint64 sorted_id;
+  gint64 id;
+} EvExportKey;
+
+typedef struct {
+  char          *path;
+  char          *state_path;
+  char          *room;      /* %NULL for all rooms */
+  char          *account;   /* %NULL for all selected accounts */
+  char          *db_path;
+  sqlite3       *conn;      /* Only used on the worker thread */
+  gint64         room_row;
+
+  GFileIOStream *file;
+  GOutputStream *gz;        /* The current gzip member */
+  goffset        offset;    /* End of the last complete member */
+  EvExportKey    last;      /* Last exported event */
+  guint64        n_events;
+  guint64        n_member_events;
+  guint64        n_resumed;
+  guint64        raw_size;
+  gint64         started;
+  gboolean       done;
+} EvExport;
+
+typedef struct {
+  GBytes      *data;
+  EvExportKey  last;
+  guint        n_rows;
+  guint        n_events;  /* Rows of selected accounts */
+} EvExportPage;
+
+static EvExport *export;
+
+static void export_fetch_page (EvExport *self);
+
+
+static void
+ev_export_free (EvExport *self)
+{
+  g_clear_pointer (&self->conn, sqlite3_close);
+  g_clear_object (&self->gz);
+  if (self->file)
+    g_io_stream_close (G_IO_STREAM (self->file), NULL, NULL);
+  g_clear_object (&self->file);
+  g_free (self->path);
+  g_free (self->state_path);
+  g_free (self->room);
+  g_free (self->account);
+  g_free (self->db_path);
+  g_free (self);
+}
+
+
+static gboolean
+export_account_selected (EvExport *self, const char *user_id)
+{
+  if (self->account && g_strcmp0 (self->account, user_id) != 0)
+    return FALSE;
+
+  return account_selected (user_id);
+}
+
+
+static void
+export_page_free (EvExportPage *page)
+{
+  g_bytes_unref (page->data);
+  g_free (page);
+}
+
+/* Runs on the worker thread */
+static gboolean
+export_open (EvExport *self, GError **err)
+{
+  g_autoptr (GFile) file = g_file_new_for_path (self->path);
+
+  self->conn = open_connection (self->db_path, SQLITE_OPEN_READONLY, err);
+  if (!self->conn)
+    return FALSE;
+
+  if (self->room) {
+    g_autoptr (GStrvBuilder) owners = g_strv_builder_new ();
+    g_auto (GStrv) matches = NULL;
+    sqlite3_stmt *stmt = NULL;
+
+    if (sqlite3_prepare_v2 (self->conn,
+                            "SELECT rooms.id, users.username FROM rooms "
+                            "JOIN accounts ON rooms.account_id = accounts.id "
+                            "JOIN users ON accounts.user_id = users.id "
+                            "WHERE rooms.room_name = ?1", -1, &stmt, NULL) != SQLITE_OK) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Query failed: %s", sqlite3_errmsg (self->conn));
+      return FALSE;
+    }
+    sqlite3_bind_text (stmt, 1, self->room, -1, SQLITE_TRANSIENT);
+    while (sqlite3_step (stmt) == SQLITE_ROW) {
+      const char *owner = (const char *) sqlite3_column_text (stmt, 1);
+
+      if (!export_account_selected (self, owner))
+        continue;
+
+      self->room_row = sqlite3_column_int64 (stmt, 0);
+      g_strv_builder_add (owners, owner);
+    }
+    sqlite3_finalize (stmt);
+
+    matches = g_strv_builder_end (g_steal_pointer (&owners));
+    if (!matches[0]) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", self->room);
+      return FALSE;
+    }
+    /* Each account keeps its own copy of a shared room */
+    if (matches[1]) {
+      g_autofree char *list = g_strjoinv (", ", matches);
+
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Room %s is stored for %s, pick one with --account", self->room, list);
+      return FALSE;
+    }
+  }
+
+  if (!self->offset) {
+    self->file = g_file_replace_readwrite (file, NULL, FALSE, G_FILE_CREATE_NONE, NULL, err);
+    return !!self->file;
+  }
+
+  /* Drop the partial member of an interrupted run */
+  self->file = g_file_open_readwrite (file, NULL, err);
+  if (!self->file)
+    return FALSE;
+
+  return g_seekable_truncate (G_SEEKABLE (self->file), self->offset, NULL, err) &&
+    g_seekable_seek (G_SEEKABLE (self->file), self->offset, G_SEEK_SET, NULL, err);
+}
+
+
+static void
+export_fetch_thread (GTask        *task,
+                     gpointer      source_object,
+                     gpointer      task_data,
+                     GCancellable *cancellable)
+{
+  EvExport *self = task_data;
+  g_autoptr (GString) lines = NULL;
+  EvExportPage *page;
+  sqlite3_stmt *stmt = NULL;
+  GError *err = NULL;
+  int rc;
+
+  if (!self->conn && !export_open (self, &err)) {
+    g_task_return_error (task, err);
+    return;
+  }
+
+  if (sqlite3_prepare_v2 (self->conn,
+                          "SELECT e.room_id, e.sorted_id, e.id, owner.username, json_object ("
+                          " 'account', owner.username, "
+                          " 'room_id', rooms.room_name, "
+                          " 'event_id', e.event_uid, "
+                          " 'sender', sender.username, "
+                          " 'origin_server_ts', e.origin_server_ts, "
+                          " 'event', CASE WHEN json_valid (e.json_data) THEN json (e.json_data) END) "
+                          "FROM room_events e "
+                          "JOIN rooms ON e.room_id = rooms.id "
+                          "JOIN accounts ON rooms.account_id = accounts.id "
+                          "JOIN users owner ON accounts.user_id = owner.id "
+                          "LEFT JOIN room_members ON e.sender_id = room_members.id "
+                          "LEFT JOIN users sender ON room_members.user_id = sender.id "
+                          "WHERE (e.room_id, e.sorted_id, e.id) > (?1, ?2, ?3) "
+                          "AND (?4 = 0 OR e.room_id = ?4) "
+                          "ORDER BY e.room_id, e.sorted_id, e.id LIMIT ?5", -1, &stmt, NULL) != SQLITE_OK) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Query failed: %s",
+                             sqlite3_errmsg (self->conn));
+    return;
+  }
+
+  page = g_new0 (EvExportPage, 1);
+  page->last = self->last;
+  lines = g_string_sized_new (EXPORT_PAGE_EVENTS * 512);
+
+  sqlite3_bind_int64 (stmt, 1, self->last.room);
+  sqlite3_bind_int64 (stmt, 2, self->last.sorted_id);
+  sqlite3_bind_int64 (stmt, 3, self->last.id);
+  sqlite3_bind_int64 (stmt, 4, self->room_row);
+  sqlite3_bind_int (stmt, 5, EXPORT_PAGE_EVENTS);
+  while ((rc = sqlite3_step (stmt)) == SQLITE_ROW) {
+    page->last.room = sqlite3_column_int64 (stmt, 0);
+    page->last.sorted_id = sqlite3_column_int64 (stmt, 1);
+    page->last.id = sqlite3_column_int64 (stmt, 2);
+    page->n_rows++;
+
+    if (!export_account_selected (self, (const char *) sqlite3_column_text (stmt, 3)))
+      continue;
+
+    g_string_append_len (lines, (const char *) sqlite3_column_text (stmt, 4),
+                         sqlite3_column_bytes (stmt, 4));
+    g_string_append_c (lines, '\n');
+    page->n_events++;
+  }
+
+  if (rc != SQLITE_DONE) {
+    g_task_return_new_error (task, G_IO_ERROR, G_IO_ERROR_FAILED, "Query failed: %s",
+                             sqlite3_errmsg (self->conn));
+    sqlite3_finalize (stmt);
+    export_page_free (page);
+    return;
+  }
+  sqlite3_finalize (stmt);
+
+  page->data = g_string_free_to_bytes (g_steal_pointer (&lines));
+  g_task_return_pointer (task, page, (GDestroyNotify) export_page_free);
+}
+
+
+static void
+export_fail (EvExport *self, GError *err)
+{
+  ev_prompt_print ("Export to %s failed after %" G_GUINT64_FORMAT " events: %s\n",
+                   self->path, self->n_events, err->message);
+  if (self->offset)
+    ev_prompt_print ("Run the same /export again to resume\n");
+
+  g_clear_pointer (&export, ev_export_free);
+}
+
+
+static void
+export_done (EvExport *self)
+{
+  g_autoptr (GError) err = NULL;
+  g_autofree char *raw = g_format_size (self->raw_size);
+  g_autofree char *compressed = g_format_size (self->offset);
+  double duration = (double) (g_get_monotonic_time () - self->started) / G_USEC_PER_SEC;
+  guint64 n_new = self->n_events - self->n_resumed;
+
+  if (g_unlink (self->state_path) < 0 && errno != ENOENT)
+    g_warning ("Failed to remove %s: %s", self->state_path, g_strerror (errno));
+
+  ev_prompt_print ("Exported %" G_GUINT64_FORMAT " events to %s in %.1f s (%.0f events/s)\n"
+                   "%*s%s of JSON compressed to %s, ratio %.1f\n",
+                   n_new, self->path, duration, duration > 0 ? n_new / duration : 0.0,
+                   INFO_INDENT, "", raw, compressed,
+                   self->offset ? (double) self->raw_size / self->offset : 0.0);
+
+  g_clear_pointer (&export, ev_export_free);
+}
+
+
+static gboolean
+export_save_state (EvExport *self, GError **err)
+{
+  g_autoptr (GKeyFile) keyfile = g_key_file_new ();
+
+  g_key_file_set_string (keyfile, "export", "room", self->room ?: "");
+  g_key_file_set_int64 (keyfile, "export", "offset", self->offset);
+  g_key_file_set_string (keyfile, "export", "account", self->account ?: "");
+  g_key_file_set_int64 (keyfile, "export", "last-room", self->last.room);
+  g_key_file_set_int64 (keyfile, "export", "last-sorted-id", self->last.sorted_id);
+  g_key_file_set_int64 (keyfile, "export", "last-id", self->last.id);
+  g_key_file_set_uint64 (keyfile, "export", "events", self->n_events);
+  g_key_file_set_uint64 (keyfile, "export", "raw-size", self->raw_size);
+
+  return g_key_file_save_to_file (keyfile, self->state_path, err);
+}
+
+
+static void
+on_export_member_closed (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  EvExport *self = user_data;
+  g_autoptr (GError) err = NULL;
+  double duration;
+
+  if (!g_output_stream_close_finish (G_OUTPUT_STREAM (source_object), res, &err)) {
+    export_fail (self, err);
+    return;
+  }
+  g_clear_object (&self->gz);
+  self->n_member_events = 0;
+  self->offset = g_seekable_tell (G_SEEKABLE (self->file));
+
+  if (self->done) {
+    export_done (self);
+    return;
+  }
+
+  if (!export_save_state (self, &err)) {
+    export_fail (self, err);
+    return;
+  }
+
+  duration = (double) (g_get_monotonic_time () - self->started) / G_USEC_PER_SEC;
+  ev_prompt_print ("Exported %" G_GUINT64_FORMAT " events to %s, %.0f events/s\n",
+                   self->n_events, self->path,
+                   duration > 0 ? (self->n_events - self->n_resumed) / duration : 0.0);
+
+  export_fetch_page (self);
+}
+
+
+static void
+on_export_page_written (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  EvExportPage *page = user_data;
+  g_autoptr (GError) err = NULL;
+  EvExport *self = export;
+
+  if (!g_output_stream_write_all_finish (G_OUTPUT_STREAM (source_object), res, NULL, &err)) {
+    export_page_free (page);
+    export_fail (self, err);
+    return;
+  }
+
+  self->last = page->last;
+  self->n_events += page->n_events;
+  self->n_member_events += page->n_events;
+  self->raw_size += g_bytes_get_size (page->data);
+  export_page_free (page);
+
+  if (self->n_member_events >= EXPORT_MEMBER_EVENTS) {
+    g_output_stream_close_async (self->gz, G_PRIORITY_DEFAULT, NULL, on_export_member_closed, self);
+    return;
+  }
+
+  export_fetch_page (self);
+}
+
+
+static void
+on_export_page_fetched (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  EvExport *self = user_data;
+  g_autoptr (GError) err = NULL;
+  g_autoptr (GZlibCompressor) compressor = NULL;
+  EvExportPage *page;
+  gsize size;
+  gconstpointer data;
+
+  page = g_task_propagate_pointer (G_TASK (res), &err);
+  if (!page) {
+    export_fail (self, err);
+    return;
+  }
+
+  /* Only events of other accounts */
+  if (page->n_rows && !page->n_events) {
+    self->last = page->last;
+    export_page_free (page);
+    export_fetch_page (self);
+    return;
+  }
+
+  if (!page->n_rows) {
+    export_page_free (page);
+    self->done = TRUE;
+    if (self->gz)
+      g_output_stream_close_async (self->gz, G_PRIORITY_DEFAULT, NULL, on_export_member_closed, self);
+    else
+      export_done (self);
+    return;
+  }
+
+  if (!self->gz) {
+    compressor = g_zlib_compressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP, -1);
+    self->gz = g_converter_output_stream_new (g_io_stream_get_output_stream (G_IO_STREAM (self->file)),
+                                              G_CONVERTER (compressor));
+    /* Members are closed individually, the file stays open */
+    g_filter_output_stream_set_close_base_stream (G_FILTER_OUTPUT_STREAM (self->gz), FALSE);
+  }
+
+  data = g_bytes_get_data (page->data, &size);
+  g_output_stream_write_all_async (self->gz, data, size, G_PRIORITY_DEFAULT, NULL,
+                                   on_export_page_written, page);
+}
+
+
+static void
+export_fetch_page (EvExport *self)
+{
+  g_autoptr (GTask) task = g_task_new (NULL, NULL, on_export_page_fetched, self);
+
+  g_task_set_task_data (task, self, NULL);
+  g_task_run_in_thread (task, export_fetch_thread);
+}
+
+
+static gboolean
+export_load_state (EvExport *self, GError **err)
+{
+  g_autoptr (GKeyFile) keyfile = g_key_file_new ();
+  g_autofree char *room = NULL;
+  g_autofree char *account = NULL;
+
+  if (!g_key_file_load_from_file (keyfile, self->state_path, G_KEY_FILE_NONE, NULL))
+    return TRUE;
+
+  room = g_key_file_get_string (keyfile, "export", "room", NULL);
+  account = g_key_file_get_string (keyfile, "export", "account", NULL);
+  if (g_strcmp0 (room, self->room ?: "") != 0 || g_strcmp0 (account, self->account ?: "") != 0) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                 "%s holds an unfinished export of %s%s%s", self->path,
+                 room && *room ? room : "all rooms",
+                 account && *account ? " for " : "", account ?: "");
+    return FALSE;
+  }
+
+  self->offset = g_key_file_get_int64 (keyfile, "export", "offset", NULL);
+  self->last.room = g_key_file_get_int64 (keyfile, "export", "last-room", NULL);
+  self->last.sorted_id = g_key_file_get_int64 (keyfile, "export", "last-sorted-id", NULL);
+  self->last.id = g_key_file_get_int64 (keyfile, "export", "last-id", NULL);
+  self->n_events = g_key_file_get_uint64 (keyfile, "export", "events", NULL);
+  self->raw_size = g_key_file_get_uint64 (keyfile, "export", "raw-size", NULL);
+  self->n_resumed = self->n_events;
+
+  return TRUE;
+}
+
+
+static GString *
+ev_db_export (GStrv args, GError **err)
+{
+  const char *account = NULL;
+  EvExport *self;
+
+  if (g_strv_length (args) < 2) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Need a room id or --all and a path");
+    return NULL;
+  }
+
+  for (guint i = 2; args[i]; i++) {
+    if (g_str_equal (args[i], "--account") && args[i + 1]) {
+      account = args[++i];
+    } else {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown argument '%s'", args[i]);
+      return NULL;
+    }
+  }
+
+  if (export) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_BUSY, "Already exporting to %s", export->path);
+    return NULL;
+  }
+
+  if (!g_file_test (db_path, G_FILE_TEST_IS_REGULAR)) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No database at %s", db_path);
+    return NULL;
+  }
+
+  self = g_new0 (EvExport, 1);
+  self->path = g_strdup (args[1]);
+  self->state_path = g_strdup_printf ("%s.state", args[1]);
+  self->room = g_str_equal (args[0], "--all") ? NULL : g_strdup (args[0]);
+  self->account = g_strdup (account);
+  self->db_path = g_strdup (db_path);
+  self->started = g_get_monotonic_time ();
+
+  if (!export_load_state (self, err)) {
+    ev_export_free (self);
+    return NULL;
+  }
+
+  export = self;
+  export_fetch_page (self);
+
+  if (self->n_resumed)
+    return g_string_new_take (g_strdup_printf ("Resuming export to %s after %" G_GUINT64_FORMAT " events",
+                                               self->path, self->n_resumed));
+
+  return g_string_new_take (g_strdup_printf ("Exporting to %s", self->path));
+}
+
+
+static const EvCmdOpt db_room_opts[] = {
+  {
+    .name = "room-id",
+    .desc = "The id of the room",
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt db_room_events_opts[] = {
+  {
+    .name = "room-id",
+    .desc = "The id of the room to show the events for",
+  },
+  {
+    .name = "count",
+    .desc = "The number of newest events to show, defaults to 20",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt db_search_opts[] = {
+  {
+    .name = "text",
+    .desc = "The text to search for in message bodies, case insensitive",
+  },
+  {
+    .name = "--room",
+    .desc = "Only search the given room",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  {
+    .name = "--sender",
+    .desc = "Only search messages of the given user id",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  {
+    .name = "--since",
+    .desc = "Only search messages from this day (YYYY-MM-DD) on",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  {
+    .name = "--until",
+    .desc = "Only search messages up to and including this day (YYYY-MM-DD)",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  {
+    .name = "--limit",
+    .desc = "The maximum number of results, defaults to 20",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt db_maintain_opts[] = {
+  {
+    .name = "action",
+    .desc = "One of vacuum, analyze or checkpoint",
+    .completer = db_maintain_opt_get_completion,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt db_export_opts[] = {
+  {
+    .name = "room-id",
+    .desc = "The id of the room to export or --all",
+  },
+  {
+    .name = "path",
+    .desc = "The gzip compressed NDJSON file to write, an unfinished export is resumed",
+  },
+  {
+    .name = "--account",
+    .desc = "Only export rooms of the given user id",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt db_stats_db_opts[] = {
+  {
+    .name = "query",
+    .desc = "The query to run, lists the queries when omitted",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+    .completer = db_stats_db_opt_get_completion,
+  },
+  {
+    .name = "--room",
+    .desc = "Only look at the given room",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  {
+    .name = "--limit",
+    .desc = "The maximum number of rows, defaults to 20",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static EvCmd db_maintenance_commands[] = {
+  {
+    .name = "db-stats",
+    .help_summary = N_("Show database size, page usage and row counts"),
+    .func = ev_db_stats,
+  },
+  {
+    .name = "stats-db",
+    .help_summary = N_("Run analytics queries over the stored events"),
+    .func = ev_db_stats_db,
+    .opts = db_stats_db_opts,
+  },
+  {
+    .name = "export",
+    .help_summary = N_("Export stored events as compressed NDJSON"),
+    .func = ev_db_export,
+    .opts = db_export_opts,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+/* Writes to the database, so not offered in offline mode */
+static EvCmd db_online_commands[] = {
+  {
+    .name = "db-maintain",
+    .help_summary = N_("Vacuum, analyze or checkpoint the database"),
+    .func = ev_db_maintain,
+    .opts = db_maintain_opts,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static EvCmd db_commands[] = {
+  {
+    .name = "rooms",
+    .help_summary = N_("List the rooms stored in the database"),
+    .func = ev_db_list_rooms,
+  },
+  {
+    .name = "room-details",
+    .help_summary = N_("Get details about a stored room"),
+    .func = ev_db_room_details,
+    .opts = db_room_opts,
+  },
+  {
+    .name = "room-events",
+    .help_summary = N_("Show the newest stored events of a room"),
+    .func = ev_db_room_events,
+    .opts = db_room_events_opts,
+  },
+  {
+    .name = "search",
+    .help_summary = N_("Search the stored messages"),
+    .func = ev_db_search,
+    .opts = db_search_opts,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+/**
+ * ev_db_add_commands:
+ * @commands: The commands to add to
+ * @offline: Whether to add the commands serving rooms and events instead
+ *   of the ones modifying the database
+ */
+void
+ev_db_add_commands (GPtrArray *commands, gboolean offline)
+{
+  for (int i = 0; offline && db_commands[i].name; i++)
+    g_ptr_array_add (commands, &db_commands[i]);
+
+  for (int i = 0; db_maintenance_commands[i].name; i++)
+    g_ptr_array_add (commands, &db_maintenance_commands[i]);
+
+  for (int i = 0; !offline && db_online_commands[i].name; i++)
+    g_ptr_array_add (commands, &db_online_commands[i]);
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * EvDbSearchHit:
+ * @ts: The time of the event in ms
+ * @text: The formatted result
+ *
+ * A `/search` result. The database and imports collect these so the
+ * results can be merged by time.
+ */
+typedef struct {
+  gint64  ts;
+  char   *text;
+} EvDbSearchHit;
+
+void ev_db_init         (const char         *data_dir,
+                         const char * const *only_accounts,
+                         gboolean            offline);
+void ev_db_destroy      (void);
+void ev_db_add_commands (GPtrArray          *commands,
+                         gboolean            offline);
+
+char *ev_db_format_ts    (gint64              ts);
+void  ev_db_append_event (GString            *out,
+                          gint64              ts,
+                          const char         *sender,
+                          const char         *body,
+                          const char         *event_id);
+
+EvDbSearchHit *ev_db_search_hit_new  (gint64         ts,
+                                      GString       *text);
+void           ev_db_search_hit_free (EvDbSearchHit *hit);
+
+G_END_DECLS
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "ev-config.h"
+
+#include "ev-histogram.h"
+
+#include <string.h>
+
+
+static guint
+get_bucket (gint64 value)
+{
+  guint bucket = 0;
+
+  while (value > 0 && bucket < EV_HISTOGRAM_N_BUCKETS - 1) {
+    value >>= 1;
+    bucket++;
+  }
+
+  return bucket;
+}
+
+
+void
+ev_histogram_add (EvHistogram *self, gint64 value)
+{
+  value = MAX (value, 0);
+
+  if (!self->count || value < self->min)
+    self->min = value;
+  if (!self->count || value > self->max)
+    self->max = value;
+
+  self->buckets[get_bucket (value)]++;
+  self->count++;
+  self->sum += value;
+}
+
+
+void
+ev_histogram_reset (EvHistogram *self)
+{
+  memset (self, 0, sizeof (*self));
+}
+
+/**
+ * ev_histogram_get_percentile:
+ * @self: The histogram
+ * @percentile: The percentile between `0.0` and `100.0`
+ *
+ * As values are bucketed the result is the upper bound of the bucket
+ * holding the percentile, clamped to the observed range.
+ *
+ * Returns: The value at the given percentile
+ */
+gint64
+ev_histogram_get_percentile (EvHistogram *self, double percentile)
+{
+  guint64 rank, seen = 0;
+
+  if (!self->count)
+    return 0;
+
+  rank = (guint64) (self->count * CLAMP (percentile, 0.0, 100.0) / 100.0 + 0.5);
+  rank = CLAMP (rank, 1, self->count);
+
+  for (guint i = 0; i < EV_HISTOGRAM_N_BUCKETS; i++) {
+    seen += self->buckets[i];
+    if (seen >= rank) {
+      gint64 upper = i ? (((gint64) 1 << i) - 1) : 0;
+
+      return CLAMP (upper, self->min, self->max);
+    }
+  }
+
+  return self->max;
+}
+
+
+double
+ev_histogram_get_mean (EvHistogram *self)
+{
+  if (!self->count)
+    return 0.0;
+
+  return (double) self->sum / self->count;
+}
+
+/**
+ * ev_histogram_format:
+ * @self: The histogram
+ * @unit:(nullable): The unit of the values
+ *
+ * Returns: A one line summary of the histogram
+ */
+char *
+ev_histogram_format (EvHistogram *self, const char *unit)
+{
+  if (!self->count)
+    return g_strdup ("no data");
+
+  unit = unit ?: "";
+  return g_strdup_printf ("n=%" G_GUINT64_FORMAT ", mean %.1f%s, p50 %" G_GINT64_FORMAT "%s, p90 %" G_GINT64_FORMAT "%s, "
+                          "p99 %" G_GINT64_FORMAT "%s, max %" G_GINT64_FORMAT "%s",
+                          self->count,
+                          ev_histogram_get_mean (self), unit,
+                          ev_histogram_get_percentile (self, 50), unit,
+                          ev_histogram_get_percentile (self, 90), unit,
+                          ev_histogram_get_percentile (self, 99), unit,
+                          self->max, unit);
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define EV_HISTOGRAM_N_BUCKETS 64
+
+/**
+ * EvHistogram:
+ *
+ * A histogram of non negative values with logarithmic buckets. Bucket
+ * `0` holds `0`, bucket `n` the values in `[2^(n-1), 2^n)`. Zero
+ * initialized memory is an empty histogram.
+ */
+typedef struct {
+  guint64 buckets[EV_HISTOGRAM_N_BUCKETS];
+  guint64 count;
+  gint64  sum;
+  gint64  min;
+  gint64  max;
+} EvHistogram;
+
+void             ev_histogram_add                (EvHistogram    *self,
+                                                  gint64          value);
+void             ev_histogram_reset              (EvHistogram    *self);
+gint64           ev_histogram_get_percentile     (EvHistogram    *self,
+                                                  double          percentile);
+double           ev_histogram_get_mean           (EvHistogram    *self);
+char            *ev_histogram_format             (EvHistogram    *self,
+                                                  const char     *unit);
+
+G_END_DECLS
@@ -0,0 +1,728 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "ev-config.h"
+
+#include "ev-db.h"
+#include "ev-import.h"
+#include "ev-prompt.h"
+
+#include <gio/gio.h>
+#include <gio/gunixoutputstream.h>
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+#include <json-glib/json-glib.h>
+
+#include <string.h>
+
+#define IMPORT_MAX_THREADS  8
+#define IMPORT_CHUNK_SIZE   (256 * 1024)
+
+/**
+ * EvImport:
+ *
+ * Loads the NDJSON written by `/export` so stored history can be looked
+ * at without a homeserver or database. The file is mapped and split at
+ * line boundaries, worker threads index each part by room, sender and
+ * time. Only the fields needed for that get parsed up front, bodies and
+ * the rest of an event are parsed when an event is shown or searched.
+ *
+ * Compressed exports can't be parsed in place, those get inflated into
+ * a temporary file first. That file is mapped and unlinked right away so
+ * it's paged in like an uncompressed export rather than held in memory.
+ */
+
+typedef struct {
+  const char *line;    /* Points into the file's data */
+  guint       length;
+  gint64      ts;      /* ms */
+  const char *room;    /* Interned */
+  const char *sender;  /* Interned, nullable */
+} EvImportEvent;
+
+typedef struct {
+  char    *path;
+  GBytes  *data;
+  GArray  *events;     /* EvImportEvent */
+  guint64  n_invalid;
+  gboolean truncated;
+} EvImportFile;
+
+typedef struct {
+  GHashTable *rooms;   /* room → GPtrArray of EvImportEvent, oldest first */
+  GHashTable *senders; /* sender → GPtrArray of EvImportEvent, oldest first */
+  GPtrArray  *by_time; /* All events, oldest first */
+} EvImportIndex;
+
+typedef struct {
+  EvImportFile  *file;
+  GPtrArray     *files;  /* Including file, not owned */
+  EvImportIndex *index;
+  gint64         started;
+} EvImportJob;
+
+typedef struct {
+  const char *start;
+  const char *end;
+  GArray     *events;
+  guint64     n_invalid;
+} EvImportChunk;
+
+static GPtrArray *imports;
+static EvImportIndex *import_index;
+static gboolean importing;
+
+
+static void
+ev_import_file_free (EvImportFile *file)
+{
+  g_free (file->path);
+  g_clear_pointer (&file->data, g_bytes_unref);
+  g_clear_pointer (&file->events, g_array_unref);
+  g_free (file);
+}
+
+
+static void
+ev_import_index_free (EvImportIndex *self)
+{
+  g_hash_table_unref (self->rooms);
+  g_hash_table_unref (self->senders);
+  g_ptr_array_unref (self->by_time);
+  g_free (self);
+}
+
+
+static void
+ev_import_job_free (EvImportJob *job)
+{
+  g_clear_pointer (&job->file, ev_import_file_free);
+  g_clear_pointer (&job->index, ev_import_index_free);
+  g_ptr_array_unref (job->files);
+  g_free (job);
+}
+
+
+void
+ev_import_destroy (void)
+{
+  g_clear_pointer (&import_index, ev_import_index_free);
+  g_clear_pointer (&imports, g_ptr_array_unref);
+}
+
+
+static JsonObject *
+parse_line (JsonParser *parser, const char *line, gsize length)
+{
+  JsonNode *root;
+
+  if (!json_parser_load_from_data (parser, line, length, NULL))
+    return NULL;
+
+  root = json_parser_get_root (parser);
+  if (!root || !JSON_NODE_HOLDS_OBJECT (root))
+    return NULL;
+
+  return json_node_get_object (root);
+}
+
+
+static JsonObject *
+get_object_member (JsonObject *object, const char *member)
+{
+  JsonNode *node = json_object_get_member (object, member);
+
+  if (!node || !JSON_NODE_HOLDS_OBJECT (node))
+    return NULL;
+
+  return json_node_get_object (node);
+}
+
+
+static const char *
+get_string_member (JsonObject *object, const char *member)
+{
+  JsonNode *node = json_object_get_member (object, member);
+
+  if (!node || json_node_get_value_type (node) != G_TYPE_STRING)
+    return NULL;
+
+  return json_node_get_string (node);
+}
+
+
+static const char *
+get_body (JsonObject *object)
+{
+  JsonObject *event = get_object_member (object, "event");
+  JsonObject *content = event ? get_object_member (event, "content") : NULL;
+
+  return content ? get_string_member (content, "body") : NULL;
+}
+
+
+static gpointer
+index_chunk (gpointer user_data)
+{
+  EvImportChunk *chunk = user_data;
+  g_autoptr (JsonParser) parser = json_parser_new_immutable ();
+  const char *line = chunk->start;
+
+  while (line < chunk->end) {
+    const char *eol = memchr (line, '\n', chunk->end - line);
+    gsize length = (eol ?: chunk->end) - line;
+    EvImportEvent event = { .line = line, .length = length };
+    JsonObject *object;
+    const char *room, *sender;
+
+    line += length + 1;
+    if (!length)
+      continue;
+
+    object = parse_line (parser, event.line, length);
+    room = object ? get_string_member (object, "room_id") : NULL;
+    if (!room) {
+      chunk->n_invalid++;
+      continue;
+    }
+
+    sender = get_string_member (object, "sender");
+    event.room = g_intern_string (room);
+    event.sender = sender ? g_intern_string (sender) : NULL;
+    if (json_object_has_member (object, "origin_server_ts"))
+      event.ts = json_object_get_int_member (object, "origin_server_ts");
+    g_array_append_val (chunk->events, event);
+  }
+
+  return NULL;
+}
+
+/* Exports consist of several gzip members, inflate them all */
+static gboolean
+inflate_to (GBytes *input, GOutputStream *out, gboolean *truncated, GError **err)
+{
+  g_autoptr (GZlibDecompressor) decompressor = g_zlib_decompressor_new (G_ZLIB_COMPRESSOR_FORMAT_GZIP);
+  g_autofree guint8 *buf = g_malloc (IMPORT_CHUNK_SIZE);
+  const guint8 *in;
+  gsize in_size;
+
+  in = g_bytes_get_data (input, &in_size);
+  while (in_size) {
+    g_autoptr (GError) local_err = NULL;
+    GConverterResult res;
+    gsize read = 0, written = 0;
+
+    res = g_converter_convert (G_CONVERTER (decompressor), in, in_size,
+                               buf, IMPORT_CHUNK_SIZE,
+                               G_CONVERTER_INPUT_AT_END, &read, &written, &local_err);
+    if (res == G_CONVERTER_ERROR) {
+      /* An interrupted export, keep what's there */
+      if (g_error_matches (local_err, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT)) {
+        *truncated = TRUE;
+        break;
+      }
+      g_propagate_error (err, g_steal_pointer (&local_err));
+      return FALSE;
+    }
+
+    if (!g_output_stream_write_all (out, buf, written, NULL, NULL, err))
+      return FALSE;
+
+    in += read;
+    in_size -= read;
+
+    if (res == G_CONVERTER_FINISHED)
+      g_converter_reset (G_CONVERTER (decompressor));
+  }
+
+  return g_output_stream_close (out, NULL, err);
+}
+
+
+static GBytes *
+inflate (GBytes *input, gboolean *truncated, GError **err)
+{
+  g_autoptr (GOutputStream) out = NULL;
+  g_autoptr (GMappedFile) mapped = NULL;
+  g_autofree char *tmp_path = NULL;
+  int fd;
+
+  fd = g_file_open_tmp ("ev-import-XXXXXX.ndjson", &tmp_path, err);
+  if (fd < 0)
+    return NULL;
+
+  out = g_unix_output_stream_new (fd, TRUE);
+  if (inflate_to (input, out, truncated, err))
+    mapped = g_mapped_file_new (tmp_path, FALSE, err);
+
+  /* The mapping keeps the content around */
+  g_unlink (tmp_path);
+  if (!mapped)
+    return NULL;
+
+  return g_mapped_file_get_bytes (mapped);
+}
+
+
+static gboolean
+load_file (EvImportFile *file, GError **err)
+{
+  g_autoptr (GMappedFile) mapped = NULL;
+  g_autoptr (GBytes) bytes = NULL;
+  const guint8 *data;
+  gsize size;
+
+  mapped = g_mapped_file_new (file->path, FALSE, err);
+  if (!mapped)
+    return FALSE;
+
+  /* Keeps the mapping alive */
+  bytes = g_mapped_file_get_bytes (mapped);
+  data = g_bytes_get_data (bytes, &size);
+  if (size >= 2 && data[0] == 0x1f && data[1] == 0x8b) {
+    file->data = inflate (bytes, &file->truncated, err);
+    return !!file->data;
+  }
+
+  file->data = g_steal_pointer (&bytes);
+  return TRUE;
+}
+
+
+static void
+index_file (EvImportFile *file)
+{
+  EvImportChunk chunks[IMPORT_MAX_THREADS] = { 0 };
+  GThread *threads[IMPORT_MAX_THREADS] = { NULL };
+  guint n_chunks = CLAMP (g_get_num_processors (), 1, IMPORT_MAX_THREADS);
+  const char *data, *end, *pos;
+  gsize size;
+
+  data = g_bytes_get_data (file->data, &size);
+  end = data + size;
+  n_chunks = MIN (n_chunks, size / IMPORT_CHUNK_SIZE + 1);
+
+  /* Split at line boundaries */
+  pos = data;
+  for (guint i = 0; i < n_chunks; i++) {
+    const char *split = i == n_chunks - 1 ? end : MIN (data + size / n_chunks * (i + 1), end);
+
+    if (split < pos)
+      split = pos;
+    if (split < end) {
+      const char *eol = memchr (split, '\n', end - split);
+      split = eol ? eol + 1 : end;
+    }
+
+    chunks[i].start = pos;
+    chunks[i].end = split;
+    chunks[i].events = g_array_new (FALSE, FALSE, sizeof (EvImportEvent));
+    pos = split;
+  }
+
+  for (guint i = 1; i < n_chunks; i++)
+    threads[i] = g_thread_new ("import-index", index_chunk, &chunks[i]);
+  index_chunk (&chunks[0]);
+
+  file->events = g_array_new (FALSE, FALSE, sizeof (EvImportEvent));
+  for (guint i = 0; i < n_chunks; i++) {
+    if (threads[i])
+      g_thread_join (threads[i]);
+
+    g_array_append_vals (file->events, chunks[i].events->data, chunks[i].events->len);
+    file->n_invalid += chunks[i].n_invalid;
+    g_array_unref (chunks[i].events);
+  }
+}
+
+
+static int
+compare_events (gconstpointer a, gconstpointer b)
+{
+  const EvImportEvent *event_a = *(const EvImportEvent **)a;
+  const EvImportEvent *event_b = *(const EvImportEvent **)b;
+
+  if (event_a->ts == event_b->ts)
+    return 0;
+
+  return event_a->ts < event_b->ts ? -1 : 1;
+}
+
+
+static void
+index_add (GHashTable *table, const char *key, EvImportEvent *event)
+{
+  GPtrArray *events = g_hash_table_lookup (table, key);
+
+  if (!events) {
+    events = g_ptr_array_new ();
+    g_hash_table_insert (table, (gpointer) key, events);
+  }
+  g_ptr_array_add (events, event);
+}
+
+/* Builds a fresh index over all files so the current one stays usable
+ * while importing */
+static EvImportIndex *
+build_index (GPtrArray *files)
+{
+  EvImportIndex *self = g_new0 (EvImportIndex, 1);
+
+  self->rooms = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                       (GDestroyNotify) g_ptr_array_unref);
+  self->senders = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                         (GDestroyNotify) g_ptr_array_unref);
+  self->by_time = g_ptr_array_new ();
+
+  for (guint i = 0; i < files->len; i++) {
+    EvImportFile *file = g_ptr_array_index (files, i);
+
+    for (guint j = 0; j < file->events->len; j++)
+      g_ptr_array_add (self->by_time, &g_array_index (file->events, EvImportEvent, j));
+  }
+  g_ptr_array_sort (self->by_time, compare_events);
+
+  /* Sorted by time already */
+  for (guint i = 0; i < self->by_time->len; i++) {
+    EvImportEvent *event = g_ptr_array_index (self->by_time, i);
+
+    index_add (self->rooms, event->room, event);
+    if (event->sender)
+      index_add (self->senders, event->sender, event);
+  }
+
+  return self;
+}
+
+
+static void
+import_thread (GTask        *task,
+               gpointer      source_object,
+               gpointer      task_data,
+               GCancellable *cancellable)
+{
+  EvImportJob *job = task_data;
+  GError *err = NULL;
+
+  if (!load_file (job->file, &err)) {
+    g_task_return_error (task, err);
+    return;
+  }
+
+  index_file (job->file);
+  job->index = build_index (job->files);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+
+static void
+on_import_done (GObject *source_object, GAsyncResult *res, gpointer user_data)
+{
+  EvImportJob *job = g_task_get_task_data (G_TASK (res));
+  g_autoptr (GError) err = NULL;
+  g_autofree char *size = NULL;
+  double duration = (double) (g_get_monotonic_time () - job->started) / G_USEC_PER_SEC;
+  EvImportFile *file;
+
+  importing = FALSE;
+
+  if (!g_task_propagate_boolean (G_TASK (res), &err)) {
+    ev_prompt_print ("Import of %s failed: %s\n", job->file->path, err->message);
+    return;
+  }
+
+  file = g_steal_pointer (&job->file);
+  g_ptr_array_add (imports, file);
+  g_clear_pointer (&import_index, ev_import_index_free);
+  import_index = g_steal_pointer (&job->index);
+
+  size = g_format_size (g_bytes_get_size (file->data));
+  ev_prompt_print ("Imported %u events (%s) from %s in %.1f s\n",
+                   file->events->len, size, file->path, duration);
+  if (file->n_invalid)
+    ev_prompt_print ("%*sSkipped %" G_GUINT64_FORMAT " invalid lines\n",
+                     INFO_INDENT, "", file->n_invalid);
+  if (file->truncated)
+    ev_prompt_print ("%*sThe file ends in an incomplete gzip member\n", INFO_INDENT, "");
+}
+
+
+/* Looks up a string without interning user input */
+static const char *
+lookup_interned (const char *str)
+{
+  GQuark quark = g_quark_try_string (str);
+
+  return quark ? g_quark_to_string (quark) : NULL;
+}
+
+
+gboolean
+ev_import_has_room (const char *room_id)
+{
+  const char *room = lookup_interned (room_id);
+
+  return import_index && room && g_hash_table_contains (import_index->rooms, room);
+}
+
+
+guint
+ev_import_get_n_events (void)
+{
+  return import_index ? import_index->by_time->len : 0;
+}
+
+
+static void
+append_event (GString *out, JsonParser *parser, EvImportEvent *event)
+{
+  JsonObject *object = parse_line (parser, event->line, event->length);
+
+  ev_db_append_event (out, event->ts, event->sender,
+                      object ? get_body (object) : NULL,
+                      object ? get_string_member (object, "event_id") : NULL);
+}
+
+
+/* The index of the first event at or after ts, events are sorted by time */
+static guint
+find_first_at (GPtrArray *events, gint64 ts)
+{
+  guint low = 0, high = events->len;
+
+  while (low < high) {
+    guint mid = low + (high - low) / 2;
+    EvImportEvent *event = g_ptr_array_index (events, mid);
+
+    if (event->ts < ts)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+/**
+ * ev_import_append_room_events:
+ * @out: The string to append to
+ * @room_id: The room
+ * @limit: The number of events
+ *
+ * Appends the newest imported events of a room, oldest first.
+ */
+void
+ev_import_append_room_events (GString *out, const char *room_id, guint limit)
+{
+  g_autoptr (JsonParser) parser = json_parser_new_immutable ();
+  GPtrArray *events;
+  guint first;
+
+  if (!import_index)
+    return;
+
+  events = g_hash_table_lookup (import_index->rooms, lookup_interned (room_id));
+  if (!events)
+    return;
+
+  first = events->len > limit ? events->len - limit : 0;
+  for (guint i = first; i < events->len; i++)
+    append_event (out, parser, g_ptr_array_index (events, i));
+}
+
+/**
+ * ev_import_search:
+ * @hits: The array of #EvDbSearchHit to add the results to
+ * @text: The text to search for
+ * @room_id:(nullable): Only search in this room
+ * @sender:(nullable): Only search messages of this sender
+ * @since: Only search messages at or after this time in ms, `0` for no limit
+ * @until: Only search messages before this time in ms, `0` for no limit
+ * @skip_events:(nullable): Event ids to leave out
+ * @limit: The maximum number of results
+ *
+ * Searches the bodies of the imported messages, newest first. Uses the
+ * smallest of the room and sender indexes, narrows that to the time
+ * range and parses only the events that get looked at. The results are
+ * kept apart so they can be merged with the database's.
+ *
+ * Returns: The number of results
+ */
+guint
+ev_import_search (GPtrArray  *hits,
+                  const char *text,
+                  const char *room_id,
+                  const char *sender,
+                  gint64      since,
+                  gint64      until,
+                  GHashTable *skip_events,
+                  guint       limit)
+{
+  g_autoptr (JsonParser) parser = json_parser_new_immutable ();
+  g_autofree char *needle = g_utf8_casefold (text, -1);
+  GPtrArray *events, *by_sender = NULL;
+  const char *room = NULL;
+  guint n_results = 0, first, last;
+
+  if (!import_index)
+    return 0;
+
+  events = import_index->by_time;
+  if (room_id) {
+    room = lookup_interned (room_id);
+    events = room ? g_hash_table_lookup (import_index->rooms, room) : NULL;
+  }
+  if (sender) {
+    sender = lookup_interned (sender);
+    by_sender = sender ? g_hash_table_lookup (import_index->senders, sender) : NULL;
+    if (!by_sender)
+      return 0;
+  }
+  if (!events)
+    return 0;
+  if (by_sender && by_sender->len < events->len)
+    events = by_sender;
+
+  first = since ? find_first_at (events, since) : 0;
+  last = until ? find_first_at (events, until) : events->len;
+
+  for (guint i = last; i > first && n_results < limit; i--) {
+    EvImportEvent *event = g_ptr_array_index (events, i - 1);
+    g_autofree char *body = NULL;
+    JsonObject *object;
+    const char *str, *event_id;
+    GString *hit;
+
+    /* Interned, so pointers compare */
+    if ((room && event->room != room) || (sender && event->sender != sender))
+      continue;
+
+    object = parse_line (parser, event->line, event->length);
+    str = object ? get_body (object) : NULL;
+    if (!str)
+      continue;
+
+    body = g_utf8_casefold (str, -1);
+    if (!strstr (body, needle))
+      continue;
+
+    event_id = get_string_member (object, "event_id");
+    if (skip_events && event_id && g_hash_table_contains (skip_events, event_id))
+      continue;
+
+    hit = g_string_new (event->room);
+    g_string_append_c (hit, '\n');
+    append_event (hit, parser, event);
+    g_ptr_array_add (hits, ev_db_search_hit_new (event->ts, hit));
+    n_results++;
+  }
+
+  return n_results;
+}
+
+
+static GString *
+list_imports (void)
+{
+  g_autoptr (GString) out = g_string_new ("");
+  g_autoptr (GList) rooms = NULL;
+
+  if (!import_index || !imports->len)
+    return g_string_new ("Nothing imported");
+
+  for (guint i = 0; i < imports->len; i++) {
+    EvImportFile *file = g_ptr_array_index (imports, i);
+
+    g_string_append_printf (out, "  File: %s, %u events\n", file->path, file->events->len);
+  }
+
+  rooms = g_list_sort (g_hash_table_get_keys (import_index->rooms), (GCompareFunc) g_strcmp0);
+  for (GList *l = rooms; l; l = l->next) {
+    GPtrArray *events = g_hash_table_lookup (import_index->rooms, l->data);
+    EvImportEvent *first = g_ptr_array_index (events, 0);
+    EvImportEvent *last = g_ptr_array_index (events, events->len - 1);
+    g_autofree char *from = ev_db_format_ts (first->ts);
+    g_autofree char *to = ev_db_format_ts (last->ts);
+
+    g_string_append_printf (out, "  Room: %s, %u events, %s - %s\n",
+                            (char *) l->data, events->len, from, to);
+  }
+
+  return g_steal_pointer (&out);
+}
+
+
+static GString *
+ev_import_load (GStrv args, GError **err)
+{
+  g_autoptr (GTask) task = NULL;
+  EvImportJob *job;
+
+  if (!args[0])
+    return list_imports ();
+
+  if (importing) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_BUSY, "An import is already running");
+    return NULL;
+  }
+
+  for (guint i = 0; i < imports->len; i++) {
+    EvImportFile *file = g_ptr_array_index (imports, i);
+
+    if (g_str_equal (file->path, args[0])) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_EXISTS, "%s is already imported", args[0]);
+      return NULL;
+    }
+  }
+
+  job = g_new0 (EvImportJob, 1);
+  job->file = g_new0 (EvImportFile, 1);
+  job->file->path = g_strdup (args[0]);
+  job->files = g_ptr_array_copy (imports, NULL, NULL);
+  g_ptr_array_add (job->files, job->file);
+  job->started = g_get_monotonic_time ();
+
+  importing = TRUE;
+  task = g_task_new (NULL, NULL, on_import_done, NULL);
+  g_task_set_task_data (task, job, (GDestroyNotify) ev_import_job_free);
+  g_task_run_in_thread (task, import_thread);
+
+  return g_string_new_take (g_strdup_printf ("Importing %s", args[0]));
+}
+
+
+static const EvCmdOpt import_opts[] = {
+  {
+    .name = "path",
+    .desc = "The file written by /export, lists the imports when omitted",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static EvCmd import_commands[] = {
+  {
+    .name = "import",
+    .help_summary = N_("Load exported events for /room-events and /search"),
+    .func = ev_import_load,
+    .opts = import_opts,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+void
+ev_import_add_commands (GPtrArray *commands)
+{
+  imports = g_ptr_array_new_with_free_func ((GDestroyNotify) ev_import_file_free);
+
+  for (int i = 0; import_commands[i].name; i++)
+    g_ptr_array_add (commands, &import_commands[i]);
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+void     ev_import_destroy            (void);
+void     ev_import_add_commands       (GPtrArray  *commands);
+gboolean ev_import_has_room           (const char *room_id);
+guint    ev_import_get_n_events       (void);
+void     ev_import_append_room_events (GString    *out,
+                                       const char *room_id,
+                                       guint       limit);
+guint    ev_import_search             (GPtrArray  *hits,
+                                       const char *text,
+                                       const char *room_id,
+                                       const char *sender,
+                                       gint64      since,
+                                       gint64      until,
+                                       GHashTable *skip_events,
+                                       guint       limit);
+
+G_END_DECLS
@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "ev-config.h"
+
+#include "ev-format-builder.h"
+#include "ev-histogram.h"
+#include "ev-loop-monitor.h"
+#include "ev-prompt.h"
+
+#include <glib/gi18n.h>
+
+#define LOOP_MONITOR_INTERVAL   10  /* ms */
+#define LOOP_MONITOR_THRESHOLD  50  /* ms */
+#define LOOP_MONITOR_MAX_DEPTH  16
+
+/**
+ * EvLoopMonitor:
+ *
+ * Measures how late a high priority timer gets dispatched to find out
+ * how long the main loop was blocked. Commands and callbacks mark
+ * themselves as activities so a stall can be attributed to the activity
+ * that held the loop the longest since the previous tick.
+ */
+
+typedef struct {
+  const char *name;
+  gint64      start;  /* µs, monotonic */
+} EvLoopActivity;
+
+typedef struct {
+  guint64 count;
+  gint64  total;  /* ms */
+  gint64  max;    /* ms */
+} EvLoopCulprit;
+
+static guint timer_id;
+static gint64 last_tick;            /* µs, monotonic */
+static gint64 started;              /* µs, monotonic */
+static guint64 n_stalls;
+static EvHistogram lag;             /* ms */
+static GHashTable *culprits;
+
+static EvLoopActivity stack[LOOP_MONITOR_MAX_DEPTH];
+static guint depth;
+/* The activity that blocked the loop the longest since the last tick */
+static const char *blocker;
+static gint64 blocker_duration;
+
+
+static gboolean
+on_tick (gpointer user_data)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 late = (now - last_tick) / 1000 - LOOP_MONITOR_INTERVAL;
+  EvLoopCulprit *culprit;
+  const char *name;
+
+  last_tick = now;
+  ev_histogram_add (&lag, late);
+
+  if (late >= LOOP_MONITOR_THRESHOLD) {
+    n_stalls++;
+
+    /* Attribute to a still running activity if there's nothing better */
+    if (blocker)
+      name = blocker;
+    else if (depth)
+      name = stack[depth - 1].name;
+    else
+      name = "unattributed";
+
+    culprit = g_hash_table_lookup (culprits, name);
+    if (!culprit) {
+      culprit = g_new0 (EvLoopCulprit, 1);
+      g_hash_table_insert (culprits, g_strdup (name), culprit);
+    }
+    culprit->count++;
+    culprit->total += late;
+    culprit->max = MAX (culprit->max, late);
+  }
+
+  blocker = NULL;
+  blocker_duration = 0;
+
+  return G_SOURCE_CONTINUE;
+}
+
+
+static void
+reset (void)
+{
+  ev_histogram_reset (&lag);
+  g_hash_table_remove_all (culprits);
+  n_stalls = 0;
+  started = last_tick = g_get_monotonic_time ();
+}
+
+
+void
+ev_loop_monitor_init (void)
+{
+  culprits = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  reset ();
+  timer_id = g_timeout_add_full (G_PRIORITY_HIGH, LOOP_MONITOR_INTERVAL, on_tick, NULL, NULL);
+}
+
+
+void
+ev_loop_monitor_destroy (void)
+{
+  g_clear_handle_id (&timer_id, g_source_remove);
+  g_clear_pointer (&culprits, g_hash_table_unref);
+}
+
+/**
+ * ev_loop_monitor_begin:
+ * @activity: The name of the activity, must stay valid
+ *
+ * Marks the start of an activity that runs on the main loop. Activities
+ * can nest, e.g. when a command iterates the main loop itself.
+ */
+void
+ev_loop_monitor_begin (const char *activity)
+{
+  if (depth < LOOP_MONITOR_MAX_DEPTH) {
+    stack[depth].name = activity;
+    stack[depth].start = g_get_monotonic_time ();
+  }
+  depth++;
+}
+
+/**
+ * ev_loop_monitor_end:
+ * @activity: The name of the activity
+ *
+ * Marks the end of an activity started with [func@loop_monitor_begin].
+ */
+void
+ev_loop_monitor_end (const char *activity)
+{
+  EvLoopActivity *current;
+  gint64 blocked;
+
+  g_return_if_fail (depth > 0);
+
+  depth--;
+  if (depth >= LOOP_MONITOR_MAX_DEPTH)
+    return;
+
+  current = &stack[depth];
+  g_warn_if_fail (g_strcmp0 (current->name, activity) == 0);
+
+  /* Only the part since the last tick blocked the loop, nested main loop
+   * iterations let the timer run */
+  blocked = g_get_monotonic_time () - MAX (current->start, last_tick);
+  if (blocked > blocker_duration) {
+    blocker = current->name;
+    blocker_duration = blocked;
+  }
+}
+
+
+static int
+compare_culprits (gconstpointer a, gconstpointer b)
+{
+  EvLoopCulprit *culprit_a = g_hash_table_lookup (culprits, *(const char **)a);
+  EvLoopCulprit *culprit_b = g_hash_table_lookup (culprits, *(const char **)b);
+
+  if (culprit_a->total == culprit_b->total)
+    return 0;
+
+  return culprit_a->total < culprit_b->total ? 1 : -1;
+}
+
+
+static GString *
+ev_loop_monitor_show (GStrv args, GError **err)
+{
+  g_autoptr (EvFormatBuilder) builder = ev_format_builder_new ();
+  g_autoptr (GString) out = NULL;
+  g_autoptr (GPtrArray) names = g_ptr_array_new ();
+  GHashTableIter iter;
+  const char *name;
+
+  if (args[0]) {
+    if (!g_str_equal (args[0], "--reset") || args[1]) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown argument '%s'", args[0]);
+      return NULL;
+    }
+    reset ();
+    return g_string_new ("Reset main loop stats");
+  }
+
+  ev_format_builder_set_indent (builder, INFO_INDENT);
+  ev_format_builder_take_value (builder, _("Monitored"),
+                                g_strdup_printf ("%" G_GINT64_FORMAT " s", (g_get_monotonic_time () - started) / G_USEC_PER_SEC));
+  ev_format_builder_take_value (builder, _("Interval"), g_strdup_printf ("%d ms", LOOP_MONITOR_INTERVAL));
+  ev_format_builder_take_value (builder, _("Dispatch delay"), ev_histogram_format (&lag, " ms"));
+  ev_format_builder_take_value (builder, _("Stalls"),
+                                g_strdup_printf ("%" G_GUINT64_FORMAT " over %d ms",
+                                                 n_stalls, LOOP_MONITOR_THRESHOLD));
+  out = ev_format_builder_end (builder);
+
+  g_hash_table_iter_init (&iter, culprits);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&name, NULL))
+    g_ptr_array_add (names, (gpointer) name);
+
+  if (!names->len)
+    return g_steal_pointer (&out);
+
+  g_ptr_array_sort (names, compare_culprits);
+
+  g_string_append_printf (out, "\n%*s%-30s  %8s  %10s  %10s\n", INFO_INDENT, "",
+                          "Blocked by", "Stalls", "Total", "Max");
+  for (guint i = 0; i < names->len; i++) {
+    EvLoopCulprit *culprit = g_hash_table_lookup (culprits, g_ptr_array_index (names, i));
+
+    g_string_append_printf (out, "%*s%-30s  %8" G_GUINT64_FORMAT "  %7" G_GINT64_FORMAT " ms  %7" G_GINT64_FORMAT " ms\n",
+                            INFO_INDENT, "", (char *) g_ptr_array_index (names, i),
+                            culprit->count, culprit->total, culprit->max);
+  }
+
+  return g_steal_pointer (&out);
+}
+
+
+static const EvCmdOpt loop_stats_opts[] = {
+  {
+    .name = "--reset",
+    .desc = "Reset the stats",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static EvCmd loop_monitor_commands[] = {
+  {
+    .name = "loop-stats",
+    .help_summary = N_("Show how long the main loop got blocked and by what"),
+    .func = ev_loop_monitor_show,
+    .opts = loop_stats_opts,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+void
+ev_loop_monitor_add_commands (GPtrArray *commands)
+{
+  for (int i = 0; loop_monitor_commands[i].name; i++)
+    g_ptr_array_add (commands, &loop_monitor_commands[i]);
+}
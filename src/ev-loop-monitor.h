@@ -0,0 +1,19 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+void ev_loop_monitor_init         (void);
+void ev_loop_monitor_destroy      (void);
+void ev_loop_monitor_begin        (const char *activity);
+void ev_loop_monitor_end          (const char *activity);
+void ev_loop_monitor_add_commands (GPtrArray  *commands);
+
+G_END_DECLS
@@ -9,9 +9,18 @@
 #include "ev-config.h"
 #include "ev-application.h"
 #include "ev-format-builder.h"
+#include "ev-histogram.h"
+#include "ev-loop-monitor.h"
 #include "ev-matrix.h"
+#include "ev-media-cache.h"
 #include "ev-prompt.h"
+#include "ev-ring.h"
+#include "ev-scheduler.h"
+#include "ev-startup-profile.h"
+#include "ev-sync-log.h"
+#include "ev-sync-stats.h"
 
+#include <errno.h>
 #include <gio/gio.h>
 #include <glib/gi18n.h>
 
@@ -23,65 +32,345 @@
  * Matrix server interaction
  */
 
+/**
+ * EvAccount:
+ *
+ * An account configured via a `[matrix-NN]` group in accounts.cfg. All
+ * accounts sync concurrently, commands act on the selected one.
+ */
+typedef struct {
+  char       *group;
+  char       *username;
+  char       *password;
+  char       *homeserver;     /* Skips homeserver discovery */
+  CmClient   *client;
+  GListModel *joined_rooms;
+  GPtrArray  *pushers;
+  gint64      pushers_fetched;
+  gboolean    pushers_refreshing;
+  gboolean    skipped;        /* Not selected on the command line */
+  GError     *error;          /* Why the account stopped syncing */
+  /* Stats */
+  guint64     n_syncs;
+  guint64     n_sync_errors;
+  guint64     n_events;
+  gint64      last_sync;      /* µs, monotonic */
+  EvSyncStats sync_stats;
+  GHashTable *room_sync_stats;
+  GHashTable *member_cache;   /* room id → members, dropped on membership changes */
+  GHashTable *device_cache;   /* user id → devices */
+  /* Watchdog */
+  gint64      started;        /* µs, monotonic */
+  gint64      stall_start;    /* µs, monotonic */
+  gint64      last_recovery;  /* µs, monotonic */
+  guint       n_stalls;
+  guint       n_recoveries;
+  EvHistogram stalls;         /* s */
+} EvAccount;
+
+#define HOMESERVER_LOOKUP_TIMEOUT  30 /* seconds */
+#define HOMESERVER_CACHE_TTL       (24 * 60 * 60) /* seconds */
+#define SYNC_STATS_TOP_ROOMS       10
+#define WATCHDOG_INTERVAL          5  /* seconds */
+#define WATCHDOG_THRESHOLD         90 /* seconds */
+#define UPLOAD_RSS_INTERVAL        100 /* ms */
+#define MEDIA_CACHE_MAX_SIZE       (512 * 1024 * 1024) /* bytes */
+#define MEMBERS_DEFAULT_LIMIT      50
+#define DEVICES_CACHE_TTL          (10 * 60) /* seconds */
+
 static CmMatrix *matrix;
-static CmClient *client;
-static CmAccount *account;
+static GPtrArray *accounts;
+static EvAccount *current;
+static GPtrArray *stale_clients;
+static guint pruning;
+static GStrv only_accounts;
+static guint watchdog_id;
+static guint watchdog_threshold = WATCHDOG_THRESHOLD;
+static gboolean watchdog_recover;
 static GCancellable *cancel;
-static GListModel *joined_rooms;
-static GPtrArray *pushers;
 static GRegex *room_regex;
+static EvScheduler *scheduler;
+static char *homeserver_cache;
+static EvMediaCache *media_cache;
+static GError *config_error;
+
+typedef struct _EvRemovePushers EvRemovePushers;
+
+typedef struct {
+  EvRemovePushers *batch;
+  CmPusher        *pusher;
+} EvRemovePushersEntry;
+
+/**
+ * EvRemovePushers:
+ *
+ * Bulk removal of pushers matching a filter
+ */
+struct _EvRemovePushers {
+  EvAccount *account;
+  GPtrArray *entries;
+  guint      done;
+  guint      failed;
+  gint64     latency_sum;
+  gint64     latency_max;
+  gint64     started;
+};
+static EvRemovePushers *remove_pushers;
+
+typedef struct _EvJoinMany EvJoinMany;
+
+typedef struct {
+  EvJoinMany *batch;
+  char       *room;
+  guint       attempts;
+  gint64      latency;
+  GError     *error;
+} EvJoinManyEntry;
+
+/**
+ * EvJoinMany:
+ *
+ * A bulk room join. The joins are submitted to the bulk lane of the
+ * scheduler which takes care of concurrency and rate limits.
+ */
+struct _EvJoinMany {
+  EvAccount  *account;
+  GPtrArray  *entries;
+  guint       done;
+  gint64      started;
+};
+static EvJoinMany *join_many;
+
+#define MARK_READ_PROGRESS_INTERVAL 100 /* rooms */
+
+typedef struct _EvMarkRead EvMarkRead;
+
+typedef struct {
+  EvMarkRead *batch;
+  CmRoom     *room;
+  CmEvent    *event;  /* The latest loaded event */
+} EvMarkReadEntry;
+
+/**
+ * EvMarkRead:
+ *
+ * Marks many rooms as read. Like [struct@JoinMany] the read markers go
+ * through the bulk lane of the scheduler.
+ */
+struct _EvMarkRead {
+  EvAccount   *account;
+  GPtrArray   *entries;
+  guint        done;
+  guint        failed;
+  guint        skipped;
+  gint64       started;
+  EvHistogram  latency;  /* ms */
+};
+static EvMarkRead *mark_read;
+
+#define TAIL_CAPACITY         256
+#define TAIL_FLUSH_INTERVAL   100 /* ms */
+#define TAIL_MAX_LINES        20  /* per flush */
+
+typedef struct {
+  CmRoom  *room;
+  CmEvent *event;
+  gint64   received;  /* µs, real time */
+} EvTailEntry;
+
+/**
+ * EvTail:
+ *
+ * Streams new events of the selected rooms to the terminal. Events are
+ * queued in a ring buffer and printed in bounded batches. When the
+ * terminal can't keep up the oldest events get dropped and the number
+ * of dropped events is printed instead.
+ */
+typedef struct {
+  EvAccount  *account;
+  GHashTable *rooms;       /* Room ids, %NULL for all rooms */
+  EvRing     *ring;
+  guint       flush_id;
+  guint64     n_shown;
+  guint64     n_dropped;   /* Reported so far */
+} EvTail;
+static EvTail *tail;
+
+#define BENCH_SEND_PREFIX        "ev-bench"
+#define BENCH_SEND_MAX_COUNT     100000
+#define BENCH_SEND_MAX_SIZE      (64 * 1024)
+#define BENCH_SEND_ECHO_TIMEOUT  30 /* seconds */
+
+/**
+ * EvBenchSend:
+ *
+ * A send benchmark. Messages are tagged with the run's tag and their
+ * sequence number so their echoes can be matched in the sync stream.
+ */
+typedef struct {
+  EvAccount  *account;
+  CmRoom     *room;
+  char       *tag;
+  guint       count;
+  guint       rate;          /* messages per second */
+  guint       size;          /* bytes per message */
+  guint       n_sent;
+  guint       n_send_done;
+  guint       n_send_failed;
+  guint       n_rate_limited;
+  guint       n_echoed;
+  gint64     *started;       /* µs, monotonic per message */
+  gboolean   *echoed;
+  gint64      first_start;   /* µs, monotonic */
+  gint64      last_echo;     /* µs, monotonic */
+  EvHistogram send_latency;  /* ms */
+  EvHistogram echo_latency;  /* ms */
+  guint       timer_id;
+  guint       timeout_id;
+} EvBenchSend;
+static EvBenchSend *bench_send;
+
+typedef struct _EvDownloadBatch EvDownloadBatch;
+
+typedef struct {
+  EvDownloadBatch *batch;
+  CmEvent         *event;
+  GFile           *file;
+  GFile           *part;       /* Written to until complete */
+  GInputStream    *in;
+  GOutputStream   *out;
+  GCancellable    *cancellable;
+  goffset          resumed;    /* Bytes already on disk from a previous attempt */
+  goffset          skipped;
+  goffset          bytes;
+  gint64           started;    /* µs, monotonic */
+  gboolean         cached;
+} EvDownloadEntry;
+
+/**
+ * EvDownloadBatch:
+ *
+ * A set of downloads. Each download is spliced from the network straight
+ * into a partial file and renamed when complete. They are submitted to
+ * the bulk lane of the scheduler which bounds the number of concurrent
+ * downloads. Content found in the media cache is copied from there
+ * instead.
+ */
+struct _EvDownloadBatch {
+  GPtrArray  *entries;
+  guint       done;
+  guint       failed;
+  goffset     bytes;
+  gint64      started;
+};
+
+typedef struct {
+  char *id;
+  char *name;
+  char *ed25519;
+} EvDevice;
+
+typedef struct {
+  GPtrArray *devices;
+  gint64     fetched;  /* µs, monotonic */
+} EvDeviceList;
 
 
 static void
-on_client_sync (CmClient  *cm_client,
-                CmRoom    *room,
-                GPtrArray *events,
-                GError    *err,
-                gpointer  user_data)
+ev_device_free (EvDevice *device)
 {
-  g_debug ("Got new client events");
+  g_free (device->id);
+  g_free (device->name);
+  g_free (device->ed25519);
+  g_free (device);
+}
 
-  if (room && events) {
-    for (guint i = 0; i < events->len; i++) {
-      CmRoomMessageEvent *event;
 
-      event = events->pdata[i];
-      g_debug ("Event type: %d", cm_event_get_m_type (CM_EVENT (event)));
+static void
+ev_device_list_free (EvDeviceList *list)
+{
+  g_ptr_array_unref (list->devices);
+  g_free (list);
+}
 
-      if (CM_IS_ROOM_MESSAGE_EVENT (event) &&
-          cm_room_message_event_get_msg_type (CM_ROOM_MESSAGE_EVENT (event))) {
-        g_debug ("text message: %s", cm_room_message_event_get_body (event));
-      }
-    }
+
+static void
+ev_account_free (EvAccount *account)
+{
+  g_free (account->group);
+  g_free (account->username);
+  g_free (account->password);
+  g_free (account->homeserver);
+  g_clear_pointer (&account->pushers, g_ptr_array_unref);
+  g_clear_object (&account->client);
+  g_clear_error (&account->error);
+  g_clear_pointer (&account->room_sync_stats, g_hash_table_unref);
+  g_clear_pointer (&account->member_cache, g_hash_table_unref);
+  g_clear_pointer (&account->device_cache, g_hash_table_unref);
+  g_free (account);
+}
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EvAccount, ev_account_free)
+
+
+static EvAccount *
+get_current_account (GError **err)
+{
+  if (!current) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_INITIALIZED, "No account selected");
+    return NULL;
   }
 
-  if (err) {
-    if (g_error_matches (err, CM_ERROR, CM_ERROR_BAD_PASSWORD)) {
-      g_critical ("%s", err->message);
-      ev_quit ();
-      return;
-    }
-    g_warning ("client error (%d): %s", err->code, err->message);
+  if (current->skipped) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_INITIALIZED, "Account %s wasn't started",
+                 current->username);
+    return NULL;
+  }
+
+  if (!current->client) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_INITIALIZED, "Account %s isn't ready yet",
+                 current->username);
+    return NULL;
+  }
+
+  return current;
+}
+
+
+static EvAccount *
+find_account (const char *name)
+{
+  for (guint i = 0; i < accounts->len; i++) {
+    EvAccount *account = g_ptr_array_index (accounts, i);
+
+    if (g_strcmp0 (account->username, name) == 0 || g_strcmp0 (account->group, name) == 0)
+      return account;
   }
+
+  return NULL;
 }
 
 
 static void
-on_joined_rooms_items_changed (GListModel *list,
-                               guint       position,
-                               guint       removed,
-                               guint       added,
-                               gpointer    user_data)
+account_failed (EvAccount *account, const GError *err)
 {
-  g_debug ("Taking part in %d rooms", g_list_model_get_n_items (list));
+  g_clear_error (&account->error);
+  account->error = g_error_copy (err);
 
-  for (guint i = 0; i < g_list_model_get_n_items (list); i++) {
-    g_autoptr (CmRoom) room = g_list_model_get_item (list, i);
+  if (account->client)
+    cm_client_set_enabled (account->client, FALSE);
 
-    g_debug ("room name: %s, room id: %s\n",
-             cm_room_get_name (room),
-             cm_room_get_id (room));
+  /* Keep going as long as any account is usable */
+  for (guint i = 0; i < accounts->len; i++) {
+    EvAccount *a = g_ptr_array_index (accounts, i);
+
+    if (!a->error && !a->skipped) {
+      ev_prompt_print ("Account %s disabled: %s\n", account->username, err->message);
+      return;
+    }
   }
+
+  g_critical ("%s: %s", account->username, err->message);
+  ev_quit ();
 }
 
 
@@ -111,549 +400,3695 @@ ev_enum_to_nick (GType g_enum_type, gint value)
 }
 
 
-static CmRoom *
-get_joined_room_by_id (const char *room_id)
+static void
+tail_entry_clear (EvTailEntry *entry)
 {
-  CmRoom *room = NULL;
+  g_clear_object (&entry->room);
+  g_clear_object (&entry->event);
+}
 
-  for (guint i = 0; i < g_list_model_get_n_items (joined_rooms); i++) {
-    g_autoptr (CmRoom) r = g_list_model_get_item (joined_rooms, i);
-    const char *id = cm_room_get_id (r);
 
-    if (g_str_equal (room_id, id)) {
-      room = g_steal_pointer (&r);
-      break;
-    }
-  }
+static void
+tail_stop (void)
+{
+  if (!tail)
+    return;
 
-  return room;
+  g_clear_handle_id (&tail->flush_id, g_source_remove);
+  g_clear_pointer (&tail->rooms, g_hash_table_unref);
+  g_clear_pointer (&tail->ring, ev_ring_free);
+  g_clear_pointer (&tail, g_free);
 }
 
 
 static void
-on_matrix_open (GObject *object, GAsyncResult *result, gpointer user_data)
+tail_format_entry (GString *out, EvTailEntry *entry)
 {
-  g_autoptr (GError) err = NULL;
-  g_autofree char *username = NULL, *password = NULL, *config_path = NULL;
-  g_autoptr (GKeyFile) keyfile = g_key_file_new ();
-  GListModel *clients;
+  g_autoptr (GDateTime) dt = g_date_time_new_from_unix_local (entry->received / G_USEC_PER_SEC);
+  g_autofree char *time = g_date_time_format (dt, "%H:%M:%S");
+  CmUser *sender = cm_event_get_sender (entry->event);
+  const char *name = cm_room_get_name (entry->room) ?: cm_room_get_id (entry->room);
 
-  /* The spec does not seem to specify which characters are actually valid
-   * https://spec.matrix.org/v1.11/appendices/#room-ids
-   * https://spec.matrix.org/v1.11/appendices/#room-aliases */
-  room_regex = g_regex_new ("^[!#].*:([a-z]+\\.?)+$",
-                            G_REGEX_CASELESS,
-                            G_REGEX_MATCH_DEFAULT,
-                            NULL);
+  g_string_append_printf (out, "[%s] %s <%s> ", time, name, sender ? cm_user_get_id (sender) : "?");
 
-  if (!cm_matrix_open_finish (matrix, result, &err)) {
-    g_critical ("Error opening db: %s", err->message);
-    ev_quit ();
-    return;
+  if (CM_IS_ROOM_MESSAGE_EVENT (entry->event) &&
+      cm_room_message_event_get_msg_type (CM_ROOM_MESSAGE_EVENT (entry->event)) == CM_CONTENT_TYPE_TEXT) {
+    g_string_append (out, cm_room_message_event_get_body (CM_ROOM_MESSAGE_EVENT (entry->event)));
+  } else {
+    g_autofree char *nick = ev_enum_to_nick (CM_TYPE_EVENT_TYPE, cm_event_get_m_type (entry->event));
+
+    g_string_append_printf (out, "(%s)", nick);
   }
+  g_string_append_c (out, '\n');
+}
 
-  /* TODO: ask, libcmatrix saves them in the login keyring anyway */
-  config_path = g_build_filename (g_get_user_config_dir (), EV_PROJECT, "accounts.cfg", NULL);
 
-  if (!g_key_file_load_from_file (keyfile, config_path, G_KEY_FILE_NONE, &err)) {
-    g_critical ("Failed to read config file %s: %s", config_path, err->message);
-    ev_quit ();
-    return;
+static gboolean
+on_tail_flush (gpointer user_data)
+{
+  g_autoptr (GString) out = g_string_new ("");
+  guint64 n_evicted = ev_ring_get_n_evicted (tail->ring);
+  guint n = 0;
+
+  if (n_evicted > tail->n_dropped) {
+    g_string_append_printf (out, "… dropped %" G_GUINT64_FORMAT " events, the terminal can't keep up\n",
+                            n_evicted - tail->n_dropped);
+    tail->n_dropped = n_evicted;
   }
 
-  username = g_key_file_get_string (keyfile, "matrix-00", "username", &err);
-  if (!username) {
-    g_critical ("Failed to get username: %s", err->message);
-    ev_quit ();
-    return;
+  /* Bound the output per flush so the prompt stays responsive */
+  while (n < TAIL_MAX_LINES && ev_ring_get_length (tail->ring)) {
+    tail_format_entry (out, ev_ring_peek (tail->ring, 0));
+    ev_ring_drop (tail->ring);
+    n++;
   }
-  password = g_key_file_get_string (keyfile, "matrix-00", "password", &err);
-  if (!password) {
-    g_critical ("Failed to get password: %s", err->message);
-    ev_quit ();
+  tail->n_shown += n;
+
+  if (out->len)
+    ev_prompt_print ("%s", out->str);
+
+  if (ev_ring_get_length (tail->ring))
+    return G_SOURCE_CONTINUE;
+
+  tail->flush_id = 0;
+  return G_SOURCE_REMOVE;
+}
+
+
+static void
+tail_add_events (EvAccount *account, CmRoom *room, GPtrArray *events)
+{
+  gint64 now;
+
+  if (!tail || tail->account != account)
     return;
-  }
 
-  clients = cm_matrix_get_clients_list (matrix);
-  g_debug ("Found %d existing clients", g_list_model_get_n_items (clients));
-  for (int i = 0; i < g_list_model_get_n_items (clients); i++) {
-    g_autoptr (CmClient) c = g_list_model_get_item (clients, i);
-    CmAccount *a = cm_client_get_account (c);
+  if (tail->rooms && !g_hash_table_contains (tail->rooms, cm_room_get_id (room)))
+    return;
 
-    /* See if we have a client with our id in the db already as we need to set
-     * a sync callback for it as it will otherwise assert() */
-    if (g_strcmp0 (cm_account_get_login_id (a), username) == 0) {
-      client = g_steal_pointer (&c);
-    } else {
-      /* FIXME: libcmatrix should give us better control which accounts will
-       * actually /sync https://source.puri.sm/Librem5/libcmatrix/-/issues/41 */
-      cm_client_set_enabled (c, FALSE);
-    }
+  now = g_get_real_time ();
+  for (guint i = 0; i < events->len; i++) {
+    EvTailEntry *entry = ev_ring_push (tail->ring);
+
+    entry->room = g_object_ref (room);
+    entry->event = g_object_ref (g_ptr_array_index (events, i));
+    entry->received = now;
   }
 
-  if (!client) {
-    g_autoptr (GError) error = NULL;
-    g_autofree char *homeserver = NULL;
+  if (!tail->flush_id)
+    tail->flush_id = g_timeout_add (TAIL_FLUSH_INTERVAL, on_tail_flush, NULL);
+}
 
-    g_debug ("No client yet, creating a new one");
-    client = cm_matrix_client_new (matrix);
-    cm_client_set_password (client, password);
-    cm_client_set_device_name (client, EV_PROJECT);
 
-    homeserver = cm_utils_get_homeserver_sync (username, &error);
-    if (!homeserver) {
-      g_critical ("Could not determine homeserver for user '%s': %s",
-                  username, error->message);
-      ev_quit ();
-      return;
-    }
-    cm_client_set_homeserver (client, homeserver);
+static gboolean
+on_watchdog_timeout (gpointer user_data)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 threshold = (gint64) watchdog_threshold * G_USEC_PER_SEC;
 
-    account = cm_client_get_account (client);
-    if (!cm_account_set_login_id (account, username)) {
-      g_critical ("'%s' isn't a valid username", username);
-      ev_quit ();
-      return;
+  for (guint i = 0; i < accounts->len; i++) {
+    EvAccount *account = g_ptr_array_index (accounts, i);
+    gint64 last = account->last_sync ?: account->started;
+
+    if (!account->client || account->error || account->skipped)
+      continue;
+
+    if (now - last < threshold)
+      continue;
+
+    if (!account->stall_start) {
+      account->stall_start = last;
+      account->n_stalls++;
+      ev_prompt_print ("No sync for %s in %" G_GINT64_FORMAT " s\n", account->username,
+                       (now - last) / G_USEC_PER_SEC);
     }
 
-    if (!cm_matrix_save_client_sync (matrix, client, NULL, &error))
-      g_warning ("Could not save client %p: %s", client, error->message);
-  }
-  cm_client_set_sync_callback (client, on_client_sync, NULL, NULL);
+    if (!watchdog_recover)
+      continue;
 
-  g_print ("Logging in %s\n", username);
-  cm_client_set_enabled (client, TRUE);
-  joined_rooms = cm_client_get_joined_rooms (client);
+    /* Give the sync loop time to recover before trying again */
+    if (now - MAX (account->last_recovery, account->stall_start) < threshold)
+      continue;
 
-  g_signal_connect_object (joined_rooms, "items-changed",
-                           G_CALLBACK (on_joined_rooms_items_changed),
-                           client,
-                           G_CONNECT_DEFAULT);
+    ev_prompt_print ("Restarting sync of %s\n", account->username);
+    account->last_recovery = now;
+    account->n_recoveries++;
+    cm_client_set_enabled (account->client, FALSE);
+    cm_client_set_enabled (account->client, TRUE);
+  }
+
+  return G_SOURCE_CONTINUE;
 }
 
 
-void
-ev_matrix_init (const char *data_dir, const char *cache_dir)
+static void
+watchdog_sync_done (EvAccount *account)
 {
-  cancel = g_cancellable_new ();
+  gint64 duration;
 
-  matrix = cm_matrix_new (data_dir, cache_dir, EV_APP_ID, FALSE);
-  cm_matrix_open_async (matrix, data_dir, "matrix.db", cancel, on_matrix_open, NULL);
+  if (!account->stall_start)
+    return;
+
+  duration = g_get_monotonic_time () - account->stall_start;
+  ev_histogram_add (&account->stalls, duration / G_USEC_PER_SEC);
+  account->stall_start = 0;
+  ev_prompt_print ("Sync of %s resumed after %" G_GINT64_FORMAT " s\n", account->username,
+                   duration / G_USEC_PER_SEC);
 }
 
 
-void
-ev_matrix_destroy (void)
+static void
+bench_send_free (EvBenchSend *bench)
 {
-  g_cancellable_cancel (cancel);
-  g_clear_object (&cancel);
-
-  g_clear_pointer (&pushers, g_ptr_array_unref);
-  g_clear_object (&client);
-  g_clear_object (&matrix);
-  g_clear_pointer (&room_regex, g_regex_unref);
+  g_clear_handle_id (&bench->timer_id, g_source_remove);
+  g_clear_handle_id (&bench->timeout_id, g_source_remove);
+  g_clear_object (&bench->room);
+  g_free (bench->tag);
+  g_free (bench->started);
+  g_free (bench->echoed);
+  g_free (bench);
 }
 
 
-static GString *
-ev_matrix_list_rooms (GStrv unused, GError **err)
+static void
+bench_send_finish (void)
 {
-  g_autoptr (GString) out = g_string_new ("");
+  g_autoptr (EvFormatBuilder) builder = ev_format_builder_new ();
+  g_autoptr (GString) out = NULL;
+  EvBenchSend *bench = bench_send;
+  guint n_ok = bench->n_send_done - bench->n_send_failed;
+  gint64 duration = MAX ((bench->last_echo ?: g_get_monotonic_time ()) - bench->first_start, 1);
 
-  if (!joined_rooms || g_list_model_get_n_items (joined_rooms) == 0) {
-    g_string_append (out, "No joined rooms\n");
-    return g_steal_pointer (&out);
-  }
+  ev_format_builder_set_indent (builder, INFO_INDENT);
+  ev_format_builder_add (builder, _("Room Id"), cm_room_get_id (bench->room));
+  ev_format_builder_take_value (builder, _("Sent"),
+                                g_strdup_printf (_("%u of %u, %u failed, %u rate limited"),
+                                                 n_ok, bench->count, bench->n_send_failed,
+                                                 bench->n_rate_limited));
+  ev_format_builder_take_value (builder, _("Echoed"), g_strdup_printf ("%u of %u", bench->n_echoed, n_ok));
+  ev_format_builder_take_value (builder, _("Send latency"),
+                                ev_histogram_format (&bench->send_latency, " ms"));
+  ev_format_builder_take_value (builder, _("Echo latency"),
+                                ev_histogram_format (&bench->echo_latency, " ms"));
+  ev_format_builder_take_value (builder, _("Throughput"),
+                                g_strdup_printf (_("%.1f messages/s, %.1f KiB/s"),
+                                                 (double) bench->n_echoed * G_USEC_PER_SEC / duration,
+                                                 (double) bench->n_echoed * bench->size * G_USEC_PER_SEC / duration / 1024));
+  out = ev_format_builder_end (builder);
+
+  ev_prompt_print ("Benchmark %s done\n%s", bench->tag, out->str);
+  g_clear_pointer (&bench_send, bench_send_free);
+}
 
-  for (guint i = 0; i < g_list_model_get_n_items (joined_rooms); i++) {
-    g_autoptr (CmRoom) room = g_list_model_get_item (joined_rooms, i);
 
-    g_string_append_printf (out, "  Room name: %s, room id: %s\n",
-                            cm_room_get_name (room),
-                            cm_room_get_id (room));
-  }
+static gboolean
+on_bench_send_echo_timeout (gpointer user_data)
+{
+  bench_send->timeout_id = 0;
+  bench_send_finish ();
 
-  return g_steal_pointer (&out);
+  return G_SOURCE_REMOVE;
 }
 
 
-static GString *
-ev_matrix_room_details (GStrv args, GError **err)
+static void
+bench_send_check_done (void)
 {
-  g_autoptr (EvFormatBuilder) builder = ev_format_builder_new ();
-  g_autoptr (CmRoom) room = NULL;
-  const char *room_id;
-  GListModel *events;
+  EvBenchSend *bench = bench_send;
 
-  g_assert (client);
+  if (bench->n_send_done < bench->count)
+    return;
 
-  if (g_strv_length (args) < 1) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
-    return NULL;
+  if (bench->n_echoed == bench->n_send_done - bench->n_send_failed) {
+    bench_send_finish ();
+    return;
   }
-  room_id = args[0];
 
-  room = get_joined_room_by_id (room_id);
-  if (!room) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", room_id);
-    return NULL;
+  if (!bench->timeout_id) {
+    bench->timeout_id = g_timeout_add_seconds (BENCH_SEND_ECHO_TIMEOUT,
+                                               on_bench_send_echo_timeout, NULL);
   }
+}
 
-  ev_format_builder_set_indent (builder, INFO_INDENT);
-  ev_format_builder_add (builder, _("Room Id"), cm_room_get_id (room));
-  /* Translators: a matrix room name */
-  ev_format_builder_add (builder, _("Name"), cm_room_get_name (room));
-  ev_format_builder_add_nonnull (builder, _("Topic"), cm_room_get_topic (room));
-  ev_format_builder_add (builder, _("Encrypted"),
-                         cm_room_is_encrypted (room) ? _("Yes") : _("No"));
-  ev_format_builder_take_value (builder, _("Unread notifications"),
-                                g_strdup_printf ("%ld", cm_room_get_unread_notification_counts (room)));
 
-  events = cm_room_get_events_list (room);
-  ev_format_builder_take_value (builder, _("Events"),
-                                g_strdup_printf ("%u", g_list_model_get_n_items (events)));
+static void
+on_bench_send_ready (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  EvBenchSend *bench = bench_send;
+  guint seq = GPOINTER_TO_UINT (user_data);
+  g_autoptr (GError) err = NULL;
+  g_autofree char *event_id = NULL;
+
+  /* The benchmark only ends once all sends finished, unless we're shutting down */
+  if (!bench)
+    return;
 
+  bench->n_send_done++;
+  event_id = cm_room_send_text_finish (CM_ROOM (object), result, &err);
+  if (!event_id) {
+    bench->n_send_failed++;
+    if (g_error_matches (err, CM_ERROR, CM_ERROR_LIMIT_EXCEEDED))
+      bench->n_rate_limited++;
+    else
+      g_debug ("Failed to send bench message %u: %s", seq, err->message);
+  } else {
+    ev_histogram_add (&bench->send_latency, (g_get_monotonic_time () - bench->started[seq]) / 1000);
+  }
 
-  return ev_format_builder_end (builder);
+  bench_send_check_done ();
 }
 
 
-static GString *
-ev_matrix_room_events (GStrv args, GError **err)
+static gboolean
+on_bench_send_tick (gpointer user_data)
 {
-  g_autoptr (EvFormatBuilder) builder = ev_format_builder_new ();
-  g_autoptr (CmRoom) room = NULL;
-  const char *room_id;
-  GListModel *events;
+  EvBenchSend *bench = bench_send;
+  g_autoptr (GString) body = g_string_new (NULL);
+  gint64 now = g_get_monotonic_time ();
+  guint seq = bench->n_sent;
+
+  g_string_append_printf (body, "%s %s %u ", BENCH_SEND_PREFIX, bench->tag, seq);
+  while (body->len < bench->size)
+    g_string_append_c (body, 'x');
+
+  if (!bench->first_start)
+    bench->first_start = now;
+  bench->started[seq] = now;
+  bench->n_sent++;
+  cm_room_send_text_async (bench->room, body->str, cancel, on_bench_send_ready, GUINT_TO_POINTER (seq));
+
+  if (bench->n_sent < bench->count)
+    return G_SOURCE_CONTINUE;
+
+  bench->timer_id = 0;
+  return G_SOURCE_REMOVE;
+}
 
-  g_assert (client);
 
-  if (g_strv_length (args) < 1) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+static void
+bench_send_match (EvAccount *account, CmRoom *room, GPtrArray *events)
+{
+  EvBenchSend *bench = bench_send;
+  gint64 now = g_get_monotonic_time ();
+
+  if (!bench || bench->account != account || bench->room != room)
+    return;
+
+  for (guint i = 0; i < events->len; i++) {
+    CmEvent *event = g_ptr_array_index (events, i);
+    const char *body;
+    char *end;
+    guint64 seq;
+
+    if (!CM_IS_ROOM_MESSAGE_EVENT (event))
+      continue;
+
+    body = cm_room_message_event_get_body (CM_ROOM_MESSAGE_EVENT (event));
+    if (!body || !g_str_has_prefix (body, BENCH_SEND_PREFIX " "))
+      continue;
+
+    body += strlen (BENCH_SEND_PREFIX " ");
+    if (!g_str_has_prefix (body, bench->tag))
+      continue;
+
+    body += strlen (bench->tag);
+    seq = g_ascii_strtoull (body, &end, 10);
+    if (end == body || seq >= bench->n_sent || bench->echoed[seq])
+      continue;
+
+    bench->echoed[seq] = TRUE;
+    bench->n_echoed++;
+    bench->last_echo = now;
+    ev_histogram_add (&bench->echo_latency, (now - bench->started[seq]) / 1000);
+  }
+
+  bench_send_check_done ();
+}
+
+
+static void
+on_client_sync (CmClient  *cm_client,
+                CmRoom    *room,
+                GPtrArray *events,
+                GError    *err,
+                gpointer  user_data)
+{
+  EvAccount *account = user_data;
+
+  ev_loop_monitor_begin ("sync-callback");
+  g_debug ("Got new client events for %s", account->username);
+  ev_sync_log_record (account->username, room, events, err);
+
+  if (!err) {
+    ev_startup_profile_end (EV_STARTUP_PHASE_LOGIN);
+    ev_startup_profile_end (EV_STARTUP_PHASE_FIRST_SYNC);
+
+    account->n_syncs++;
+    account->last_sync = g_get_monotonic_time ();
+    ev_sync_stats_record (&account->sync_stats, events);
+    watchdog_sync_done (account);
+  }
+
+  if (room && events) {
+    account->n_events += events->len;
+    tail_add_events (account, room, events);
+    bench_send_match (account, room, events);
+
+    if (!err) {
+      EvSyncStats *stats = g_hash_table_lookup (account->room_sync_stats, cm_room_get_id (room));
+
+      if (!stats) {
+        stats = g_new0 (EvSyncStats, 1);
+        g_hash_table_insert (account->room_sync_stats, g_strdup (cm_room_get_id (room)), stats);
+      }
+      ev_sync_stats_record (stats, events);
+    }
+
+    for (guint i = 0; i < events->len; i++) {
+      CmRoomMessageEvent *event;
+
+      event = events->pdata[i];
+      g_debug ("Event type: %d", cm_event_get_m_type (CM_EVENT (event)));
+
+      /* Cheaper to refetch on demand than to track each change. The
+       * member event's state key is the user whose membership changed
+       * (not the sender, e.g. for kicks and invites). Device list changes
+       * don't show up here, the TTL and /devices --refresh cover those. */
+      if (cm_event_get_m_type (CM_EVENT (event)) == CM_M_ROOM_MEMBER) {
+        const char *user_id = cm_event_get_state_key (CM_EVENT (event));
+
+        g_hash_table_remove (account->member_cache, cm_room_get_id (room));
+        if (user_id)
+          g_hash_table_remove (account->device_cache, user_id);
+      }
+
+      if (CM_IS_ROOM_MESSAGE_EVENT (event) &&
+          cm_room_message_event_get_msg_type (CM_ROOM_MESSAGE_EVENT (event))) {
+        g_debug ("text message: %s", cm_room_message_event_get_body (event));
+      }
+    }
+  }
+
+  if (err) {
+    account->n_sync_errors++;
+
+    if (g_error_matches (err, CM_ERROR, CM_ERROR_BAD_PASSWORD))
+      account_failed (account, err);
+    else
+      g_warning ("client error for %s (%d): %s", account->username, err->code, err->message);
+  }
+
+  ev_loop_monitor_end ("sync-callback");
+}
+
+
+static void
+on_joined_rooms_items_changed (GListModel *list,
+                               guint       position,
+                               guint       removed,
+                               guint       added,
+                               gpointer    user_data)
+{
+  g_debug ("Taking part in %d rooms", g_list_model_get_n_items (list));
+
+  for (guint i = 0; i < g_list_model_get_n_items (list); i++) {
+    g_autoptr (CmRoom) room = g_list_model_get_item (list, i);
+
+    g_debug ("room name: %s, room id: %s\n",
+             cm_room_get_name (room),
+             cm_room_get_id (room));
+  }
+}
+
+
+static CmRoom *
+get_joined_room_by_id (EvAccount *account, const char *room_id)
+{
+  CmRoom *room = NULL;
+
+  for (guint i = 0; i < g_list_model_get_n_items (account->joined_rooms); i++) {
+    g_autoptr (CmRoom) r = g_list_model_get_item (account->joined_rooms, i);
+    const char *id = cm_room_get_id (r);
+
+    if (g_str_equal (room_id, id)) {
+      room = g_steal_pointer (&r);
+      break;
+    }
+  }
+
+  return room;
+}
+
+
+static char *
+homeserver_cache_lookup (const char *user_id)
+{
+  g_autoptr (GKeyFile) keyfile = g_key_file_new ();
+  gint64 resolved, now;
+
+  if (!g_key_file_load_from_file (keyfile, homeserver_cache, G_KEY_FILE_NONE, NULL))
+    return NULL;
+
+  now = g_get_real_time () / G_USEC_PER_SEC;
+  resolved = g_key_file_get_int64 (keyfile, user_id, "resolved", NULL);
+  if (resolved > now || now - resolved > HOMESERVER_CACHE_TTL)
+    return NULL;
+
+  return g_key_file_get_string (keyfile, user_id, "homeserver", NULL);
+}
+
+
+static void
+homeserver_cache_store (const char *user_id, const char *homeserver)
+{
+  g_autoptr (GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr (GError) err = NULL;
+  g_autofree char *dir = g_path_get_dirname (homeserver_cache);
+
+  /* Keep the entries of other users */
+  g_key_file_load_from_file (keyfile, homeserver_cache, G_KEY_FILE_KEEP_COMMENTS, NULL);
+  g_key_file_set_string (keyfile, user_id, "homeserver", homeserver);
+  g_key_file_set_int64 (keyfile, user_id, "resolved", g_get_real_time () / G_USEC_PER_SEC);
+
+  if (g_mkdir_with_parents (dir, 0700) < 0) {
+    g_warning ("Failed to create %s: %s", dir, g_strerror (errno));
+    return;
+  }
+
+  if (!g_key_file_save_to_file (keyfile, homeserver_cache, &err))
+    g_warning ("Failed to save homeserver cache: %s", err->message);
+}
+
+
+static void
+on_client_logged_in_changed (CmClient *cm_client, GParamSpec *pspec, gpointer user_data)
+{
+  if (cm_client_get_logged_in (cm_client))
+    ev_startup_profile_end (EV_STARTUP_PHASE_LOGIN);
+}
+
+
+static void
+start_client (EvAccount *account)
+{
+  CmClient *client = account->client;
+
+  ev_startup_profile_end (EV_STARTUP_PHASE_CLIENT_RESTORE);
+
+  account->started = g_get_monotonic_time ();
+  cm_client_set_sync_callback (client, on_client_sync, account, NULL);
+  g_signal_connect (client, "notify::logged-in", G_CALLBACK (on_client_logged_in_changed), NULL);
+
+  g_print ("Logging in %s\n", cm_account_get_login_id (cm_client_get_account (client)));
+  ev_startup_profile_begin (EV_STARTUP_PHASE_LOGIN);
+  ev_startup_profile_begin (EV_STARTUP_PHASE_FIRST_SYNC);
+  cm_client_set_enabled (client, TRUE);
+  if (cm_client_get_logged_in (client))
+    ev_startup_profile_end (EV_STARTUP_PHASE_LOGIN);
+  account->joined_rooms = cm_client_get_joined_rooms (client);
+
+  g_signal_connect_object (account->joined_rooms, "items-changed",
+                           G_CALLBACK (on_joined_rooms_items_changed),
+                           client,
+                           G_CONNECT_DEFAULT);
+}
+
+
+static void
+create_client (EvAccount *account, const char *homeserver)
+{
+  g_autoptr (GError) error = NULL;
+  g_autoptr (CmClient) client = NULL;
+
+  client = cm_matrix_client_new (matrix);
+  cm_client_set_password (client, account->password);
+  cm_client_set_device_name (client, EV_PROJECT);
+  cm_client_set_homeserver (client, homeserver);
+
+  if (!cm_account_set_login_id (cm_client_get_account (client), account->username)) {
+    g_set_error (&error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                 "'%s' isn't a valid username", account->username);
+    account_failed (account, error);
+    return;
+  }
+
+  if (!cm_matrix_save_client_sync (matrix, client, NULL, &error))
+    g_warning ("Could not save client %p: %s", client, error->message);
+
+  account->client = g_steal_pointer (&client);
+  start_client (account);
+}
+
+
+static void
+on_get_homeserver_ready (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  EvAccount *account = user_data;
+  g_autoptr (GError) err = NULL;
+  g_autofree char *homeserver = NULL;
+
+  homeserver = cm_utils_get_homeserver_finish (result, &err);
+  if (!homeserver) {
+    if (g_error_matches (err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      return;
+
+    g_prefix_error (&err, "Could not determine homeserver: ");
+    account_failed (account, err);
+    return;
+  }
+
+  homeserver_cache_store (account->username, homeserver);
+  create_client (account, homeserver);
+}
+
+
+static void
+on_matrix_open (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  g_autoptr (GError) err = NULL;
+  GListModel *clients;
+
+  ev_startup_profile_end (EV_STARTUP_PHASE_DB_OPEN);
+
+  if (!cm_matrix_open_finish (matrix, result, &err)) {
+    g_critical ("Error opening db: %s", err->message);
+    ev_quit ();
+    return;
+  }
+
+  if (config_error) {
+    g_critical ("%s", config_error->message);
+    ev_quit ();
+    return;
+  }
+
+  ev_startup_profile_begin (EV_STARTUP_PHASE_CLIENT_RESTORE);
+  clients = cm_matrix_get_clients_list (matrix);
+  g_debug ("Found %d existing clients", g_list_model_get_n_items (clients));
+  for (int i = 0; i < g_list_model_get_n_items (clients); i++) {
+    g_autoptr (CmClient) c = g_list_model_get_item (clients, i);
+    CmAccount *a = cm_client_get_account (c);
+    EvAccount *account;
+
+    /* See if we have a client with a configured id in the db already as we need
+     * to set a sync callback for it as it will otherwise assert() */
+    account = find_account (cm_account_get_login_id (a));
+    if (account && !account->client && !account->skipped) {
+      account->client = g_steal_pointer (&c);
+      continue;
+    }
+
+    /* FIXME: libcmatrix should give us better control which accounts will
+     * actually /sync https://source.puri.sm/Librem5/libcmatrix/-/issues/41
+     * Until then all stored clients get loaded when opening the db, so
+     * keep track of the ones that aren't configured anymore so they can
+     * be pruned */
+    cm_client_set_enabled (c, FALSE);
+    if (!account)
+      g_ptr_array_add (stale_clients, g_steal_pointer (&c));
+  }
+  ev_startup_profile_set_clients (g_list_model_get_n_items (clients), stale_clients->len);
+  if (stale_clients->len) {
+    ev_prompt_print ("%u stored clients belong to no configured account, see /prune-clients\n",
+                     stale_clients->len);
+  }
+
+  for (guint i = 0; i < accounts->len; i++) {
+    EvAccount *account = g_ptr_array_index (accounts, i);
+    g_autofree char *homeserver = NULL;
+
+    if (account->skipped)
+      continue;
+
+    if (account->client) {
+      start_client (account);
+      continue;
+    }
+
+    g_debug ("No client for %s yet, creating a new one", account->username);
+    ev_startup_profile_set_cold (TRUE);
+    if (account->homeserver) {
+      create_client (account, account->homeserver);
+      continue;
+    }
+
+    homeserver = homeserver_cache_lookup (account->username);
+    if (homeserver) {
+      g_debug ("Using cached homeserver %s for %s", homeserver, account->username);
+      create_client (account, homeserver);
+      continue;
+    }
+
+    cm_utils_get_homeserver_async (account->username,
+                                   HOMESERVER_LOOKUP_TIMEOUT,
+                                   cancel,
+                                   on_get_homeserver_ready,
+                                   account);
+  }
+}
+
+
+static gboolean
+load_config (GError **err)
+{
+  g_autoptr (GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr (GError) local_err = NULL;
+  g_autofree char *config_path = NULL;
+  g_auto (GStrv) groups = NULL;
+
+  /* TODO: ask, libcmatrix saves them in the login keyring anyway */
+  config_path = g_build_filename (g_get_user_config_dir (), EV_PROJECT, "accounts.cfg", NULL);
+
+  if (!g_key_file_load_from_file (keyfile, config_path, G_KEY_FILE_NONE, &local_err)) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to read config file %s: %s", config_path, local_err->message);
+    return FALSE;
+  }
+
+  groups = g_key_file_get_groups (keyfile, NULL);
+  for (guint i = 0; groups[i]; i++) {
+    g_autoptr (EvAccount) account = NULL;
+
+    if (!g_str_has_prefix (groups[i], "matrix-"))
+      continue;
+
+    account = g_new0 (EvAccount, 1);
+    account->room_sync_stats = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+    account->member_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                   (GDestroyNotify) g_ptr_array_unref);
+    account->device_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                   (GDestroyNotify) ev_device_list_free);
+    account->group = g_strdup (groups[i]);
+    account->username = g_key_file_get_string (keyfile, groups[i], "username", &local_err);
+    if (!account->username) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to get username for %s: %s", groups[i], local_err->message);
+      return FALSE;
+    }
+    account->password = g_key_file_get_string (keyfile, groups[i], "password", &local_err);
+    if (!account->password) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Failed to get password for %s: %s", groups[i], local_err->message);
+      return FALSE;
+    }
+    /* Optional, e.g. to use a local test server */
+    account->homeserver = g_key_file_get_string (keyfile, groups[i], "homeserver", NULL);
+
+    if (find_account (account->username)) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                   "Account %s configured more than once", account->username);
+      return FALSE;
+    }
+
+    if (only_accounts) {
+      account->skipped = !g_strv_contains ((const char * const *)only_accounts, account->username) &&
+        !g_strv_contains ((const char * const *)only_accounts, account->group);
+    }
+
+    if (!current && !account->skipped)
+      current = account;
+
+    g_ptr_array_add (accounts, g_steal_pointer (&account));
+  }
+
+  if (!accounts->len) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                 "No [matrix-NN] accounts in config file %s", config_path);
+    return FALSE;
+  }
+
+  for (guint i = 0; only_accounts && only_accounts[i]; i++) {
+    if (!find_account (only_accounts[i])) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "No account '%s' in config file %s", only_accounts[i], config_path);
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+
+void
+ev_matrix_init (const char *data_dir, const char *cache_dir, const char * const *only_accounts_)
+{
+  g_autofree char *media_dir = NULL;
+
+  cancel = g_cancellable_new ();
+  scheduler = ev_scheduler_new (cancel);
+  /* Transfers take as long as the file is large */
+  ev_scheduler_set_timeout (scheduler, "download", 0);
+  ev_scheduler_set_timeout (scheduler, "upload", 0);
+  accounts = g_ptr_array_new_with_free_func ((GDestroyNotify) ev_account_free);
+  stale_clients = g_ptr_array_new_with_free_func (g_object_unref);
+  only_accounts = g_strdupv ((GStrv)only_accounts_);
+  ev_sync_log_init ();
+  watchdog_id = g_timeout_add_seconds (WATCHDOG_INTERVAL, on_watchdog_timeout, NULL);
+  homeserver_cache = g_build_filename (cache_dir, "homeservers.cfg", NULL);
+  media_dir = g_build_filename (cache_dir, "media", NULL);
+  media_cache = ev_media_cache_new (media_dir, MEDIA_CACHE_MAX_SIZE);
+
+  /* The spec does not seem to specify which characters are actually valid
+   * https://spec.matrix.org/v1.11/appendices/#room-ids
+   * https://spec.matrix.org/v1.11/appendices/#room-aliases */
+  room_regex = g_regex_new ("^[!#].*:([a-z]+\\.?)+$",
+                            G_REGEX_CASELESS,
+                            G_REGEX_MATCH_DEFAULT,
+                            NULL);
+
+  ev_startup_profile_begin (EV_STARTUP_PHASE_DB_OPEN);
+  matrix = cm_matrix_new (data_dir, cache_dir, EV_APP_ID, FALSE);
+  cm_matrix_open_async (matrix, data_dir, "matrix.db", cancel, on_matrix_open, NULL);
+
+  /* Parse the config while the database opens in the background. Errors are
+   * reported once the main loop runs */
+  ev_startup_profile_begin (EV_STARTUP_PHASE_CONFIG);
+  load_config (&config_error);
+  ev_startup_profile_end (EV_STARTUP_PHASE_CONFIG);
+}
+
+
+void
+ev_matrix_destroy (void)
+{
+  g_cancellable_cancel (cancel);
+  g_clear_object (&cancel);
+  g_clear_object (&scheduler);
+  g_clear_object (&media_cache);
+  g_clear_pointer (&homeserver_cache, g_free);
+  g_clear_error (&config_error);
+
+  tail_stop ();
+  g_clear_pointer (&bench_send, bench_send_free);
+  ev_sync_log_destroy ();
+  g_clear_handle_id (&watchdog_id, g_source_remove);
+  current = NULL;
+  g_clear_pointer (&accounts, g_ptr_array_unref);
+  g_clear_pointer (&stale_clients, g_ptr_array_unref);
+  g_clear_pointer (&only_accounts, g_strfreev);
+  g_clear_object (&matrix);
+  g_clear_pointer (&room_regex, g_regex_unref);
+}
+
+
+static GString *
+ev_matrix_list_rooms (GStrv unused, GError **err)
+{
+  g_autoptr (GString) out = g_string_new ("");
+  GListModel *joined_rooms;
+  EvAccount *account;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  joined_rooms = account->joined_rooms;
+  if (!joined_rooms || g_list_model_get_n_items (joined_rooms) == 0) {
+    g_string_append (out, "No joined rooms\n");
+    return g_steal_pointer (&out);
+  }
+
+  for (guint i = 0; i < g_list_model_get_n_items (joined_rooms); i++) {
+    g_autoptr (CmRoom) room = g_list_model_get_item (joined_rooms, i);
+
+    g_string_append_printf (out, "  Room name: %s, room id: %s\n",
+                            cm_room_get_name (room),
+                            cm_room_get_id (room));
+  }
+
+  return g_steal_pointer (&out);
+}
+
+
+static GString *
+ev_matrix_room_details (GStrv args, GError **err)
+{
+  g_autoptr (EvFormatBuilder) builder = ev_format_builder_new ();
+  g_autoptr (CmRoom) room = NULL;
+  const char *room_id;
+  GListModel *events;
+  GPtrArray *members;
+  EvAccount *account;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  if (g_strv_length (args) < 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+    return NULL;
+  }
+  room_id = args[0];
+
+  room = get_joined_room_by_id (account, room_id);
+  if (!room) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", room_id);
+    return NULL;
+  }
+
+  ev_format_builder_set_indent (builder, INFO_INDENT);
+  ev_format_builder_add (builder, _("Room Id"), cm_room_get_id (room));
+  /* Translators: a matrix room name */
+  ev_format_builder_add (builder, _("Name"), cm_room_get_name (room));
+  ev_format_builder_add_nonnull (builder, _("Topic"), cm_room_get_topic (room));
+  ev_format_builder_add (builder, _("Encrypted"),
+                         cm_room_is_encrypted (room) ? _("Yes") : _("No"));
+  ev_format_builder_take_value (builder, _("Unread notifications"),
+                                g_strdup_printf ("%ld", cm_room_get_unread_notification_counts (room)));
+
+  events = cm_room_get_events_list (room);
+  ev_format_builder_take_value (builder, _("Events"),
+                                g_strdup_printf ("%u", g_list_model_get_n_items (events)));
+  members = g_hash_table_lookup (account->member_cache, room_id);
+  if (members) {
+    ev_format_builder_take_value (builder, _("Joined members"), g_strdup_printf ("%u", members->len));
+  } else {
+    ev_format_builder_add (builder, _("Joined members"), _("not loaded, see /members"));
+  }
+
+  return ev_format_builder_end (builder);
+}
+
+
+typedef struct {
+  char *user_id;
+  char *display_name;
+} EvMember;
+
+
+static void
+ev_member_free (EvMember *member)
+{
+  g_free (member->user_id);
+  g_free (member->display_name);
+  g_free (member);
+}
+
+
+static int
+compare_members (gconstpointer a, gconstpointer b)
+{
+  const EvMember *member_a = *(EvMember **)a;
+  const EvMember *member_b = *(EvMember **)b;
+
+  return g_strcmp0 (member_a->user_id, member_b->user_id);
+}
+
+
+static void
+on_load_members_ready (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  EvSchedulerJob *job = user_data;
+  GError *err = NULL;
+
+  cm_room_load_joined_members_finish (CM_ROOM (object), result, &err);
+  ev_scheduler_job_return (job, err);
+}
+
+
+static void
+load_members_run (EvSchedulerJob *job, GCancellable *cancellable, gpointer user_data)
+{
+  CmRoom *room = user_data;
+
+  cm_room_load_joined_members_async (room, cancellable, on_load_members_ready, job);
+}
+
+/*
+ * Returns the cached members of a room sorted by user id, fetching
+ * them from the server on first use.
+ */
+static GPtrArray *
+get_room_members (EvAccount *account, CmRoom *room, GError **err)
+{
+  GPtrArray *members;
+  GListModel *joined;
+
+  members = g_hash_table_lookup (account->member_cache, cm_room_get_id (room));
+  if (members)
+    return members;
+
+  if (!ev_scheduler_run_sync (scheduler, cm_client_get_homeserver (account->client), "members",
+                              EV_SCHEDULER_FLAG_IDEMPOTENT, load_members_run, room, err))
+    return NULL;
+
+  joined = cm_room_get_joined_members (room);
+  members = g_ptr_array_new_full (g_list_model_get_n_items (joined), (GDestroyNotify) ev_member_free);
+  for (guint i = 0; i < g_list_model_get_n_items (joined); i++) {
+    g_autoptr (CmUser) user = g_list_model_get_item (joined, i);
+    EvMember *member = g_new0 (EvMember, 1);
+
+    member->user_id = g_strdup (cm_user_get_id (user));
+    member->display_name = g_strdup (cm_user_get_display_name (user));
+    g_ptr_array_add (members, member);
+  }
+  g_ptr_array_sort (members, compare_members);
+
+  g_hash_table_insert (account->member_cache, g_strdup (cm_room_get_id (room)), members);
+
+  return members;
+}
+
+
+static gboolean
+parse_uint_arg (const char *name, const char *value, guint *out, GError **err)
+{
+  guint64 parsed;
+
+  if (!value) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "%s needs a value", name);
+    return FALSE;
+  }
+
+  if (!g_ascii_string_to_unsigned (value, 10, 0, G_MAXUINT, &parsed, err))
+    return FALSE;
+
+  *out = parsed;
+  return TRUE;
+}
+
+
+static GString *
+ev_matrix_members (GStrv args, GError **err)
+{
+  g_autoptr (GString) out = g_string_new ("");
+  g_autoptr (CmRoom) room = NULL;
+  g_autoptr (GError) local_err = NULL;
+  guint limit = MEMBERS_DEFAULT_LIMIT, offset = 0, end;
+  gboolean cached;
+  GPtrArray *members;
+  EvAccount *account;
+  gint64 start;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  if (g_strv_length (args) < 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+    return NULL;
+  }
+
+  for (guint i = 1; args[i]; i++) {
+    if (g_str_equal (args[i], "--limit")) {
+      if (!parse_uint_arg (args[i], args[i + 1], &limit, err))
+        return NULL;
+      if (!limit) {
+        g_set_error (err, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "--limit must be at least 1");
+        return NULL;
+      }
+      i++;
+    } else if (g_str_equal (args[i], "--offset")) {
+      if (!parse_uint_arg (args[i], args[i + 1], &offset, err))
+        return NULL;
+      i++;
+    } else if (g_str_equal (args[i], "--membership")) {
+      if (!args[i + 1]) {
+        g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "--membership needs a value");
+        return NULL;
+      }
+      /* libcmatrix only tracks joined members */
+      if (!g_str_equal (args[i + 1], "join")) {
+        g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                     "Only joined members are known, can't list '%s'", args[i + 1]);
+        return NULL;
+      }
+      i++;
+    } else {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown argument '%s'", args[i]);
+      return NULL;
+    }
+  }
+
+  room = get_joined_room_by_id (account, args[0]);
+  if (!room) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", args[0]);
+    return NULL;
+  }
+
+  start = g_get_monotonic_time ();
+  cached = !!g_hash_table_lookup (account->member_cache, cm_room_get_id (room));
+  members = get_room_members (account, room, &local_err);
+  if (!members) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to load members: %s", local_err->message);
+    return NULL;
+  }
+
+  if (offset >= members->len) {
+    return g_string_new_take (g_strdup_printf ("No members at offset %u, the room has %u joined members",
+                                               offset, members->len));
+  }
+
+  end = MIN ((guint64) offset + limit, members->len);
+  for (guint i = offset; i < end; i++) {
+    EvMember *member = g_ptr_array_index (members, i);
+
+    g_string_append_printf (out, "%*s%s", INFO_INDENT, "", member->user_id);
+    if (member->display_name)
+      g_string_append_printf (out, " (%s)", member->display_name);
+    g_string_append (out, "\n");
+  }
+
+  g_string_append_printf (out, "%*sShowing %u-%u of %u joined members, %s in %" G_GINT64_FORMAT " ms",
+                          INFO_INDENT, "", offset + 1, end, members->len,
+                          cached ? "cached" : "fetched",
+                          (g_get_monotonic_time () - start) / 1000);
+
+  return g_steal_pointer (&out);
+}
+
+
+static GString *
+ev_matrix_member (GStrv args, GError **err)
+{
+  g_autoptr (EvFormatBuilder) builder = ev_format_builder_new ();
+  g_autoptr (CmRoom) room = NULL;
+  g_autoptr (GError) local_err = NULL;
+  EvMember *found = NULL;
+  GPtrArray *members;
+  EvAccount *account;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  if (g_strv_length (args) != 2) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Need a room and a user id");
+    return NULL;
+  }
+
+  room = get_joined_room_by_id (account, args[0]);
+  if (!room) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", args[0]);
+    return NULL;
+  }
+
+  members = get_room_members (account, room, &local_err);
+  if (!members) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to load members: %s", local_err->message);
+    return NULL;
+  }
+
+  for (guint i = 0; i < members->len; i++) {
+    EvMember *member = g_ptr_array_index (members, i);
+
+    if (g_str_equal (member->user_id, args[1])) {
+      found = member;
+      break;
+    }
+  }
+
+  if (!found) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "%s is not a member of %s", args[1], args[0]);
+    return NULL;
+  }
+
+  ev_format_builder_set_indent (builder, INFO_INDENT);
+  ev_format_builder_add (builder, _("User Id"), found->user_id);
+  ev_format_builder_add_nonnull (builder, _("Display name"), found->display_name);
+  ev_format_builder_add (builder, _("Membership"), "join");
+
+  return ev_format_builder_end (builder);
+}
+
+
+static GString *
+ev_matrix_room_events (GStrv args, GError **err)
+{
+  g_autoptr (EvFormatBuilder) builder = ev_format_builder_new ();
+  g_autoptr (CmRoom) room = NULL;
+  const char *room_id;
+  GListModel *events;
+  EvAccount *account;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  if (g_strv_length (args) < 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+    return NULL;
+  }
+  room_id = args[0];
+
+  room = get_joined_room_by_id (account, room_id);
+  if (!room) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", room_id);
+    return NULL;
+  }
+
+  events = cm_room_get_events_list (room);
+
+  ev_format_builder_set_indent (builder, INFO_INDENT);
+
+  ev_format_builder_take_value (builder, _("Events"),
+                                g_strdup_printf ("%u", g_list_model_get_n_items (events)));
+  for (guint i = 0; i < g_list_model_get_n_items (events); i++) {
+    g_autoptr (CmEvent) event = g_list_model_get_item (events, i);
+    CmEventType type = cm_event_get_m_type (event);
+
+    ev_format_builder_add_newline (builder);
+    ev_format_builder_add (builder, _("Event Id"), cm_event_get_id (CM_EVENT (event)));
+    /* Translators: A matrix message event type */
+    ev_format_builder_take_value (builder, _("Type"), ev_enum_to_nick (CM_TYPE_EVENT_TYPE, type));
+
+    if (type == CM_M_ROOM_MESSAGE) {
+      CmContentType content_type;
+      CmRoomMessageEvent *rev = CM_ROOM_MESSAGE_EVENT (event);
+
+      content_type = cm_room_message_event_get_msg_type (rev);
+      ev_format_builder_take_value (builder, _("Content-Type"), ev_enum_to_nick (CM_TYPE_CONTENT_TYPE,
+                                                                                 content_type));
+      if (content_type == CM_CONTENT_TYPE_TEXT) {
+        ev_format_builder_add (builder, _("Body"),
+                               cm_room_message_event_get_body (rev));
+      }
+    }
+  }
+
+  return ev_format_builder_end (builder);
+}
+
+
+static char *
+format_fingerprint (const char *key)
+{
+  GString *fp = g_string_new (NULL);
+
+  while (key && *key) {
+    g_autofree char *chunk = g_strndup (key, 4);
+
+    g_string_append_printf (fp, "%s ", chunk);
+    key = key + strlen (chunk);
+  }
+
+  return g_string_free (fp, FALSE);
+}
+
+
+static GString *
+ev_matrix_client_details (GStrv unused, GError **err)
+{
+  g_autoptr (EvFormatBuilder) builder = ev_format_builder_new ();
+  gboolean logged_in;
+  const char *device_id;
+  EvAccount *account;
+  CmClient *client;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+  client = account->client;
+
+  device_id = cm_client_get_device_id (client);
+  ev_format_builder_set_indent (builder, INFO_INDENT);
+  ev_format_builder_add (builder, _("User"), cm_client_get_user_id (client));
+  ev_format_builder_add (builder, _("Home server"), cm_client_get_homeserver (client));
+  ev_format_builder_add (builder, _("Device ID"), device_id ?: "not logged in");
+  if (device_id)
+    ev_format_builder_take_value (builder, _("Fingerprint"),
+                                  format_fingerprint (cm_client_get_ed25519_key (client)));
+  logged_in = cm_client_get_logged_in (client);
+  ev_format_builder_add (builder, _("Logged in"), logged_in ? _("yes") : _("no"));
+  if (!logged_in)
+    ev_format_builder_add (builder, _("Logging in"), cm_client_get_logging_in (client) ? _("yes") : _("no"));
+
+  ev_format_builder_take_value (builder, _("Events/s"),
+                                g_strdup_printf (_("%.1f last minute"),
+                                                 ev_sync_stats_get_rate (&account->sync_stats)));
+  ev_format_builder_take_value (builder, _("Delivery lag"),
+                                ev_histogram_format (&account->sync_stats.lag, " ms"));
+
+  return ev_format_builder_end (builder);
+}
+
+
+typedef struct _EvDevicesQuery EvDevicesQuery;
+
+typedef struct {
+  EvDevicesQuery *query;
+  CmUser         *user;     /* Only set when fetched */
+  GError         *error;
+} EvLoadDevicesData;
+
+/**
+ * EvDevicesQuery:
+ *
+ * A /devices invocation waiting for the device lists it fetches
+ */
+struct _EvDevicesQuery {
+  EvAccount         *account;
+  char              *room_id;
+  GPtrArray         *users;
+  EvLoadDevicesData *loads;
+  guint              pending;
+  guint              n_fetched;
+  gint64             started;
+};
+
+
+static void
+devices_query_free (EvDevicesQuery *query)
+{
+  for (guint i = 0; i < query->users->len; i++)
+    g_clear_error (&query->loads[i].error);
+
+  g_free (query->loads);
+  g_ptr_array_unref (query->users);
+  g_free (query->room_id);
+  g_free (query);
+}
+
+
+static GString *
+devices_query_format (EvDevicesQuery *query)
+{
+  GString *out = g_string_new ("");
+
+  for (guint i = 0; i < query->users->len; i++) {
+    CmUser *user = g_ptr_array_index (query->users, i);
+    EvDeviceList *list = g_hash_table_lookup (query->account->device_cache, cm_user_get_id (user));
+
+    g_string_append_printf (out, "%*s%s", INFO_INDENT, "", cm_user_get_id (user));
+    if (query->loads[i].error) {
+      g_string_append_printf (out, ": %s\n", query->loads[i].error->message);
+      continue;
+    }
+
+    if (!list) {
+      g_string_append (out, ": no devices\n");
+      continue;
+    }
+
+    g_string_append_printf (out, " (%u devices, %s)\n", list->devices->len,
+                            query->loads[i].user ? "fetched" : "cached");
+    for (guint j = 0; j < list->devices->len; j++) {
+      EvDevice *device = g_ptr_array_index (list->devices, j);
+      g_autofree char *fp = format_fingerprint (device->ed25519);
+
+      g_string_append_printf (out, "%*s%-12s %-24s %s\n", 2 * INFO_INDENT, "",
+                              device->id, device->name ?: "", fp);
+    }
+  }
+
+  g_string_append_printf (out, "%*s%u users, %u fetched in %" G_GINT64_FORMAT " ms", INFO_INDENT, "",
+                          query->users->len, query->n_fetched,
+                          (g_get_monotonic_time () - query->started) / 1000);
+
+  return out;
+}
+
+
+static void
+on_load_devices_ready (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  EvSchedulerJob *job = user_data;
+  EvLoadDevicesData *data = ev_scheduler_job_get_user_data (job);
+  g_autoptr (GListModel) devices = NULL;
+  EvDeviceList *list;
+  GError *err = NULL;
+
+  devices = cm_user_load_devices_finish (CM_USER (object), result, &err);
+  if (!devices) {
+    ev_scheduler_job_return (job, err);
+    return;
+  }
+
+  list = g_new0 (EvDeviceList, 1);
+  list->fetched = g_get_monotonic_time ();
+  list->devices = g_ptr_array_new_with_free_func ((GDestroyNotify) ev_device_free);
+  for (guint i = 0; i < g_list_model_get_n_items (devices); i++) {
+    g_autoptr (CmDevice) cm_device = g_list_model_get_item (devices, i);
+    EvDevice *device = g_new0 (EvDevice, 1);
+
+    device->id = g_strdup (cm_device_get_id (cm_device));
+    device->name = g_strdup (cm_device_get_device_name (cm_device));
+    device->ed25519 = g_strdup (cm_device_get_ed_key (cm_device));
+    g_ptr_array_add (list->devices, device);
+  }
+  g_hash_table_insert (data->query->account->device_cache,
+                       g_strdup (cm_user_get_id (data->user)), list);
+
+  ev_scheduler_job_return (job, NULL);
+}
+
+
+static void
+load_devices_run (EvSchedulerJob *job, GCancellable *cancellable, gpointer user_data)
+{
+  EvLoadDevicesData *data = user_data;
+
+  cm_user_load_devices_async (data->user, cancellable, on_load_devices_ready, job);
+}
+
+
+static void
+load_devices_done (EvSchedulerJob *job, const GError *error, gpointer user_data)
+{
+  EvLoadDevicesData *data = user_data;
+  EvDevicesQuery *query = data->query;
+  g_autoptr (GString) out = NULL;
+
+  data->error = error ? g_error_copy (error) : NULL;
+  if (--query->pending)
+    return;
+
+  out = devices_query_format (query);
+  ev_prompt_print ("Devices of %s:\n%s\n", query->room_id, out->str);
+  devices_query_free (query);
+}
+
+
+static GString *
+ev_matrix_devices (GStrv args, GError **err)
+{
+  g_autoptr (GPtrArray) users = g_ptr_array_new_with_free_func (g_object_unref);
+  g_autoptr (CmRoom) room = NULL;
+  g_autoptr (GError) local_err = NULL;
+  EvDevicesQuery *query;
+  gboolean refresh = FALSE;
+  guint n_users = 0;
+  GListModel *joined;
+  EvAccount *account;
+  gint64 now;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  if (g_strv_length (args) < 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+    return NULL;
+  }
+
+  room = get_joined_room_by_id (account, args[0]);
+  if (!room) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", args[0]);
+    return NULL;
+  }
+
+  for (guint i = 1; args[i]; i++) {
+    if (g_str_equal (args[i], "--refresh"))
+      refresh = TRUE;
+    else
+      n_users++;
+  }
+
+  /* Makes sure libcmatrix knows the room's members */
+  if (!get_room_members (account, room, &local_err)) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to load members: %s", local_err->message);
+    return NULL;
+  }
+
+  joined = cm_room_get_joined_members (room);
+  for (guint i = 0; i < g_list_model_get_n_items (joined); i++) {
+    g_autoptr (CmUser) user = g_list_model_get_item (joined, i);
+    gboolean wanted = !n_users;
+
+    for (guint j = 1; args[j] && !wanted; j++)
+      wanted = g_str_equal (args[j], cm_user_get_id (user));
+
+    if (wanted)
+      g_ptr_array_add (users, g_steal_pointer (&user));
+  }
+
+  if (n_users && users->len != n_users) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                 "Only %u of %u users are members of %s", users->len, n_users, args[0]);
+    return NULL;
+  }
+
+  query = g_new0 (EvDevicesQuery, 1);
+  query->account = account;
+  query->room_id = g_strdup (cm_room_get_id (room));
+  query->users = g_steal_pointer (&users);
+  query->loads = g_new0 (EvLoadDevicesData, query->users->len);
+  query->started = now = g_get_monotonic_time ();
+
+  /* Query all users that aren't cached concurrently */
+  for (guint i = 0; i < query->users->len; i++) {
+    CmUser *user = g_ptr_array_index (query->users, i);
+    EvDeviceList *list = g_hash_table_lookup (account->device_cache, cm_user_get_id (user));
+
+    if (list && !refresh && now - list->fetched < DEVICES_CACHE_TTL * G_USEC_PER_SEC)
+      continue;
+
+    query->loads[i].query = query;
+    query->loads[i].user = user;
+    query->pending++;
+    query->n_fetched++;
+  }
+
+  /* Everything is cached */
+  if (!query->pending) {
+    GString *out = devices_query_format (query);
+
+    devices_query_free (query);
+    return out;
+  }
+
+  for (guint i = 0; i < query->users->len; i++) {
+    if (!query->loads[i].user)
+      continue;
+
+    ev_scheduler_submit (scheduler, cm_client_get_homeserver (account->client),
+                         EV_SCHEDULER_LANE_INTERACTIVE, "devices", EV_SCHEDULER_FLAG_IDEMPOTENT,
+                         load_devices_run, load_devices_done, &query->loads[i]);
+  }
+
+  return g_string_new_take (g_strdup_printf ("Fetching devices of %u of %u users",
+                                             query->n_fetched, query->users->len));
+}
+
+
+static GString *
+ev_matrix_tail (GStrv args, GError **err)
+{
+  g_autoptr (GHashTable) rooms = NULL;
+  EvAccount *account;
+
+  if (args[0] && g_str_equal (args[0], "--stop")) {
+    GString *out;
+
+    if (args[1]) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Too many arguments");
+      return NULL;
+    }
+
+    if (!tail) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not tailing any rooms");
+      return NULL;
+    }
+
+    out = g_string_new (NULL);
+    g_string_append_printf (out, "Stopped tail, showed %" G_GUINT64_FORMAT " events, "
+                            "dropped %" G_GUINT64_FORMAT,
+                            tail->n_shown, ev_ring_get_n_evicted (tail->ring));
+    tail_stop ();
+    return out;
+  }
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  for (guint i = 0; args[i]; i++) {
+    g_autoptr (CmRoom) room = get_joined_room_by_id (account, args[i]);
+
+    if (!room) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", args[i]);
+      return NULL;
+    }
+
+    if (!rooms)
+      rooms = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    g_hash_table_add (rooms, g_strdup (args[i]));
+  }
+
+  tail_stop ();
+  tail = g_new0 (EvTail, 1);
+  tail->account = account;
+  tail->rooms = g_steal_pointer (&rooms);
+  tail->ring = ev_ring_new (sizeof (EvTailEntry), TAIL_CAPACITY,
+                            (GDestroyNotify) tail_entry_clear);
+
+  if (tail->rooms) {
+    return g_string_new_take (g_strdup_printf ("Tailing %u rooms of %s, /tail --stop to stop",
+                                               g_hash_table_size (tail->rooms),
+                                               account->username));
+  }
+
+  return g_string_new_take (g_strdup_printf ("Tailing all rooms of %s, /tail --stop to stop",
+                                             account->username));
+}
+
+
+static GString *
+ev_matrix_room_load_past_events (GStrv args, GError **err)
+{
+  g_autoptr (GError) local_err = NULL;
+  g_autoptr (CmRoom) room = NULL;
+  const char *room_id;
+  gboolean success;
+  EvAccount *account;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  if (g_strv_length (args) < 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+    return NULL;
+  }
+  room_id = args[0];
+
+  room = get_joined_room_by_id (account, room_id);
+  if (!room) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", room_id);
+    return NULL;
+  }
+
+  success = cm_room_load_past_events_sync (room, &local_err);
+  if (!success) {
+    if (local_err) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   _("Failed to load events: %s"), local_err->message);
+      return NULL;
+    } else {
+      g_string_new (_("No events loaded from database"));
+    }
+  }
+
+  return g_string_new (_("Loaded events from database"));
+}
+
+
+typedef struct {
+  CmRoom     *room;
+  const char *event_id;
+  CmEvent    *event;
+} EvGetEventData;
+
+
+static void
+on_get_event_ready (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  EvSchedulerJob *job = user_data;
+  EvGetEventData *data = ev_scheduler_job_get_user_data (job);
+  GError *err = NULL;
+
+  data->event = cm_room_get_event_finish (CM_ROOM (object), result, &err);
+  ev_scheduler_job_return (job, err);
+}
+
+
+static void
+get_event_run (EvSchedulerJob *job, GCancellable *cancellable, gpointer user_data)
+{
+  EvGetEventData *data = user_data;
+
+  cm_room_get_event_async (data->room, data->event_id, cancellable, on_get_event_ready, job);
+}
+
+
+static GString *
+ev_matrix_room_get_event (GStrv args, GError **err)
+{
+  EvGetEventData data = { 0 };
+  g_autoptr (GError) local_err = NULL;
+  g_autoptr (CmEvent) event = NULL;
+  g_autoptr (GString) out = g_string_new ("");
+  g_autoptr (CmRoom) room = NULL;
+  g_autofree char *nick = NULL;
+  const char *room_id, *event_id;
+  CmUser *user;
+  GListModel *events;
+  EvAccount *account;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  if (g_strv_length (args) < 2) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+    return NULL;
+  }
+  room_id = args[0];
+  event_id = args[1];
+
+  room = get_joined_room_by_id (account, room_id);
+  if (!room) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", room_id);
+    return NULL;
+  }
+
+  events = cm_room_get_events_list (room);
+  for (guint i = 0; i < g_list_model_get_n_items (events); i++) {
+    g_autoptr (CmEvent) e = g_list_model_get_item (events, i);
+    const char *id = cm_event_get_id (e);
+
+    if (g_str_equal (event_id, id)) {
+      event = g_steal_pointer (&e);
+      g_string_append_printf (out, "  Found cached event %s\n", id);
+      break;
+    }
+  }
+
+  if (event)
+    goto print;
+
+  data.room = room;
+  data.event_id = event_id;
+  ev_scheduler_run_sync (scheduler, cm_client_get_homeserver (account->client), "room-get-event",
+                         EV_SCHEDULER_FLAG_IDEMPOTENT, get_event_run, &data, &local_err);
+  event = data.event;
+  if (!event && local_err) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to get event: %s", local_err->message);
+    return NULL;
+  }
+  if (!event) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                 "Event %s not found", event_id);
+    return NULL;
+  }
+
+ print:
+  nick = ev_enum_to_nick (CM_TYPE_EVENT_TYPE, cm_event_get_m_type (event));
+  user = cm_event_get_sender (event);
+  g_string_append_printf (out, "    Message type: %s\n", nick);
+  g_string_append_printf (out, "       Sender id: %s\n", cm_user_get_id (user));
+
+  if (CM_IS_ROOM_MESSAGE_EVENT (event)) {
+    CmRoomMessageEvent *room_msg = CM_ROOM_MESSAGE_EVENT (event);
+
+    if (cm_room_message_event_get_msg_type (room_msg))
+      g_string_append_printf (out, "       Text message: %s",
+                              cm_room_message_event_get_body (room_msg));
+  }
+
+  return g_steal_pointer (&out);
+}
+
+
+static CmEvent *
+find_event (EvAccount *account, CmRoom *room, const char *event_id, GError **err)
+{
+  EvGetEventData data = { 0 };
+  GListModel *events = cm_room_get_events_list (room);
+
+  for (guint i = 0; i < g_list_model_get_n_items (events); i++) {
+    g_autoptr (CmEvent) event = g_list_model_get_item (events, i);
+
+    if (g_strcmp0 (event_id, cm_event_get_id (event)) == 0)
+      return g_steal_pointer (&event);
+  }
+
+  data.room = room;
+  data.event_id = event_id;
+  if (!ev_scheduler_run_sync (scheduler, cm_client_get_homeserver (account->client), "room-get-event",
+                              EV_SCHEDULER_FLAG_IDEMPOTENT, get_event_run, &data, err))
+    return NULL;
+
+  return data.event;
+}
+
+
+static gboolean
+event_has_file (CmEvent *event)
+{
+  CmContentType type;
+
+  if (!CM_IS_ROOM_MESSAGE_EVENT (event))
+    return FALSE;
+
+  type = cm_room_message_event_get_msg_type (CM_ROOM_MESSAGE_EVENT (event));
+  return type == CM_CONTENT_TYPE_FILE || type == CM_CONTENT_TYPE_IMAGE ||
+    type == CM_CONTENT_TYPE_AUDIO || type == CM_CONTENT_TYPE_VIDEO;
+}
+
+
+static char *
+get_event_file_name (CmEvent *event)
+{
+  const char *body = cm_room_message_event_get_body (CM_ROOM_MESSAGE_EVENT (event));
+  g_autofree char *name = NULL;
+
+  if (!body || !*body)
+    return g_strdup ("download");
+
+  /* The body is controlled by the sender, don't let it escape the target dir */
+  name = g_path_get_basename (body);
+  if (g_str_equal (name, ".") || g_str_equal (name, "..") || g_str_equal (name, G_DIR_SEPARATOR_S))
+    return g_strdup ("download");
+
+  return g_steal_pointer (&name);
+}
+
+
+static void
+download_entry_free (EvDownloadEntry *entry)
+{
+  g_clear_object (&entry->event);
+  g_clear_object (&entry->file);
+  g_clear_object (&entry->part);
+  g_clear_object (&entry->in);
+  g_clear_object (&entry->out);
+  g_free (entry);
+}
+
+
+static void
+download_batch_free (EvDownloadBatch *batch)
+{
+  g_ptr_array_unref (batch->entries);
+  g_free (batch);
+}
+
+
+static void
+on_media_cache_stored (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  g_autoptr (GError) err = NULL;
+
+  if (!ev_media_cache_store_finish (EV_MEDIA_CACHE (object), result, &err))
+    g_warning ("Failed to add download to media cache: %s", err->message);
+}
+
+
+static void
+on_download_spliced (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  EvSchedulerJob *job = user_data;
+  EvDownloadEntry *entry = ev_scheduler_job_get_user_data (job);
+  GError *err = NULL;
+  gssize written;
+
+  written = g_output_stream_splice_finish (G_OUTPUT_STREAM (object), result, &err);
+  g_clear_object (&entry->in);
+  g_clear_object (&entry->out);
+  if (written < 0) {
+    ev_scheduler_job_return (job, err);
+    return;
+  }
+
+  entry->bytes += written;
+  if (!g_file_move (entry->part, entry->file, G_FILE_COPY_OVERWRITE, NULL, NULL, NULL, &err)) {
+    ev_scheduler_job_return (job, err);
+    return;
+  }
+
+  ev_media_cache_store_async (media_cache, cm_event_get_id (entry->event), entry->file,
+                              cancel, on_media_cache_stored, NULL);
+  ev_scheduler_job_return (job, NULL);
+}
+
+
+static void
+on_download_part_opened (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  EvSchedulerJob *job = user_data;
+  EvDownloadEntry *entry = ev_scheduler_job_get_user_data (job);
+  GFileOutputStream *out;
+  GError *err = NULL;
+
+  if (entry->resumed)
+    out = g_file_append_to_finish (G_FILE (object), result, &err);
+  else
+    out = g_file_replace_finish (G_FILE (object), result, &err);
+
+  if (!out) {
+    ev_scheduler_job_return (job, err);
+    return;
+  }
+
+  entry->out = G_OUTPUT_STREAM (out);
+  /* Data goes straight from the network to the file */
+  g_output_stream_splice_async (entry->out, entry->in,
+                                G_OUTPUT_STREAM_SPLICE_CLOSE_SOURCE |
+                                G_OUTPUT_STREAM_SPLICE_CLOSE_TARGET,
+                                G_PRIORITY_LOW, entry->cancellable,
+                                on_download_spliced, job);
+}
+
+
+static void
+download_open_part (EvSchedulerJob *job)
+{
+  EvDownloadEntry *entry = ev_scheduler_job_get_user_data (job);
+
+  if (entry->resumed) {
+    g_file_append_to_async (entry->part, G_FILE_CREATE_NONE, G_PRIORITY_LOW,
+                            entry->cancellable, on_download_part_opened, job);
+  } else {
+    g_file_replace_async (entry->part, NULL, FALSE, G_FILE_CREATE_NONE, G_PRIORITY_LOW,
+                          entry->cancellable, on_download_part_opened, job);
+  }
+}
+
+
+static void on_download_get_file_ready (GObject *object, GAsyncResult *result, gpointer user_data);
+
+
+static void
+on_download_part_deleted (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  EvSchedulerJob *job = user_data;
+  EvDownloadEntry *entry = ev_scheduler_job_get_user_data (job);
+  GError *err = NULL;
+
+  if (!g_file_delete_finish (G_FILE (object), result, &err) &&
+      !g_error_matches (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+    ev_scheduler_job_return (job, err);
+    return;
+  }
+  g_clear_error (&err);
+
+  /* The content was consumed while skipping, fetch it again */
+  cm_room_message_event_get_file_async (CM_ROOM_MESSAGE_EVENT (entry->event), entry->cancellable,
+                                        NULL, NULL, on_download_get_file_ready, job);
+}
+
+
+static void
+on_download_skipped (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  EvSchedulerJob *job = user_data;
+  EvDownloadEntry *entry = ev_scheduler_job_get_user_data (job);
+  GError *err = NULL;
+  gssize skipped;
+
+  skipped = g_input_stream_skip_finish (G_INPUT_STREAM (object), result, &err);
+  if (skipped < 0) {
+    ev_scheduler_job_return (job, err);
+    return;
+  }
+
+  /* The partial download is larger than the file so it's not a prefix
+   * of it. Retrying would fail the same way, start over instead. */
+  if (skipped == 0) {
+    g_debug ("Partial download of %s is larger than the file, restarting",
+             cm_event_get_id (entry->event));
+    g_clear_object (&entry->in);
+    g_file_delete_async (entry->part, G_PRIORITY_LOW, entry->cancellable,
+                         on_download_part_deleted, job);
+    return;
+  }
+
+  entry->skipped += skipped;
+  if (entry->skipped < entry->resumed) {
+    g_input_stream_skip_async (entry->in, entry->resumed - entry->skipped, G_PRIORITY_LOW,
+                               entry->cancellable, on_download_skipped, job);
+    return;
+  }
+
+  download_open_part (job);
+}
+
+
+static void
+on_download_get_file_ready (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  EvSchedulerJob *job = user_data;
+  EvDownloadEntry *entry = ev_scheduler_job_get_user_data (job);
+  g_autoptr (GFileInfo) info = NULL;
+  GError *err = NULL;
+
+  entry->in = cm_room_message_event_get_file_finish (CM_ROOM_MESSAGE_EVENT (object), result, &err);
+  if (!entry->in) {
+    ev_scheduler_job_return (job, err);
+    return;
+  }
+
+  /* Resume a previous attempt. The media API doesn't support ranges so
+   * the content already on disk is skipped rather than written again */
+  info = g_file_query_info (entry->part, G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                            G_FILE_QUERY_INFO_NONE, NULL, NULL);
+  entry->resumed = info ? g_file_info_get_size (info) : 0;
+  entry->skipped = 0;
+  if (!entry->resumed) {
+    download_open_part (job);
+    return;
+  }
+
+  g_input_stream_skip_async (entry->in, entry->resumed, G_PRIORITY_LOW,
+                             entry->cancellable, on_download_skipped, job);
+}
+
+
+static void
+download_run (EvSchedulerJob *job, GCancellable *cancellable, gpointer user_data)
+{
+  EvDownloadEntry *entry = user_data;
+
+  /* Left over from a failed attempt */
+  g_clear_object (&entry->in);
+  g_clear_object (&entry->out);
+
+  entry->cancellable = cancellable;
+  entry->started = g_get_monotonic_time ();
+  cm_room_message_event_get_file_async (CM_ROOM_MESSAGE_EVENT (entry->event), cancellable,
+                                        NULL, NULL, on_download_get_file_ready, job);
+}
+
+
+static void
+download_entry_done (EvDownloadEntry *entry, const GError *error)
+{
+  EvDownloadBatch *batch = entry->batch;
+  g_autofree char *path = g_file_get_path (entry->file);
+  gint64 duration = MAX (g_get_monotonic_time () - entry->started, 1);
+
+  batch->done++;
+  if (error) {
+    batch->failed++;
+    ev_prompt_print ("  [%u/%u] Failed to download %s: %s\n", batch->done, batch->entries->len,
+                     path, error->message);
+  } else {
+    batch->bytes += entry->bytes;
+    ev_prompt_print ("  [%u/%u] Downloaded %s, %" G_GOFFSET_FORMAT " bytes%s at %.1f KiB/s\n",
+                     batch->done, batch->entries->len, path, entry->bytes,
+                     entry->cached ? " (cached)" : entry->resumed ? " (resumed)" : "",
+                     (double) entry->bytes * G_USEC_PER_SEC / duration / 1024);
+  }
+
+  if (batch->done < batch->entries->len)
+    return;
+
+  if (batch->entries->len > 1) {
+    gint64 total = MAX (g_get_monotonic_time () - batch->started, 1);
+
+    ev_prompt_print ("Downloaded %u of %u files, %" G_GOFFSET_FORMAT " bytes in %.1f s, %.1f KiB/s\n",
+                     batch->done - batch->failed, batch->entries->len, batch->bytes,
+                     (double) total / G_USEC_PER_SEC,
+                     (double) batch->bytes * G_USEC_PER_SEC / total / 1024);
+  }
+  download_batch_free (batch);
+}
+
+
+static void
+download_done (EvSchedulerJob *job, const GError *error, gpointer user_data)
+{
+  download_entry_done (user_data, error);
+}
+
+
+static void
+on_download_copy_progress (goffset current_num_bytes, goffset total_num_bytes, gpointer user_data)
+{
+  EvDownloadEntry *entry = user_data;
+
+  entry->bytes = current_num_bytes;
+}
+
+
+static void
+on_download_cache_copied (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  EvDownloadEntry *entry = user_data;
+  g_autoptr (GError) err = NULL;
+
+  g_file_copy_finish (G_FILE (object), result, &err);
+  download_entry_done (entry, err);
+}
+
+
+static void
+download_batch_add (EvDownloadBatch *batch, CmEvent *event, const char *path)
+{
+  EvDownloadEntry *entry = g_new0 (EvDownloadEntry, 1);
+  g_autofree char *part = g_strdup_printf ("%s.part", path);
+
+  entry->batch = batch;
+  entry->event = g_object_ref (event);
+  entry->file = g_file_new_for_path (path);
+  entry->part = g_file_new_for_path (part);
+  g_ptr_array_add (batch->entries, entry);
+}
+
+
+static void
+download_batch_start (EvAccount *account, EvDownloadBatch *batch)
+{
+  batch->started = g_get_monotonic_time ();
+  for (guint i = 0; i < batch->entries->len; i++) {
+    EvDownloadEntry *entry = g_ptr_array_index (batch->entries, i);
+    g_autoptr (GFile) cached = ev_media_cache_lookup (media_cache, cm_event_get_id (entry->event));
+
+    if (cached) {
+      entry->cached = TRUE;
+      entry->started = g_get_monotonic_time ();
+      g_file_copy_async (cached, entry->file, G_FILE_COPY_OVERWRITE, G_PRIORITY_LOW, cancel,
+                         on_download_copy_progress, entry, on_download_cache_copied, entry);
+      continue;
+    }
+
+    ev_scheduler_submit (scheduler, cm_client_get_homeserver (account->client),
+                         EV_SCHEDULER_LANE_BULK, "download",
+                         EV_SCHEDULER_FLAG_IDEMPOTENT,
+                         download_run, download_done, entry);
+  }
+}
+
+
+static EvDownloadBatch *
+download_batch_new (void)
+{
+  EvDownloadBatch *batch = g_new0 (EvDownloadBatch, 1);
+
+  batch->entries = g_ptr_array_new_with_free_func ((GDestroyNotify) download_entry_free);
+  return batch;
+}
+
+
+static GString *
+ev_matrix_download (GStrv args, GError **err)
+{
+  g_autoptr (CmRoom) room = NULL;
+  g_autoptr (CmEvent) event = NULL;
+  g_autoptr (GError) local_err = NULL;
+  g_autofree char *path = NULL;
+  EvDownloadBatch *batch;
+  EvAccount *account;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  if (g_strv_length (args) < 2) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+    return NULL;
+  }
+
+  if (g_strv_length (args) > 3) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Too many arguments");
+    return NULL;
+  }
+
+  room = get_joined_room_by_id (account, args[0]);
+  if (!room) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", args[0]);
+    return NULL;
+  }
+
+  event = find_event (account, room, args[1], &local_err);
+  if (!event) {
+    if (local_err) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Failed to get event: %s", local_err->message);
+    } else {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Event %s not found", args[1]);
+    }
+    return NULL;
+  }
+
+  if (!event_has_file (event)) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Event %s has no attachment", args[1]);
+    return NULL;
+  }
+
+  path = args[2] ? g_strdup (args[2]) : get_event_file_name (event);
+
+  batch = download_batch_new ();
+  download_batch_add (batch, event, path);
+  download_batch_start (account, batch);
+
+  return g_string_new_take (g_strdup_printf ("Downloading to %s", path));
+}
+
+
+static GString *
+ev_matrix_download_all (GStrv args, GError **err)
+{
+  g_autoptr (GHashTable) names = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr (CmRoom) room = NULL;
+  const char *dir;
+  EvDownloadBatch *batch;
+  EvAccount *account;
+  GListModel *events;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  if (g_strv_length (args) < 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+    return NULL;
+  }
+
+  if (g_strv_length (args) > 2) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Too many arguments");
+    return NULL;
+  }
+
+  room = get_joined_room_by_id (account, args[0]);
+  if (!room) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", args[0]);
+    return NULL;
+  }
+
+  dir = args[1] ?: ".";
+  if (g_mkdir_with_parents (dir, 0755) < 0) {
+    g_set_error (err, G_IO_ERROR, g_io_error_from_errno (errno),
+                 "Failed to create %s: %s", dir, g_strerror (errno));
+    return NULL;
+  }
+
+  batch = download_batch_new ();
+  events = cm_room_get_events_list (room);
+  for (guint i = 0; i < g_list_model_get_n_items (events); i++) {
+    g_autoptr (CmEvent) event = g_list_model_get_item (events, i);
+    g_autofree char *name = NULL;
+    g_autofree char *path = NULL;
+
+    if (!event_has_file (event))
+      continue;
+
+    name = get_event_file_name (event);
+    /* Several attachments can share a name */
+    if (!g_hash_table_add (names, g_strdup (name))) {
+      char *unique = g_strdup_printf ("%u-%s", i, name);
+
+      g_free (name);
+      name = unique;
+    }
+
+    path = g_build_filename (dir, name, NULL);
+    download_batch_add (batch, event, path);
+  }
+
+  if (!batch->entries->len) {
+    download_batch_free (batch);
+    return g_string_new ("No attachments in loaded events, try /room-load-past-events");
+  }
+
+  download_batch_start (account, batch);
+
+  return g_string_new_take (g_strdup_printf ("Downloading %u files to %s", batch->entries->len, dir));
+}
+
+
+/* Returns the value of a `kB` field of /proc/self/status or -1 */
+static gint64
+get_proc_status_kb (const char *field)
+{
+  g_autofree char *status = NULL;
+  g_auto (GStrv) lines = NULL;
+  gsize len = strlen (field);
+
+  if (!g_file_get_contents ("/proc/self/status", &status, NULL, NULL))
+    return -1;
+
+  lines = g_strsplit (status, "\n", -1);
+  for (guint i = 0; lines[i]; i++) {
+    if (strncmp (lines[i], field, len) == 0 && lines[i][len] == ':')
+      return g_ascii_strtoll (lines[i] + len + 1, NULL, 10);
+  }
+
+  return -1;
+}
+
+
+typedef struct {
+  CmRoom  *room;
+  GFile   *file;
+  goffset  size;
+  goffset  uploaded;
+  gint64   started;      /* µs, monotonic */
+  gint64   rss_before;   /* kB */
+  gint64   rss_peak;     /* kB */
+  gint64   rss_sampled;  /* µs, monotonic */
+  char    *event_id;
+} EvUpload;
+
+
+static void
+ev_upload_free (EvUpload *upload)
+{
+  g_clear_object (&upload->room);
+  g_clear_object (&upload->file);
+  g_free (upload->event_id);
+  g_free (upload);
+}
+
+
+static void
+on_upload_progress (goffset current_num_bytes, goffset total_num_bytes, gpointer user_data)
+{
+  EvUpload *upload = user_data;
+  gint64 now = g_get_monotonic_time ();
+
+  upload->uploaded = current_num_bytes;
+
+  /* VmHWM is the peak over the process' lifetime, so sample the RSS
+   * while the upload runs instead */
+  if (now - upload->rss_sampled >= UPLOAD_RSS_INTERVAL * 1000) {
+    upload->rss_sampled = now;
+    upload->rss_peak = MAX (upload->rss_peak, get_proc_status_kb ("VmRSS"));
+  }
+}
+
+
+static void
+on_upload_ready (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  EvSchedulerJob *job = user_data;
+  EvUpload *upload = ev_scheduler_job_get_user_data (job);
+  GError *err = NULL;
+
+  upload->event_id = cm_room_send_file_finish (CM_ROOM (object), result, &err);
+  ev_scheduler_job_return (job, err);
+}
+
+
+static void
+upload_run (EvSchedulerJob *job, GCancellable *cancellable, gpointer user_data)
+{
+  EvUpload *upload = user_data;
+  g_autofree char *name = g_file_get_basename (upload->file);
+
+  upload->started = g_get_monotonic_time ();
+  /* libcmatrix streams the file to the media repo, encrypting it on the
+   * way in encrypted rooms */
+  cm_room_send_file_async (upload->room, upload->file, name,
+                           on_upload_progress, upload,
+                           cancellable, on_upload_ready, job);
+}
+
+
+static void
+upload_done (EvSchedulerJob *job, const GError *error, gpointer user_data)
+{
+  EvUpload *upload = user_data;
+  g_autofree char *path = g_file_get_path (upload->file);
+  gint64 duration = MAX (g_get_monotonic_time () - upload->started, 1);
+  gint64 rss;
+
+  if (error) {
+    ev_prompt_print ("Failed to upload %s after %" G_GOFFSET_FORMAT " bytes: %s\n",
+                     path, upload->uploaded, error->message);
+    ev_upload_free (upload);
+    return;
+  }
+
+  rss = get_proc_status_kb ("VmRSS");
+  upload->rss_peak = MAX (upload->rss_peak, rss);
+  ev_prompt_print ("Uploaded %s as %s, %" G_GOFFSET_FORMAT " bytes in %.1f s, %.1f KiB/s\n"
+                   "  RSS %" G_GINT64_FORMAT " kB before, %" G_GINT64_FORMAT " kB after, "
+                   "peak %" G_GINT64_FORMAT " kB above before\n",
+                   path, upload->event_id, upload->size,
+                   (double) duration / G_USEC_PER_SEC,
+                   (double) upload->size * G_USEC_PER_SEC / duration / 1024,
+                   upload->rss_before, rss, upload->rss_peak - upload->rss_before);
+  ev_upload_free (upload);
+}
+
+
+static GString *
+ev_matrix_upload (GStrv args, GError **err)
+{
+  g_autoptr (GFile) file = NULL;
+  g_autoptr (GFileInfo) info = NULL;
+  g_autoptr (CmRoom) room = NULL;
+  EvUpload *upload;
+  EvAccount *account;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  if (g_strv_length (args) < 2) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+    return NULL;
+  }
+
+  if (g_strv_length (args) > 2) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Too many arguments");
+    return NULL;
+  }
+
+  room = get_joined_room_by_id (account, args[0]);
+  if (!room) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", args[0]);
+    return NULL;
+  }
+
+  file = g_file_new_for_commandline_arg (args[1]);
+  info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_SIZE "," G_FILE_ATTRIBUTE_STANDARD_TYPE,
+                            G_FILE_QUERY_INFO_NONE, NULL, err);
+  if (!info)
+    return NULL;
+
+  if (g_file_info_get_file_type (info) != G_FILE_TYPE_REGULAR) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_REGULAR_FILE, "%s is not a regular file", args[1]);
+    return NULL;
+  }
+
+  upload = g_new0 (EvUpload, 1);
+  upload->room = g_steal_pointer (&room);
+  upload->file = g_steal_pointer (&file);
+  upload->size = g_file_info_get_size (info);
+  upload->rss_before = get_proc_status_kb ("VmRSS");
+  upload->rss_peak = upload->rss_before;
+
+  /* Not idempotent, a retry could post the file twice */
+  ev_scheduler_submit (scheduler, cm_client_get_homeserver (account->client),
+                       EV_SCHEDULER_LANE_BULK, "upload", EV_SCHEDULER_FLAG_NONE,
+                       upload_run, upload_done, upload);
+
+  return g_string_new_take (g_strdup_printf ("Uploading %s, %" G_GOFFSET_FORMAT " bytes",
+                                             args[1], upload->size));
+}
+
+
+static void
+set_pushers (EvAccount *account, GPtrArray *fetched)
+{
+  g_clear_pointer (&account->pushers, g_ptr_array_unref);
+  account->pushers = fetched;
+  account->pushers_fetched = g_get_monotonic_time ();
+}
+
+
+static void
+on_get_pushers_ready (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  EvSchedulerJob *job = user_data;
+  EvAccount *account = ev_scheduler_job_get_user_data (job);
+  GPtrArray *fetched;
+  GError *err = NULL;
+
+  fetched = cm_client_get_pushers_finish (CM_CLIENT (object), result, &err);
+  if (fetched)
+    set_pushers (account, fetched);
+
+  ev_scheduler_job_return (job, err);
+}
+
+
+static void
+get_pushers_run (EvSchedulerJob *job, GCancellable *cancellable, gpointer user_data)
+{
+  EvAccount *account = user_data;
+
+  cm_client_get_pushers_async (account->client, cancellable, on_get_pushers_ready, job);
+}
+
+
+static void
+refresh_pushers_done (EvSchedulerJob *job, const GError *error, gpointer user_data)
+{
+  EvAccount *account = user_data;
+
+  account->pushers_refreshing = FALSE;
+
+  if (error) {
+    ev_prompt_print ("Failed to refresh pushers of %s: %s\n", account->username, error->message);
+    return;
+  }
+
+  ev_prompt_print ("Refreshed pushers of %s, %u configured, run /get-pushers for their ids\n",
+                   account->username, account->pushers->len);
+}
+
+
+static void
+refresh_pushers (EvAccount *account)
+{
+  if (account->pushers_refreshing)
+    return;
+
+  account->pushers_refreshing = TRUE;
+  ev_scheduler_submit (scheduler, cm_client_get_homeserver (account->client),
+                       EV_SCHEDULER_LANE_BULK, "get-pushers",
+                       EV_SCHEDULER_FLAG_IDEMPOTENT,
+                       get_pushers_run, refresh_pushers_done, account);
+}
+
+
+static gboolean
+ensure_pushers (EvAccount *account, GError **err)
+{
+  g_autoptr (GError) local_err = NULL;
+
+  if (account->pushers)
+    return TRUE;
+
+  if (!ev_scheduler_run_sync (scheduler, cm_client_get_homeserver (account->client), "get-pushers",
+                              EV_SCHEDULER_FLAG_IDEMPOTENT, get_pushers_run, account, &local_err)) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to get pushers: %s", local_err->message);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+static GString *
+ev_matrix_get_pushers (GStrv args, GError **err)
+{
+  g_autoptr (EvFormatBuilder) builder = NULL;
+  g_autoptr (GString) out = g_string_new ("");
+  g_autoptr (GString) details = NULL;
+  GPtrArray *pushers;
+  EvAccount *account;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  if (args[0] && (!g_str_equal (args[0], "--refresh") || args[1])) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown argument '%s'", args[0]);
+    return NULL;
+  }
+
+  /* Show what we have, the ids only change on an explicit refresh */
+  if (account->pushers) {
+    g_string_append_printf (out, "    Cached %" G_GINT64_FORMAT " s ago%s\n\n",
+                            (g_get_monotonic_time () - account->pushers_fetched) / G_USEC_PER_SEC,
+                            args[0] ? ", refreshing" : "");
+    if (args[0])
+      refresh_pushers (account);
+  } else if (!ensure_pushers (account, err)) {
+    return NULL;
+  }
+  pushers = account->pushers;
+
+  if (!pushers->len) {
+    g_string_append (out, "    No pushers configured\n");
+    return g_steal_pointer (&out);
+  }
+
+  builder = ev_format_builder_new ();
+  ev_format_builder_set_indent (builder, INFO_INDENT);
+  for (int i = 0; i < pushers->len; i++) {
+    CmPusher *pusher = g_ptr_array_index (pushers, i);
+
+    if (i != 0)
+      ev_format_builder_add_newline (builder);
+
+    ev_format_builder_take_value (builder, "Pusher Id",
+                                  g_strdup_printf ("%d", i));
+    ev_format_builder_add (builder, "Kind",
+                           cm_pusher_get_kind_as_string (pusher));
+    ev_format_builder_add (builder, "App Display Name",
+                           cm_pusher_get_app_display_name (pusher));
+    ev_format_builder_add (builder, "App Id", cm_pusher_get_app_id (pusher));
+    ev_format_builder_add (builder, "Device Display Name",
+                           cm_pusher_get_device_display_name (pusher));
+    ev_format_builder_add (builder, "Lang", cm_pusher_get_lang (pusher));
+    ev_format_builder_add (builder, "Profile Tag", cm_pusher_get_profile_tag (pusher));
+    ev_format_builder_add (builder, "Pushkey", cm_pusher_get_pushkey (pusher));
+    if (cm_pusher_get_kind (pusher) == CM_PUSHER_KIND_HTTP)
+      ev_format_builder_add (builder, "Url", cm_pusher_get_url (pusher));
+  }
+
+  details = ev_format_builder_end (builder);
+  g_string_append (out, details->str);
+
+  return g_steal_pointer (&out);
+}
+
+
+static void
+on_remove_pusher_ready (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  EvSchedulerJob *job = user_data;
+  GError *err = NULL;
+
+  cm_client_remove_pusher_finish (CM_CLIENT (object), result, &err);
+  ev_scheduler_job_return (job, err);
+}
+
+
+typedef struct {
+  CmClient *client;
+  CmPusher *pusher;
+} EvRemovePusherData;
+
+
+static void
+remove_pusher_run (EvSchedulerJob *job, GCancellable *cancellable, gpointer user_data)
+{
+  EvRemovePusherData *data = user_data;
+
+  cm_client_remove_pusher_async (data->client, data->pusher, cancellable,
+                                 on_remove_pusher_ready, job);
+}
+
+
+static GString *
+ev_matrix_remove_pusher (GStrv args, GError **err)
+{
+  g_autoptr (GError) local_err = NULL;
+  g_autoptr (CmPusher) pusher = NULL;
+  EvRemovePusherData data = { 0 };
+  GPtrArray *pushers;
+  EvAccount *account;
+  gboolean success;
+  guint64 pusher_id;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+  pushers = account->pushers;
+
+  if (g_strv_length (args) < 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+    return NULL;
+  }
+
+  if (!pushers) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "No pushers - did you run /get-pushers ?");
+    return NULL;
+  }
+
+  /* Either the id shown by /get-pushers or the pushkey */
+  if (g_ascii_string_to_unsigned (args[0], 10, 0, G_MAXUINT, &pusher_id, NULL)) {
+    if (pusher_id >= pushers->len) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Invalid pusher id '%s'", args[0]);
+      return NULL;
+    }
+    pusher = g_object_ref (g_ptr_array_index (pushers, pusher_id));
+  } else {
+    for (guint i = 0; i < pushers->len; i++) {
+      CmPusher *candidate = g_ptr_array_index (pushers, i);
+
+      if (g_strcmp0 (cm_pusher_get_pushkey (candidate), args[0]) == 0) {
+        pusher = g_object_ref (candidate);
+        break;
+      }
+    }
+    if (!pusher) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No pusher with pushkey '%s'", args[0]);
+      return NULL;
+    }
+  }
+
+  /* Hold a ref, a refresh can replace the list while we wait */
+  data.client = account->client;
+  data.pusher = pusher;
+
+  success = ev_scheduler_run_sync (scheduler, cm_client_get_homeserver (account->client),
+                                   "remove-pusher", EV_SCHEDULER_FLAG_IDEMPOTENT,
+                                   remove_pusher_run, &data, &local_err);
+  if (!success) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Failed to remove pusher: %s", local_err->message);
+    return NULL;
+  }
+
+  return g_string_new_take (g_strdup_printf ("Removed pusher %s", cm_pusher_get_pushkey (pusher)));
+}
+
+
+static void
+remove_pushers_entry_free (EvRemovePushersEntry *entry)
+{
+  g_object_unref (entry->pusher);
+  g_free (entry);
+}
+
+
+static void
+remove_pushers_free (EvRemovePushers *batch)
+{
+  g_ptr_array_unref (batch->entries);
+  g_free (batch);
+}
+
+
+static void
+remove_pushers_run (EvSchedulerJob *job, GCancellable *cancellable, gpointer user_data)
+{
+  EvRemovePushersEntry *entry = user_data;
+
+  cm_client_remove_pusher_async (entry->batch->account->client, entry->pusher, cancellable,
+                                 on_remove_pusher_ready, job);
+}
+
+
+static void
+remove_pushers_done (EvSchedulerJob *job, const GError *error, gpointer user_data)
+{
+  EvRemovePushersEntry *entry = user_data;
+  EvRemovePushers *batch = entry->batch;
+  EvAccount *account = batch->account;
+  gint64 latency = ev_scheduler_job_get_latency (job);
+
+  batch->done++;
+  if (error) {
+    batch->failed++;
+    ev_prompt_print ("  [%u/%u] Failed to remove pusher %s: %s\n",
+                     batch->done, batch->entries->len,
+                     cm_pusher_get_pushkey (entry->pusher), error->message);
+  } else {
+    batch->latency_sum += latency;
+    batch->latency_max = MAX (batch->latency_max, latency);
+    ev_prompt_print ("  [%u/%u] Removed pusher %s (%s) in %" G_GINT64_FORMAT " ms\n",
+                     batch->done, batch->entries->len,
+                     cm_pusher_get_pushkey (entry->pusher),
+                     cm_pusher_get_app_id (entry->pusher),
+                     latency / 1000);
+  }
+
+  if (batch->done < batch->entries->len)
+    return;
+
+  if (batch->done > batch->failed) {
+    ev_prompt_print ("Removed %u of %u pushers in %.1f s, latency mean %" G_GINT64_FORMAT " ms, max %" G_GINT64_FORMAT " ms\n",
+                     batch->done - batch->failed, batch->entries->len,
+                     (double)(g_get_monotonic_time () - batch->started) / G_USEC_PER_SEC,
+                     batch->latency_sum / (batch->done - batch->failed) / 1000,
+                     batch->latency_max / 1000);
+  } else {
+    ev_prompt_print ("Failed to remove %u pushers\n", batch->failed);
+  }
+
+  g_assert (remove_pushers == batch);
+  g_clear_pointer (&remove_pushers, remove_pushers_free);
+
+  /* Positional ids changed, fetch the list again when it's asked for */
+  g_clear_pointer (&account->pushers, g_ptr_array_unref);
+}
+
+
+static GString *
+ev_matrix_remove_pushers (GStrv args, GError **err)
+{
+  const char *app_id = NULL, *kind = NULL, *url_prefix = NULL;
+  EvRemovePushers *batch;
+  GPtrArray *pushers;
+  EvAccount *account;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  for (guint i = 0; args[i]; i++) {
+    const char **filter;
+
+    if (g_str_equal (args[i], "--app-id")) {
+      filter = &app_id;
+    } else if (g_str_equal (args[i], "--kind")) {
+      filter = &kind;
+    } else if (g_str_equal (args[i], "--url-prefix")) {
+      filter = &url_prefix;
+    } else {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown argument '%s'", args[i]);
+      return NULL;
+    }
+
+    if (!args[i + 1]) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Missing value for '%s'", args[i]);
+      return NULL;
+    }
+    *filter = args[++i];
+  }
+
+  if (!app_id && !kind && !url_prefix) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Need at least one filter");
+    return NULL;
+  }
+
+  if (remove_pushers) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_BUSY, "Already removing pushers");
+    return NULL;
+  }
+
+  /* Claim the slot first, fetching the pushers iterates the main context */
+  batch = g_new0 (EvRemovePushers, 1);
+  batch->account = account;
+  batch->entries = g_ptr_array_new_with_free_func ((GDestroyNotify) remove_pushers_entry_free);
+  remove_pushers = batch;
+
+  if (!ensure_pushers (account, err)) {
+    remove_pushers_free (g_steal_pointer (&remove_pushers));
+    return NULL;
+  }
+  pushers = account->pushers;
+
+  for (guint i = 0; i < pushers->len; i++) {
+    CmPusher *pusher = g_ptr_array_index (pushers, i);
+    EvRemovePushersEntry *entry;
+
+    if (app_id && g_strcmp0 (cm_pusher_get_app_id (pusher), app_id) != 0)
+      continue;
+
+    if (kind && g_ascii_strcasecmp (cm_pusher_get_kind_as_string (pusher), kind) != 0)
+      continue;
+
+    if (url_prefix && (cm_pusher_get_kind (pusher) != CM_PUSHER_KIND_HTTP ||
+                       !g_str_has_prefix (cm_pusher_get_url (pusher) ?: "", url_prefix)))
+      continue;
+
+    entry = g_new0 (EvRemovePushersEntry, 1);
+    entry->batch = batch;
+    entry->pusher = g_object_ref (pusher);
+    g_ptr_array_add (batch->entries, entry);
+  }
+
+  if (!batch->entries->len) {
+    remove_pushers_free (g_steal_pointer (&remove_pushers));
+    return g_string_new ("No matching pushers");
+  }
+
+  batch->started = g_get_monotonic_time ();
+  for (guint i = 0; i < batch->entries->len; i++) {
+    EvRemovePushersEntry *entry = g_ptr_array_index (batch->entries, i);
+
+    ev_scheduler_submit (scheduler, cm_client_get_homeserver (account->client),
+                         EV_SCHEDULER_LANE_BULK, "remove-pusher",
+                         EV_SCHEDULER_FLAG_IDEMPOTENT,
+                         remove_pushers_run, remove_pushers_done, entry);
+  }
+
+  return g_string_new_take (g_strdup_printf ("Removing %u pushers", batch->entries->len));
+}
+
+
+static void
+on_join_room_ready (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  EvSchedulerJob *job = user_data;
+  GError *err = NULL;
+
+  cm_client_join_room_finish (CM_CLIENT (object), result, &err);
+  ev_scheduler_job_return (job, err);
+}
+
+
+typedef struct {
+  CmClient   *client;
+  const char *room;
+} EvJoinRoomData;
+
+
+static void
+join_room_run (EvSchedulerJob *job, GCancellable *cancellable, gpointer user_data)
+{
+  EvJoinRoomData *data = user_data;
+
+  cm_client_join_room_async (data->client, data->room, cancellable, on_join_room_ready, job);
+}
+
+
+static GString *
+ev_matrix_join_room (GStrv args, GError **err)
+{
+  EvJoinRoomData data = { 0 };
+  const char *room;
+  EvAccount *account;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  if (g_strv_length (args) < 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+    return NULL;
+  }
+
+  if (g_strv_length (args) > 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Too many arguments");
+    return NULL;
+  }
+
+  room = args[0];
+  if (!g_regex_match (room_regex, room, G_REGEX_MATCH_DEFAULT, NULL)) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not a valid room id or alias");
+    return NULL;
+  }
+
+  data.client = account->client;
+  data.room = room;
+  if (!ev_scheduler_run_sync (scheduler, cm_client_get_homeserver (account->client), "join",
+                              EV_SCHEDULER_FLAG_IDEMPOTENT, join_room_run, &data, err))
+    return NULL;
+
+  return g_string_new_take (g_strdup_printf ("Joined '%s'", room));
+}
+
+
+static void
+join_many_entry_free (EvJoinManyEntry *entry)
+{
+  g_free (entry->room);
+  g_clear_error (&entry->error);
+  g_free (entry);
+}
+
+
+static void
+join_many_free (EvJoinMany *batch)
+{
+  g_ptr_array_unref (batch->entries);
+  g_free (batch);
+}
+
+
+static void
+join_many_print_summary (EvJoinMany *batch)
+{
+  g_autoptr (GString) out = g_string_new ("");
+  gint64 total, latency_sum = 0;
+  guint joined = 0;
+  int max_len = strlen ("Room");
+
+  for (guint i = 0; i < batch->entries->len; i++) {
+    EvJoinManyEntry *entry = g_ptr_array_index (batch->entries, i);
+
+    max_len = MAX (max_len, strlen (entry->room));
+  }
+
+  g_string_append_printf (out, "%*s%-*s  %-8s  %8s  %10s\n", INFO_INDENT, "",
+                          max_len, "Room", "Result", "Attempts", "Latency");
+  for (guint i = 0; i < batch->entries->len; i++) {
+    EvJoinManyEntry *entry = g_ptr_array_index (batch->entries, i);
+
+    g_string_append_printf (out, "%*s%-*s  %-8s  %8u  %7" G_GINT64_FORMAT " ms", INFO_INDENT, "",
+                            max_len, entry->room,
+                            entry->error ? "failed" : "joined",
+                            entry->attempts,
+                            entry->latency / 1000);
+    if (entry->error) {
+      g_string_append_printf (out, "  (%s)", entry->error->message);
+    } else {
+      joined++;
+      latency_sum += entry->latency;
+    }
+    g_string_append (out, "\n");
+  }
+
+  total = g_get_monotonic_time () - batch->started;
+  g_string_append_printf (out, "\n%*sJoined %u of %u rooms in %.1f s",
+                          INFO_INDENT, "", joined, batch->entries->len,
+                          (double)total / G_USEC_PER_SEC);
+  if (joined)
+    g_string_append_printf (out, ", mean latency %" G_GINT64_FORMAT " ms", latency_sum / joined / 1000);
+  g_string_append (out, "\n");
+
+  ev_prompt_print ("%s", out->str);
+}
+
+
+static void
+join_many_run (EvSchedulerJob *job, GCancellable *cancellable, gpointer user_data)
+{
+  EvJoinManyEntry *entry = user_data;
+
+  cm_client_join_room_async (entry->batch->account->client, entry->room, cancellable,
+                             on_join_room_ready, job);
+}
+
+
+static void
+join_many_done (EvSchedulerJob *job, const GError *error, gpointer user_data)
+{
+  EvJoinManyEntry *entry = user_data;
+  EvJoinMany *batch = entry->batch;
+
+  entry->attempts = ev_scheduler_job_get_attempts (job);
+  entry->latency = ev_scheduler_job_get_latency (job);
+  entry->error = error ? g_error_copy (error) : NULL;
+  batch->done++;
+
+  if (entry->error) {
+    ev_prompt_print ("  [%u/%u] Failed to join '%s': %s\n", batch->done, batch->entries->len,
+                     entry->room, entry->error->message);
+  } else {
+    ev_prompt_print ("  [%u/%u] Joined '%s' in %" G_GINT64_FORMAT " ms\n", batch->done, batch->entries->len,
+                     entry->room, entry->latency / 1000);
+  }
+
+  if (batch->done == batch->entries->len) {
+    join_many_print_summary (batch);
+    if (join_many == batch)
+      join_many = NULL;
+    join_many_free (batch);
+  }
+}
+
+
+static gboolean
+join_many_add_room (EvJoinMany *batch, GHashTable *seen, const char *room)
+{
+  EvJoinManyEntry *entry;
+
+  if (!g_regex_match (room_regex, room, G_REGEX_MATCH_DEFAULT, NULL))
+    return FALSE;
+
+  if (!g_hash_table_add (seen, g_strdup (room)))
+    return TRUE;
+
+  entry = g_new0 (EvJoinManyEntry, 1);
+  entry->batch = batch;
+  entry->room = g_strdup (room);
+  g_ptr_array_add (batch->entries, entry);
+
+  return TRUE;
+}
+
+
+static gboolean
+join_many_add_file (EvJoinMany *batch, GHashTable *seen, const char *path, GError **err)
+{
+  g_autofree char *contents = NULL;
+  g_auto (GStrv) lines = NULL;
+
+  if (!g_file_get_contents (path, &contents, NULL, err))
+    return FALSE;
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (guint i = 0; lines[i]; i++) {
+    char *line = g_strstrip (lines[i]);
+
+    if (line[0] == '\0' || line[0] == '#')
+      continue;
+
+    if (!join_many_add_room (batch, seen, line)) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Not a valid room id or alias '%s' at %s:%u", line, path, i + 1);
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+
+static GString *
+ev_matrix_join_many (GStrv args, GError **err)
+{
+  g_autoptr (GHashTable) seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  EvJoinMany *batch;
+  EvAccount *account;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  if (g_strv_length (args) < 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+    return NULL;
+  }
+
+  if (join_many) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_BUSY, "Already joining %u rooms",
+                 join_many->entries->len);
+    return NULL;
+  }
+
+  batch = g_new0 (EvJoinMany, 1);
+  batch->account = account;
+  batch->entries = g_ptr_array_new_with_free_func ((GDestroyNotify) join_many_entry_free);
+
+  for (guint i = 0; args[i]; i++) {
+    if (join_many_add_room (batch, seen, args[i]))
+      continue;
+
+    if (!g_file_test (args[i], G_FILE_TEST_IS_REGULAR)) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "'%s' is neither a valid room id or alias nor a file", args[i]);
+      join_many_free (batch);
+      return NULL;
+    }
+
+    if (!join_many_add_file (batch, seen, args[i], err)) {
+      join_many_free (batch);
+      return NULL;
+    }
+  }
+
+  if (!batch->entries->len) {
+    join_many_free (batch);
+    return g_string_new ("No rooms to join");
+  }
+
+  join_many = batch;
+  batch->started = g_get_monotonic_time ();
+  for (guint i = 0; i < batch->entries->len; i++) {
+    ev_scheduler_submit (scheduler,
+                         cm_client_get_homeserver (account->client),
+                         EV_SCHEDULER_LANE_BULK,
+                         "join-many",
+                         EV_SCHEDULER_FLAG_IDEMPOTENT,
+                         join_many_run,
+                         join_many_done,
+                         g_ptr_array_index (batch->entries, i));
+  }
+
+  return g_string_new_take (g_strdup_printf ("Joining %u rooms", batch->entries->len));
+}
+
+static char *
+get_account_state (EvAccount *account)
+{
+  if (account->skipped)
+    return g_strdup (_("not started"));
+
+  if (account->error)
+    return g_strdup_printf (_("disabled: %s"), account->error->message);
+
+  if (!account->client)
+    return g_strdup (_("resolving homeserver"));
+
+  if (cm_client_get_logged_in (account->client))
+    return g_strdup (account->n_syncs ? _("syncing") : _("logged in"));
+
+  return g_strdup (cm_client_get_logging_in (account->client) ? _("logging in") : _("not logged in"));
+}
+
+
+static void
+mark_read_entry_free (EvMarkReadEntry *entry)
+{
+  g_clear_object (&entry->room);
+  g_clear_object (&entry->event);
+  g_free (entry);
+}
+
+
+static void
+mark_read_free (EvMarkRead *batch)
+{
+  g_ptr_array_unref (batch->entries);
+  g_free (batch);
+}
+
+
+static void
+on_set_read_marker_ready (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  EvSchedulerJob *job = user_data;
+  GError *err = NULL;
+
+  cm_room_set_read_marker_finish (CM_ROOM (object), result, &err);
+  ev_scheduler_job_return (job, err);
+}
+
+
+static void
+mark_read_run (EvSchedulerJob *job, GCancellable *cancellable, gpointer user_data)
+{
+  EvMarkReadEntry *entry = user_data;
+
+  /* Mark the latest event as both fully read and read */
+  cm_room_set_read_marker_async (entry->room, entry->event, entry->event,
+                                 on_set_read_marker_ready, job);
+}
+
+
+static void
+mark_read_done (EvSchedulerJob *job, const GError *error, gpointer user_data)
+{
+  EvMarkReadEntry *entry = user_data;
+  EvMarkRead *batch = entry->batch;
+  g_autofree char *latency = NULL;
+  gint64 total;
+
+  batch->done++;
+  if (error) {
+    batch->failed++;
+    ev_prompt_print ("  [%u/%u] Failed to mark '%s' read: %s\n", batch->done, batch->entries->len,
+                     cm_room_get_id (entry->room), error->message);
+  } else {
+    ev_histogram_add (&batch->latency, ev_scheduler_job_get_latency (job) / 1000);
+  }
+
+  /* Don't flood the terminal when marking thousands of rooms */
+  if (batch->done % MARK_READ_PROGRESS_INTERVAL == 0 && batch->done < batch->entries->len)
+    ev_prompt_print ("  [%u/%u] Marking rooms read\n", batch->done, batch->entries->len);
+
+  if (batch->done < batch->entries->len)
+    return;
+
+  total = g_get_monotonic_time () - batch->started;
+  latency = ev_histogram_format (&batch->latency, " ms");
+  ev_prompt_print ("Marked %u of %u rooms read in %.1f s, %u skipped without events\n"
+                   "  Latency: %s\n",
+                   batch->done - batch->failed, batch->entries->len,
+                   (double) total / G_USEC_PER_SEC, batch->skipped, latency);
+  if (mark_read == batch)
+    mark_read = NULL;
+  mark_read_free (batch);
+}
+
+
+static void
+mark_read_add_room (EvMarkRead *batch, CmRoom *room)
+{
+  GListModel *events = cm_room_get_events_list (room);
+  guint n_items = g_list_model_get_n_items (events);
+  EvMarkReadEntry *entry;
+
+  /* Only loaded events are known, no request is made to find the latest one */
+  if (!n_items) {
+    batch->skipped++;
+    return;
+  }
+
+  entry = g_new0 (EvMarkReadEntry, 1);
+  entry->batch = batch;
+  entry->room = g_object_ref (room);
+  entry->event = g_list_model_get_item (events, n_items - 1);
+  g_ptr_array_add (batch->entries, entry);
+}
+
+
+static GString *
+ev_matrix_mark_read (GStrv args, GError **err)
+{
+  EvMarkRead *batch;
+  EvAccount *account;
+
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
+
+  if (g_strv_length (args) < 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+    return NULL;
+  }
+
+  if (g_str_equal (args[0], "--all") && args[1]) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "--all takes no rooms");
+    return NULL;
+  }
+
+  if (mark_read) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_BUSY, "Already marking %u rooms read",
+                 mark_read->entries->len);
+    return NULL;
+  }
+
+  batch = g_new0 (EvMarkRead, 1);
+  batch->account = account;
+  batch->entries = g_ptr_array_new_with_free_func ((GDestroyNotify) mark_read_entry_free);
+
+  if (g_str_equal (args[0], "--all")) {
+    GListModel *rooms = cm_client_get_joined_rooms (account->client);
+
+    for (guint i = 0; i < g_list_model_get_n_items (rooms); i++) {
+      g_autoptr (CmRoom) room = g_list_model_get_item (rooms, i);
+
+      mark_read_add_room (batch, room);
+    }
+  } else {
+    for (guint i = 0; args[i]; i++) {
+      g_autoptr (CmRoom) room = get_joined_room_by_id (account, args[i]);
+
+      if (!room) {
+        g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", args[i]);
+        mark_read_free (batch);
+        return NULL;
+      }
+      mark_read_add_room (batch, room);
+    }
+  }
+
+  if (!batch->entries->len) {
+    guint skipped = batch->skipped;
+
+    mark_read_free (batch);
+    return g_string_new_take (g_strdup_printf ("No rooms with loaded events, %u skipped", skipped));
+  }
+
+  mark_read = batch;
+  batch->started = g_get_monotonic_time ();
+  /* The "mark-read" deadline starts on dispatch, so rooms waiting behind
+   * thousands of others for rate limit tokens don't time out */
+  for (guint i = 0; i < batch->entries->len; i++) {
+    ev_scheduler_submit (scheduler,
+                         cm_client_get_homeserver (account->client),
+                         EV_SCHEDULER_LANE_BULK,
+                         "mark-read",
+                         EV_SCHEDULER_FLAG_IDEMPOTENT,
+                         mark_read_run,
+                         mark_read_done,
+                         g_ptr_array_index (batch->entries, i));
+  }
+
+  return g_string_new_take (g_strdup_printf ("Marking %u rooms read", batch->entries->len));
+}
+
+
+static void
+format_account (EvFormatBuilder *builder, EvAccount *account)
+{
+  gint64 now = g_get_monotonic_time ();
+
+  ev_format_builder_take_value (builder, _("User"),
+                                g_strdup_printf ("%s%s", account->username,
+                                                 account == current ? _(" (selected)") : ""));
+  ev_format_builder_add (builder, _("Config group"), account->group);
+  ev_format_builder_take_value (builder, _("State"), get_account_state (account));
+  if (account->joined_rooms) {
+    ev_format_builder_take_value (builder, _("Joined rooms"),
+                                  g_strdup_printf ("%u", g_list_model_get_n_items (account->joined_rooms)));
+  }
+  ev_format_builder_take_value (builder, _("Syncs"),
+                                g_strdup_printf ("%" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT " failed",
+                                                 account->n_syncs, account->n_sync_errors));
+  ev_format_builder_take_value (builder, _("Events"),
+                                g_strdup_printf ("%" G_GUINT64_FORMAT, account->n_events));
+  if (account->last_sync) {
+    ev_format_builder_take_value (builder, _("Last sync"),
+                                  g_strdup_printf (_("%d s ago"), (int) ((now - account->last_sync) / G_USEC_PER_SEC)));
+  }
+}
+
+
+static GString *
+ev_matrix_account (GStrv args, GError **err)
+{
+  g_autoptr (EvFormatBuilder) builder = ev_format_builder_new ();
+
+  if (g_strv_length (args) > 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Too many arguments");
+    return NULL;
+  }
+
+  if (!accounts || !accounts->len) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_INITIALIZED, "No accounts configured");
+    return NULL;
+  }
+
+  if (args[0]) {
+    EvAccount *account = find_account (args[0]);
+
+    if (!account) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No account '%s'", args[0]);
+      return NULL;
+    }
+    current = account;
+  }
+
+  ev_format_builder_set_indent (builder, INFO_INDENT);
+  for (guint i = 0; i < accounts->len; i++) {
+    if (i != 0)
+      ev_format_builder_add_newline (builder);
+
+    format_account (builder, g_ptr_array_index (accounts, i));
+  }
+
+  return ev_format_builder_end (builder);
+}
+
+
+static void
+on_delete_client_ready (GObject *object, GAsyncResult *result, gpointer user_data)
+{
+  g_autoptr (CmClient) client = user_data;
+  g_autoptr (GError) err = NULL;
+  const char *login_id = cm_account_get_login_id (cm_client_get_account (client));
+
+  pruning--;
+  if (!cm_matrix_delete_client_finish (CM_MATRIX (object), result, &err))
+    ev_prompt_print ("Failed to remove stale client %s: %s\n", login_id, err->message);
+  else
+    ev_prompt_print ("Removed stale client %s\n", login_id);
+}
+
+
+static GString *
+ev_matrix_prune_clients (GStrv args, GError **err)
+{
+  g_autoptr (GString) out = g_string_new ("");
+  gboolean delete = FALSE;
+
+  if (g_strv_length (args) > 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Too many arguments");
     return NULL;
   }
-  room_id = args[0];
 
-  room = get_joined_room_by_id (room_id);
-  if (!room) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", room_id);
+  if (args[0]) {
+    if (!g_str_equal (args[0], "--delete")) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown argument '%s'", args[0]);
+      return NULL;
+    }
+    delete = TRUE;
+  }
+
+  if (pruning) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_BUSY, "Still removing %u clients", pruning);
     return NULL;
   }
 
-  events = cm_room_get_events_list (room);
+  if (!stale_clients || !stale_clients->len)
+    return g_string_new ("No stale clients");
 
-  ev_format_builder_set_indent (builder, INFO_INDENT);
+  for (guint i = 0; i < stale_clients->len; i++) {
+    CmClient *client = g_ptr_array_index (stale_clients, i);
 
-  ev_format_builder_take_value (builder, _("Events"),
-                                g_strdup_printf ("%u", g_list_model_get_n_items (events)));
-  for (guint i = 0; i < g_list_model_get_n_items (events); i++) {
-    g_autoptr (CmEvent) event = g_list_model_get_item (events, i);
-    CmEventType type = cm_event_get_m_type (event);
+    g_string_append_printf (out, "    %s\n", cm_account_get_login_id (cm_client_get_account (client)));
+  }
 
-    ev_format_builder_add_newline (builder);
-    ev_format_builder_add (builder, _("Event Id"), cm_event_get_id (CM_EVENT (event)));
-    /* Translators: A matrix message event type */
-    ev_format_builder_take_value (builder, _("Type"), ev_enum_to_nick (CM_TYPE_EVENT_TYPE, type));
+  if (!delete) {
+    g_string_append_printf (out, "\n    %u stale clients, use --delete to remove them",
+                            stale_clients->len);
+    return g_steal_pointer (&out);
+  }
 
-    if (type == CM_M_ROOM_MESSAGE) {
-      CmContentType content_type;
-      CmRoomMessageEvent *rev = CM_ROOM_MESSAGE_EVENT (event);
+  for (guint i = 0; i < stale_clients->len; i++) {
+    CmClient *client = g_ptr_array_index (stale_clients, i);
 
-      content_type = cm_room_message_event_get_msg_type (rev);
-      ev_format_builder_take_value (builder, _("Content-Type"), ev_enum_to_nick (CM_TYPE_CONTENT_TYPE,
-                                                                                 content_type));
-      if (content_type == CM_CONTENT_TYPE_TEXT) {
-        ev_format_builder_add (builder, _("Body"),
-                               cm_room_message_event_get_body (rev));
-      }
-    }
+    pruning++;
+    cm_matrix_delete_client_async (matrix, client, on_delete_client_ready, g_object_ref (client));
   }
+  g_string_append_printf (out, "\n    Removing %u stale clients", stale_clients->len);
+  g_ptr_array_set_size (stale_clients, 0);
 
-  return ev_format_builder_end (builder);
+  return g_steal_pointer (&out);
+}
+
+
+static int
+compare_room_sync_stats (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  GHashTable *room_sync_stats = user_data;
+  EvSyncStats *stats_a = g_hash_table_lookup (room_sync_stats, *(const char **)a);
+  EvSyncStats *stats_b = g_hash_table_lookup (room_sync_stats, *(const char **)b);
+
+  if (stats_a->n_events == stats_b->n_events)
+    return 0;
+
+  return stats_a->n_events < stats_b->n_events ? 1 : -1;
 }
 
 
 static GString *
-ev_matrix_client_details (GStrv unused, GError **err)
+ev_matrix_sync_stats (GStrv args, GError **err)
 {
   g_autoptr (EvFormatBuilder) builder = ev_format_builder_new ();
-  gboolean logged_in;
-  const char *device_id;
+  g_autoptr (GString) out = NULL;
+  g_autoptr (GPtrArray) room_ids = g_ptr_array_new ();
+  GHashTableIter iter;
+  const char *room_id;
+  EvAccount *account;
 
-  if (!client)
+  if (g_strv_length (args) > 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Too many arguments");
     return NULL;
+  }
 
-  device_id = cm_client_get_device_id (client);
-  ev_format_builder_set_indent (builder, INFO_INDENT);
-  ev_format_builder_add (builder, _("User"), cm_client_get_user_id (client));
-  ev_format_builder_add (builder, _("Home server"), cm_client_get_homeserver (client));
-  ev_format_builder_add (builder, _("Device ID"), device_id ?: "not logged in");
-  if (device_id) {
-    g_autoptr (GString) fp = NULL;
-    const char *str;
+  account = get_current_account (err);
+  if (!account)
+    return NULL;
 
-    fp = g_string_new (NULL);
-    str = cm_client_get_ed25519_key (client);
+  ev_format_builder_set_indent (builder, INFO_INDENT);
 
-    while (str && *str) {
-      g_autofree char *chunk = g_strndup (str, 4);
+  if (args[0]) {
+    EvSyncStats *stats = g_hash_table_lookup (account->room_sync_stats, args[0]);
 
-      g_string_append_printf (fp, "%s ", chunk);
-      str = str + strlen (chunk);
+    if (!stats) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No events synced for room %s", args[0]);
+      return NULL;
     }
-    ev_format_builder_add (builder, _("Fingerprint"), fp->str);
+
+    ev_format_builder_add (builder, _("Room Id"), args[0]);
+    ev_sync_stats_format (stats, builder);
+    return ev_format_builder_end (builder);
   }
-  logged_in = cm_client_get_logged_in (client);
-  ev_format_builder_add (builder, _("Logged in"), logged_in ? _("yes") : _("no"));
-  if (!logged_in)
-    ev_format_builder_add (builder, _("Logging in"), cm_client_get_logging_in (client) ? _("yes") : _("no"));
 
-  return ev_format_builder_end (builder);
+  ev_format_builder_add (builder, _("User"), account->username);
+  ev_sync_stats_format (&account->sync_stats, builder);
+  out = ev_format_builder_end (builder);
+
+  g_hash_table_iter_init (&iter, account->room_sync_stats);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&room_id, NULL))
+    g_ptr_array_add (room_ids, (gpointer) room_id);
+
+  if (!room_ids->len)
+    return g_steal_pointer (&out);
+
+  g_ptr_array_sort_with_data (room_ids, compare_room_sync_stats, account->room_sync_stats);
+
+  g_string_append_printf (out, "\n%*s%-40s  %8s  %7s  %9s  %9s\n", INFO_INDENT, "",
+                          "Busiest rooms", "Events", "Ev/s", "Lag p50", "Lag p99");
+  for (guint i = 0; i < MIN (room_ids->len, SYNC_STATS_TOP_ROOMS); i++) {
+    const char *id = g_ptr_array_index (room_ids, i);
+    EvSyncStats *stats = g_hash_table_lookup (account->room_sync_stats, id);
+
+    g_string_append_printf (out, "%*s%-40s  %8" G_GUINT64_FORMAT "  %7.1f  %6" G_GINT64_FORMAT " ms  %6" G_GINT64_FORMAT " ms\n",
+                            INFO_INDENT, "", id, stats->n_events,
+                            ev_sync_stats_get_rate (stats),
+                            ev_histogram_get_percentile (&stats->lag, 50),
+                            ev_histogram_get_percentile (&stats->lag, 99));
+  }
+
+  return g_steal_pointer (&out);
 }
 
 
 static GString *
-ev_matrix_room_load_past_events (GStrv args, GError **err)
+ev_matrix_watchdog (GStrv args, GError **err)
 {
-  g_autoptr (GError) local_err = NULL;
-  g_autoptr (CmRoom) room = NULL;
-  const char *room_id;
-  gboolean success;
+  g_autoptr (EvFormatBuilder) builder = ev_format_builder_new ();
+  gint64 now = g_get_monotonic_time ();
 
-  g_assert (client);
+  for (guint i = 0; args[i]; i++) {
+    guint64 seconds;
 
-  if (g_strv_length (args) < 1) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
-    return NULL;
+    if (g_str_equal (args[i], "--recover")) {
+      watchdog_recover = TRUE;
+    } else if (g_str_equal (args[i], "--no-recover")) {
+      watchdog_recover = FALSE;
+    } else {
+      if (!g_ascii_string_to_unsigned (args[i], 10, WATCHDOG_INTERVAL, G_MAXUINT, &seconds, err))
+        return NULL;
+      watchdog_threshold = seconds;
+    }
   }
-  room_id = args[0];
 
-  room = get_joined_room_by_id (room_id);
-  if (!room) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", room_id);
-    return NULL;
-  }
+  ev_format_builder_set_indent (builder, INFO_INDENT);
+  ev_format_builder_take_value (builder, _("Threshold"),
+                                g_strdup_printf ("%u s", watchdog_threshold));
+  ev_format_builder_add (builder, _("Recovery"), watchdog_recover ? _("on") : _("off"));
 
-  success = cm_room_load_past_events_sync (room, &local_err);
-  if (!success) {
-    if (local_err) {
-      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   _("Failed to load events: %s"), local_err->message);
-      return NULL;
+  for (guint i = 0; accounts && i < accounts->len; i++) {
+    EvAccount *account = g_ptr_array_index (accounts, i);
+
+    if (account->skipped)
+      continue;
+
+    ev_format_builder_add_newline (builder);
+    ev_format_builder_add (builder, _("User"), account->username);
+    if (account->last_sync) {
+      ev_format_builder_take_value (builder, _("Last sync"),
+                                    g_strdup_printf (_("%d s ago"),
+                                                     (int) ((now - account->last_sync) / G_USEC_PER_SEC)));
     } else {
-      g_string_new (_("No events loaded from database"));
+      ev_format_builder_add (builder, _("Last sync"), _("never"));
+    }
+    if (account->stall_start) {
+      ev_format_builder_take_value (builder, _("State"),
+                                    g_strdup_printf (_("stalled for %d s"),
+                                                     (int) ((now - account->stall_start) / G_USEC_PER_SEC)));
+    } else {
+      ev_format_builder_add (builder, _("State"), _("ok"));
     }
+    ev_format_builder_take_value (builder, _("Stalls"),
+                                  g_strdup_printf ("%u", account->n_stalls));
+    ev_format_builder_take_value (builder, _("Stall duration"),
+                                  ev_histogram_format (&account->stalls, " s"));
+    ev_format_builder_take_value (builder, _("Recoveries"),
+                                  g_strdup_printf ("%u", account->n_recoveries));
   }
 
-  return g_string_new (_("Loaded events from database"));
+  return ev_format_builder_end (builder);
 }
 
 
 static GString *
-ev_matrix_room_get_event (GStrv args, GError **err)
+ev_matrix_bench_send (GStrv args, GError **err)
 {
-  g_autoptr (GError) local_err = NULL;
-  g_autoptr (CmEvent) event = NULL;
-  g_autoptr (GString) out = g_string_new ("");
   g_autoptr (CmRoom) room = NULL;
-  g_autofree char *nick = NULL;
-  const char *room_id, *event_id;
-  CmUser *user;
-  GListModel *events;
-
-  g_assert (client);
+  guint64 count = 10, rate = 1, size = 64;
+  EvBenchSend *bench;
+  EvAccount *account;
 
-  if (g_strv_length (args) < 2) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+  account = get_current_account (err);
+  if (!account)
     return NULL;
-  }
-  room_id = args[0];
-  event_id = args[1];
 
-  room = get_joined_room_by_id (room_id);
-  if (!room) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", room_id);
+  if (g_strv_length (args) < 1) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
     return NULL;
   }
 
-  events = cm_room_get_events_list (room);
-  for (guint i = 0; i < g_list_model_get_n_items (events); i++) {
-    g_autoptr (CmEvent) e = g_list_model_get_item (events, i);
-    const char *id = cm_event_get_id (e);
+  for (guint i = 1; args[i]; i++) {
+    guint64 *value, max;
+
+    if (g_str_equal (args[i], "--count")) {
+      value = &count;
+      max = BENCH_SEND_MAX_COUNT;
+    } else if (g_str_equal (args[i], "--rate")) {
+      value = &rate;
+      max = 1000;
+    } else if (g_str_equal (args[i], "--size")) {
+      value = &size;
+      max = BENCH_SEND_MAX_SIZE;
+    } else {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown argument '%s'", args[i]);
+      return NULL;
+    }
 
-    if (g_str_equal (event_id, id)) {
-      event = g_steal_pointer (&e);
-      g_string_append_printf (out, "  Found cached event %s\n", id);
-      break;
+    if (!args[i + 1]) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Missing value for '%s'", args[i]);
+      return NULL;
     }
-  }
 
-  if (event)
-    goto print;
+    if (!g_ascii_string_to_unsigned (args[++i], 10, 1, max, value, err))
+      return NULL;
+  }
 
-  event = cm_room_get_event_sync (room, event_id, cancel, &local_err);
-  if (!event && local_err) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED,
-                 "Failed to get event: %s", local_err->message);
+  if (bench_send) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_BUSY, "Benchmark %s still running", bench_send->tag);
     return NULL;
   }
-  if (!event) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
-                 "Event %s not found", event_id);
+
+  room = get_joined_room_by_id (account, args[0]);
+  if (!room) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Room %s not found", args[0]);
     return NULL;
   }
 
- print:
-  nick = ev_enum_to_nick (CM_TYPE_EVENT_TYPE, cm_event_get_m_type (event));
-  user = cm_event_get_sender (event);
-  g_string_append_printf (out, "    Message type: %s\n", nick);
-  g_string_append_printf (out, "       Sender id: %s\n", cm_user_get_id (user));
+  bench = g_new0 (EvBenchSend, 1);
+  bench->account = account;
+  bench->room = g_steal_pointer (&room);
+  bench->tag = g_strdup_printf ("%08x", g_random_int ());
+  bench->count = count;
+  bench->rate = rate;
+  bench->size = size;
+  bench->started = g_new0 (gint64, count);
+  bench->echoed = g_new0 (gboolean, count);
+  bench_send = bench;
+
+  on_bench_send_tick (NULL);
+  if (bench->n_sent < bench->count)
+    bench->timer_id = g_timeout_add (1000 / rate, on_bench_send_tick, NULL);
+
+  return g_string_new_take (g_strdup_printf ("Benchmark %s: sending %u messages of %u bytes at %u/s",
+                                             bench->tag, bench->count, bench->size, bench->rate));
+}
 
-  if (CM_IS_ROOM_MESSAGE_EVENT (event)) {
-    CmRoomMessageEvent *room_msg = CM_ROOM_MESSAGE_EVENT (event);
 
-    if (cm_room_message_event_get_msg_type (room_msg))
-      g_string_append_printf (out, "       Text message: %s",
-                              cm_room_message_event_get_body (room_msg));
-  }
+static GString *
+ev_matrix_scheduler_stats (GStrv args, GError **err)
+{
+  g_autoptr (EvFormatBuilder) builder = ev_format_builder_new ();
 
-  return g_steal_pointer (&out);
+  ev_format_builder_set_indent (builder, INFO_INDENT);
+  ev_scheduler_format_stats (scheduler, builder);
+
+  return ev_format_builder_end (builder);
 }
 
 
 static GString *
-ev_matrix_get_pushers (GStrv args, GError **err)
+ev_matrix_media_cache (GStrv args, GError **err)
 {
-  g_autoptr (GError) local_err = NULL;
-  g_autoptr (EvFormatBuilder) builder = NULL;
+  g_autoptr (EvFormatBuilder) builder = ev_format_builder_new ();
+
+  if (args[0]) {
+    if (!g_str_equal (args[0], "--clear") || args[1]) {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown argument '%s'", args[0]);
+      return NULL;
+    }
 
-  g_assert (CM_IS_CLIENT (client));
+    if (!ev_media_cache_clear (media_cache, err))
+      return NULL;
 
-  g_clear_pointer (&pushers, g_ptr_array_unref);
-  pushers = cm_client_get_pushers_sync (client, cancel, &local_err);
-  if (!pushers) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED,
-                 "Failed to get pushers: %s", local_err->message);
-    return NULL;
+    return g_string_new ("Cleared media cache");
   }
 
-  if (!pushers->len)
-    return g_string_new ("    No pushers configured\n");
-
-  builder = ev_format_builder_new ();
   ev_format_builder_set_indent (builder, INFO_INDENT);
-  for (int i = 0; i < pushers->len; i++) {
-    CmPusher *pusher = g_ptr_array_index (pushers, i);
-
-    if (i != 0)
-      ev_format_builder_add_newline (builder);
-
-    ev_format_builder_take_value (builder, "Pusher Id",
-                                  g_strdup_printf ("%d", i));
-    ev_format_builder_add (builder, "Kind",
-                           cm_pusher_get_kind_as_string (pusher));
-    ev_format_builder_add (builder, "App Display Name",
-                           cm_pusher_get_app_display_name (pusher));
-    ev_format_builder_add (builder, "App Id", cm_pusher_get_app_id (pusher));
-    ev_format_builder_add (builder, "Device Display Name",
-                           cm_pusher_get_device_display_name (pusher));
-    ev_format_builder_add (builder, "Lang", cm_pusher_get_lang (pusher));
-    ev_format_builder_add (builder, "Profile Tag", cm_pusher_get_profile_tag (pusher));
-    ev_format_builder_add (builder, "Pushkey", cm_pusher_get_pushkey (pusher));
-    if (cm_pusher_get_kind (pusher) == CM_PUSHER_KIND_HTTP)
-      ev_format_builder_add (builder, "Url", cm_pusher_get_url (pusher));
-  }
+  ev_media_cache_format_stats (media_cache, builder);
 
   return ev_format_builder_end (builder);
 }
 
 
+static const char *timeout_names[] = {
+  "devices",
+  "download",
+  "get-pushers",
+  "join",
+  "join-many",
+  "mark-read",
+  "members",
+  "remove-pusher",
+  "room-get-event",
+  "upload",
+  NULL
+};
+
+
 static GString *
-ev_matrix_remove_pusher (GStrv args, GError **err)
+ev_matrix_timeout (GStrv args, GError **err)
 {
-  g_autoptr (GError) local_err = NULL;
-  gint64 pusher_id;
-  CmPusher *pusher;
-  gboolean success;
-  char *endptr;
-
-  g_assert (CM_IS_CLIENT (client));
+  g_autoptr (EvFormatBuilder) builder = NULL;
+  guint64 seconds;
 
-  if (g_strv_length (args) < 1) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
-    return NULL;
-  }
-  pusher_id = strtoll (args[0], &endptr, 10);
-  errno = 0;
-  if (errno) {
-    g_set_error (err, G_IO_ERROR, g_io_error_from_errno (errno), "Invalid argument '%s'", args[0]);
+  if (g_strv_length (args) > 2) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Too many arguments");
     return NULL;
   }
-  if (args[0] == endptr) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "No numbers found in '%s'", args[0]);
+
+  if (args[0] && !g_strv_contains (timeout_names, args[0])) {
+    g_set_error (err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "No timeout for '%s'", args[0]);
     return NULL;
   }
 
-  if (!pushers) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "No pushers - did you run /get-pushers ?");
-    return NULL;
+  if (g_strv_length (args) == 2) {
+    if (!g_ascii_string_to_unsigned (args[1], 10, 0, G_MAXUINT / 1000, &seconds, err))
+      return NULL;
+
+    ev_scheduler_set_timeout (scheduler, args[0], seconds * 1000);
   }
 
-  if (pusher_id >= pushers->len || pusher_id < 0) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Invalid pusher id '%ld'", pusher_id);
-    return NULL;
+  builder = ev_format_builder_new ();
+  ev_format_builder_set_indent (builder, INFO_INDENT);
+  for (int i = 0; timeout_names[i]; i++) {
+    guint timeout = ev_scheduler_get_timeout (scheduler, timeout_names[i]);
+
+    if (args[0] && !g_str_equal (args[0], timeout_names[i]))
+      continue;
+
+    if (timeout)
+      ev_format_builder_take_value (builder, timeout_names[i], g_strdup_printf ("%u s", timeout / 1000));
+    else
+      ev_format_builder_add (builder, timeout_names[i], _("none"));
   }
 
-  pusher = g_ptr_array_index (pushers, pusher_id);
-  g_assert (CM_IS_PUSHER (pusher));
+  return ev_format_builder_end (builder);
+}
+
 
-  success = cm_client_remove_pusher_sync (client, pusher, cancel, &local_err);
-  if (!success) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED,
-                 "Failed to remove pusher: %s", local_err->message);
-    return NULL;
+static GStrv
+matrix_command_opt_get_timeout_completion (const char *word, int pos)
+{
+  g_autoptr (GStrvBuilder) builder = g_strv_builder_new ();
+
+  for (int i = 0; timeout_names[i]; i++) {
+    if (strncmp (timeout_names[i], word, pos) == 0)
+      g_strv_builder_add (builder, timeout_names[i]);
   }
 
-  return g_string_new_take (g_strdup_printf ("Removed pusher %ld", pusher_id));
+  return g_strv_builder_end (builder);
 }
 
 
-static GString *
-ev_matrix_join_room (GStrv args, GError **err)
+static GStrv
+matrix_command_opt_get_account_completion (const char *word, int pos)
 {
-  const char *room;
-
-  g_assert (CM_IS_CLIENT (client));
+  g_autoptr (GStrvBuilder) builder = g_strv_builder_new ();
 
-  if (g_strv_length (args) < 1) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not enough arguments");
+  if (!accounts)
     return NULL;
-  }
 
-  if (g_strv_length (args) > 1) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Too many arguments");
-    return NULL;
-  }
+  for (guint i = 0; i < accounts->len; i++) {
+    EvAccount *account = g_ptr_array_index (accounts, i);
 
-  room = args[0];
-  if (!g_regex_match (room_regex, room, G_REGEX_MATCH_DEFAULT, NULL)) {
-    g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Not a valid room id or alias");
-    return NULL;
+    if (strncmp (account->username, word, pos) == 0)
+      g_strv_builder_add (builder, account->username);
   }
 
-  if (!cm_client_join_room_sync (client, room, err))
-    return NULL;
-
-  return g_string_new_take (g_strdup_printf ("Joined '%s'", room));
+  return g_strv_builder_end (builder);
 }
 
+
 static GStrv
 matrix_command_opt_get_room_completion (const char *word, int pos)
 {
   g_autoptr (GStrvBuilder) builder = g_strv_builder_new ();
+  GListModel *joined_rooms;
 
-  if (!joined_rooms)
+  if (!current || !current->joined_rooms)
     return NULL;
+  joined_rooms = current->joined_rooms;
 
   for (guint i = 0; i < g_list_model_get_n_items (joined_rooms); i++) {
     g_autoptr (CmRoom) room = g_list_model_get_item (joined_rooms, i);
@@ -667,6 +4102,32 @@ matrix_command_opt_get_room_completion (const char *word, int pos)
 }
 
 
+static GStrv
+matrix_command_opt_get_member_completion (const char *word, int pos)
+{
+  g_autoptr (GStrvBuilder) builder = g_strv_builder_new ();
+  g_autoptr (GHashTable) seen = g_hash_table_new (g_str_hash, g_str_equal);
+  GHashTableIter iter;
+  GPtrArray *members;
+
+  if (!current)
+    return NULL;
+
+  /* Only members already fetched via /members, completion never hits the network */
+  g_hash_table_iter_init (&iter, current->member_cache);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&members)) {
+    for (guint i = 0; i < members->len; i++) {
+      EvMember *member = g_ptr_array_index (members, i);
+
+      if (strncmp (member->user_id, word, pos) == 0 && g_hash_table_add (seen, member->user_id))
+        g_strv_builder_add (builder, member->user_id);
+    }
+  }
+
+  return g_strv_builder_end (builder);
+}
+
+
 static const EvCmdOpt matrix_room_events_opts[] = {
   {
     .name = "room-id",
@@ -678,6 +4139,19 @@ static const EvCmdOpt matrix_room_events_opts[] = {
 };
 
 
+static const EvCmdOpt matrix_tail_opts[] = {
+  {
+    .name = "room-ids",
+    .desc = "The ids of the rooms to show new events for, all rooms if none are given. "
+            "Use --stop to stop",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+    .completer = matrix_command_opt_get_room_completion,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
 static const EvCmdOpt matrix_room_load_past_events_opts[] = {
   {
     .name = "room-id",
@@ -704,6 +4178,80 @@ static const EvCmdOpt matrix_room_get_event_opts[] = {
 };
 
 
+static const EvCmdOpt matrix_download_opts[] = {
+  {
+    .name = "room-id",
+    .desc = "The id of the room the event is in",
+    .completer = matrix_command_opt_get_room_completion,
+  },
+  {
+    .name = "event-id",
+    .desc = "The id of the event with the attachment",
+  },
+  {
+    .name = "path",
+    .desc = "Where to store the file, defaults to the file name",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt matrix_download_all_opts[] = {
+  {
+    .name = "room-id",
+    .desc = "The id of the room to download the attachments of",
+    .completer = matrix_command_opt_get_room_completion,
+  },
+  {
+    .name = "dir",
+    .desc = "The directory to store the files in, defaults to the current one",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt matrix_upload_opts[] = {
+  {
+    .name = "room-id",
+    .desc = "The id of the room to send the file to",
+    .completer = matrix_command_opt_get_room_completion,
+  },
+  {
+    .name = "file",
+    .desc = "The file to upload",
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt matrix_media_cache_opts[] = {
+  {
+    .name = "--clear",
+    .desc = "Remove all cached media",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt matrix_sync_stats_opts[] = {
+  {
+    .name = "room-id",
+    .desc = "The id of the room to show the stats for",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+    .completer = matrix_command_opt_get_room_completion,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
 static const EvCmdOpt matrix_room_details_opts[] = {
   {
     .name = "room-id",
@@ -715,10 +4263,209 @@ static const EvCmdOpt matrix_room_details_opts[] = {
 };
 
 
+static const EvCmdOpt matrix_members_opts[] = {
+  {
+    .name = "room-id",
+    .desc = "The id of the room to list the members of",
+    .completer = matrix_command_opt_get_room_completion,
+  },
+  {
+    .name = "--limit",
+    .desc = "The number of members to show, defaults to 50",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  {
+    .name = "--offset",
+    .desc = "The number of members to skip",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  {
+    .name = "--membership",
+    .desc = "The membership to list, only join is supported",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt matrix_member_opts[] = {
+  {
+    .name = "room-id",
+    .desc = "The id of the room the user is a member of",
+    .completer = matrix_command_opt_get_room_completion,
+  },
+  {
+    .name = "user-id",
+    .desc = "The id of the user",
+    .completer = matrix_command_opt_get_member_completion,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt matrix_devices_opts[] = {
+  {
+    .name = "room-id",
+    .desc = "The id of the room whose members to list the devices of",
+    .completer = matrix_command_opt_get_room_completion,
+  },
+  {
+    .name = "user-ids",
+    .desc = "The members to list the devices of, defaults to all",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+    .completer = matrix_command_opt_get_member_completion,
+  },
+  {
+    .name = "--refresh",
+    .desc = "Query the server even if the devices are cached",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt matrix_remove_pushers_opts[] = {
+  {
+    .name = "--app-id",
+    .desc = "Only remove pushers with the given app id",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  {
+    .name = "--kind",
+    .desc = "Only remove pushers of the given kind (e.g. 'http')",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  {
+    .name = "--url-prefix",
+    .desc = "Only remove http pushers whose url starts with the given prefix",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt matrix_join_many_opts[] = {
+  {
+    .name = "rooms",
+    .desc = "Room ids, aliases or files listing one room id or alias per line",
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt matrix_mark_read_opts[] = {
+  {
+    .name = "rooms",
+    .desc = "The ids of the rooms to mark read or --all for all joined rooms",
+    .completer = matrix_command_opt_get_room_completion,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt matrix_timeout_opts[] = {
+  {
+    .name = "command",
+    .desc = "The command to show or set the timeout for",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+    .completer = matrix_command_opt_get_timeout_completion,
+  },
+  {
+    .name = "seconds",
+    .desc = "The new timeout in seconds, 0 disables the timeout",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt matrix_account_opts[] = {
+  {
+    .name = "account",
+    .desc = "The user id or config group of the account to select",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+    .completer = matrix_command_opt_get_account_completion,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt matrix_prune_clients_opts[] = {
+  {
+    .name = "--delete",
+    .desc = "Delete the stale clients from the database instead of listing them",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt matrix_bench_send_opts[] = {
+  {
+    .name = "room-id",
+    .desc = "The id of the room to send the messages to",
+    .completer = matrix_command_opt_get_room_completion,
+  },
+  {
+    .name = "--count",
+    .desc = "The number of messages to send, defaults to 10",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  {
+    .name = "--rate",
+    .desc = "Messages to send per second, defaults to 1",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  {
+    .name = "--size",
+    .desc = "The size of each message in bytes, defaults to 64",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt matrix_watchdog_opts[] = {
+  {
+    .name = "seconds",
+    .desc = "Warn when there was no sync for that many seconds",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  {
+    .name = "--recover",
+    .desc = "Restart the sync of stalled accounts, --no-recover disables it again",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static const EvCmdOpt matrix_get_pushers_opts[] = {
+  {
+    .name = "--refresh",
+    .desc = "Refetch the pushers in the background, this changes the ids",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
 static const EvCmdOpt matrix_get_remove_pusher_opts[] = {
   {
     .name = "number",
-    .desc = "The number of the pusher",
+    .desc = "The number of the pusher as shown by /get-pushers or its pushkey",
   },
   /* Sentinel */
   { NULL }
@@ -726,6 +4473,18 @@ static const EvCmdOpt matrix_get_remove_pusher_opts[] = {
 
 
 static EvCmd matrix_commands[] = {
+  {
+    .name = "account",
+    .help_summary = N_("List the accounts and their sync stats or select the account commands act on"),
+    .func = ev_matrix_account,
+    .opts = matrix_account_opts,
+  },
+  {
+    .name = "prune-clients",
+    .help_summary = N_("List or delete stored clients that belong to no configured account"),
+    .func = ev_matrix_prune_clients,
+    .opts = matrix_prune_clients_opts,
+  },
   {
     .name = "client-details",
     .help_summary = N_("Print client information - no request is made to the server"),
@@ -742,12 +4501,36 @@ static EvCmd matrix_commands[] = {
     .func = ev_matrix_room_details,
     .opts = matrix_room_details_opts,
   },
+  {
+    .name = "members",
+    .help_summary = N_("List the joined members of a room, fetched once and then cached"),
+    .func = ev_matrix_members,
+    .opts = matrix_members_opts,
+  },
+  {
+    .name = "member",
+    .help_summary = N_("Show a member of a room"),
+    .func = ev_matrix_member,
+    .opts = matrix_member_opts,
+  },
+  {
+    .name = "devices",
+    .help_summary = N_("List the devices and keys of room members, cached for up to 10 minutes"),
+    .func = ev_matrix_devices,
+    .opts = matrix_devices_opts,
+  },
   {
     .name = "room-events",
     .help_summary = N_("List events in a room"),
     .func = ev_matrix_room_events,
     .opts = matrix_room_events_opts,
   },
+  {
+    .name = "tail",
+    .help_summary = N_("Show new events of the given rooms as they arrive"),
+    .func = ev_matrix_tail,
+    .opts = matrix_tail_opts,
+  },
   {
     .name = "room-load-past-events",
     .help_summary = N_("Fetch past room events from the database"),
@@ -760,10 +4543,35 @@ static EvCmd matrix_commands[] = {
     .func = ev_matrix_room_get_event,
     .opts = matrix_room_get_event_opts,
   },
+  {
+    .name = "download",
+    .help_summary = N_("Download the attachment of the given event"),
+    .func = ev_matrix_download,
+    .opts = matrix_download_opts,
+  },
+  {
+    .name = "download-all",
+    .help_summary = N_("Download the attachments of all loaded events of a room"),
+    .func = ev_matrix_download_all,
+    .opts = matrix_download_all_opts,
+  },
+  {
+    .name = "upload",
+    .help_summary = N_("Send a file to a room"),
+    .func = ev_matrix_upload,
+    .opts = matrix_upload_opts,
+  },
+  {
+    .name = "media-cache",
+    .help_summary = N_("Show media cache usage and hit rate, --clear empties it"),
+    .func = ev_matrix_media_cache,
+    .opts = matrix_media_cache_opts,
+  },
   {
     .name = "get-pushers",
-    .help_summary = N_("Get the currently configured push servers from the server"),
+    .help_summary = N_("Get the configured push servers, cached after the first fetch"),
     .func = ev_matrix_get_pushers,
+    .opts = matrix_get_pushers_opts,
   },
   {
     .name = "remove-pusher",
@@ -771,11 +4579,58 @@ static EvCmd matrix_commands[] = {
     .func = ev_matrix_remove_pusher,
     .opts = matrix_get_remove_pusher_opts,
   },
+  {
+    .name = "remove-pushers",
+    .help_summary = N_("Remove all pushers matching the given filters"),
+    .func = ev_matrix_remove_pushers,
+    .opts = matrix_remove_pushers_opts,
+  },
   {
     .name = "join",
     .help_summary = N_("Join a room by its id or alias"),
     .func = ev_matrix_join_room,
   },
+  {
+    .name = "join-many",
+    .help_summary = N_("Join many rooms given by id, alias or from files"),
+    .func = ev_matrix_join_many,
+    .opts = matrix_join_many_opts,
+  },
+  {
+    .name = "mark-read",
+    .help_summary = N_("Mark the latest loaded event of the given or all rooms as read"),
+    .func = ev_matrix_mark_read,
+    .opts = matrix_mark_read_opts,
+  },
+  {
+    .name = "sync-stats",
+    .help_summary = N_("Show sync throughput and delivery lag overall or for a room - no request is made to the server"),
+    .func = ev_matrix_sync_stats,
+    .opts = matrix_sync_stats_opts,
+  },
+  {
+    .name = "bench-send",
+    .help_summary = N_("Send tagged messages at a given rate and measure send and echo latency"),
+    .func = ev_matrix_bench_send,
+    .opts = matrix_bench_send_opts,
+  },
+  {
+    .name = "watchdog",
+    .help_summary = N_("Show sync stalls, set the stall threshold and toggle recovery"),
+    .func = ev_matrix_watchdog,
+    .opts = matrix_watchdog_opts,
+  },
+  {
+    .name = "scheduler-stats",
+    .help_summary = N_("Show request queue depths, wait times and rate limits - no request is made to the server"),
+    .func = ev_matrix_scheduler_stats,
+  },
+  {
+    .name = "timeout",
+    .help_summary = N_("Show or set the deadline of commands talking to the server"),
+    .func = ev_matrix_timeout,
+    .opts = matrix_timeout_opts,
+  },
   /* Sentinel */
   { NULL }
 };
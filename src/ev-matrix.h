@@ -11,7 +11,9 @@
 
 G_BEGIN_DECLS
 
-void         ev_matrix_init         (const char *data_dir, const char *cache_dir);
+void         ev_matrix_init         (const char         *data_dir,
+                                     const char         *cache_dir,
+                                     const char * const *only_accounts);
 void         ev_matrix_destroy      (void);
 void         ev_matrix_add_commands (GPtrArray *commands);
 
@@ -0,0 +1,576 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "ev-config.h"
+
+#include "ev-media-cache.h"
+
+#include <errno.h>
+#include <glib/gi18n.h>
+#include <glib/gstdio.h>
+
+#define MEDIA_CACHE_CHUNK_SIZE  (64 * 1024)
+#define MEDIA_CACHE_SAVE_DELAY  5 /* seconds */
+
+/**
+ * EvMediaCache:
+ *
+ * An on disk media cache. Content is stored once under its sha256 no
+ * matter how many keys refer to it so identical media (e.g. forwarded
+ * attachments) only takes up space once. When the cache grows over its
+ * size limit the least recently used content is evicted.
+ *
+ * Content larger than the size limit isn't cached at all.
+ *
+ * The index mapping keys to content is kept in a key file next to the
+ * content. It's saved a few seconds after a change so a burst of
+ * lookups doesn't rewrite it each time.
+ */
+
+typedef struct {
+  goffset size;
+  gint64  last_used;  /* s, real time */
+} EvMediaObject;
+
+typedef struct {
+  char    *key;
+  GFile   *file;
+  char    *dir;
+  char    *hash;
+  goffset  size;
+  goffset  max_size;
+  gboolean too_large;
+} EvMediaCacheStore;
+
+struct _EvMediaCache {
+  GObject     parent;
+
+  char       *dir;
+  char       *objects_dir;
+  char       *index_path;
+  goffset     max_size;
+  goffset     size;
+  GHashTable *objects;  /* hash → EvMediaObject */
+  GHashTable *keys;     /* key → hash */
+  guint       save_id;
+
+  guint64     n_hits;
+  guint64     n_misses;
+  guint64     n_deduplicated;
+  guint64     n_evicted;
+  guint64     n_too_large;
+  guint64     bytes_saved;        /* Not downloaded due to hits */
+  guint64     bytes_deduplicated; /* Not stored twice */
+};
+G_DEFINE_TYPE (EvMediaCache, ev_media_cache, G_TYPE_OBJECT)
+
+
+static void
+media_cache_store_free (EvMediaCacheStore *store)
+{
+  g_free (store->key);
+  g_clear_object (&store->file);
+  g_free (store->dir);
+  g_free (store->hash);
+  g_free (store);
+}
+
+
+static void
+save_index (EvMediaCache *self)
+{
+  g_autoptr (GKeyFile) keyfile = g_key_file_new ();
+  g_autoptr (GHashTable) refs = NULL;
+  g_autoptr (GError) err = NULL;
+  GHashTableIter iter;
+  const char *key, *hash;
+  EvMediaObject *object;
+
+  refs = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) g_strv_builder_unref);
+  g_hash_table_iter_init (&iter, self->keys);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&key, (gpointer *)&hash)) {
+    GStrvBuilder *builder = g_hash_table_lookup (refs, hash);
+
+    if (!builder) {
+      builder = g_strv_builder_new ();
+      g_hash_table_insert (refs, (gpointer) hash, builder);
+    }
+    g_strv_builder_add (builder, key);
+  }
+
+  g_hash_table_iter_init (&iter, self->objects);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&hash, (gpointer *)&object)) {
+    GStrvBuilder *builder = g_hash_table_lookup (refs, hash);
+    g_auto (GStrv) keys = NULL;
+
+    g_key_file_set_int64 (keyfile, hash, "size", object->size);
+    g_key_file_set_int64 (keyfile, hash, "last-used", object->last_used);
+    if (builder) {
+      keys = g_strv_builder_end (builder);
+      g_key_file_set_string_list (keyfile, hash, "keys", (const char * const *) keys,
+                                  g_strv_length (keys));
+    }
+  }
+
+  if (!g_key_file_save_to_file (keyfile, self->index_path, &err))
+    g_warning ("Failed to save media cache index %s: %s", self->index_path, err->message);
+}
+
+
+static gboolean
+on_save_index_timeout (gpointer user_data)
+{
+  EvMediaCache *self = EV_MEDIA_CACHE (user_data);
+
+  self->save_id = 0;
+  save_index (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+
+static void
+queue_save_index (EvMediaCache *self)
+{
+  if (self->save_id)
+    return;
+
+  self->save_id = g_timeout_add_seconds (MEDIA_CACHE_SAVE_DELAY, on_save_index_timeout, self);
+}
+
+
+static void
+load_index (EvMediaCache *self)
+{
+  g_autoptr (GKeyFile) keyfile = g_key_file_new ();
+  g_auto (GStrv) groups = NULL;
+
+  if (!g_key_file_load_from_file (keyfile, self->index_path, G_KEY_FILE_NONE, NULL))
+    return;
+
+  groups = g_key_file_get_groups (keyfile, NULL);
+  for (guint i = 0; groups[i]; i++) {
+    g_autofree char *path = g_build_filename (self->objects_dir, groups[i], NULL);
+    g_auto (GStrv) keys = NULL;
+    EvMediaObject *object;
+
+    /* Removed behind our back */
+    if (!g_file_test (path, G_FILE_TEST_IS_REGULAR))
+      continue;
+
+    object = g_new0 (EvMediaObject, 1);
+    object->size = g_key_file_get_int64 (keyfile, groups[i], "size", NULL);
+    object->last_used = g_key_file_get_int64 (keyfile, groups[i], "last-used", NULL);
+    g_hash_table_insert (self->objects, g_strdup (groups[i]), object);
+    self->size += object->size;
+
+    keys = g_key_file_get_string_list (keyfile, groups[i], "keys", NULL, NULL);
+    for (guint j = 0; keys && keys[j]; j++)
+      g_hash_table_insert (self->keys, g_strdup (keys[j]), g_strdup (groups[i]));
+  }
+}
+
+
+static void
+remove_object (EvMediaCache *self, const char *hash_)
+{
+  /* The hash may be owned by one of the entries removed below */
+  g_autofree char *hash = g_strdup (hash_);
+  g_autofree char *path = g_build_filename (self->objects_dir, hash, NULL);
+  EvMediaObject *object = g_hash_table_lookup (self->objects, hash);
+  GHashTableIter iter;
+  const char *ref;
+
+  if (g_unlink (path) < 0 && errno != ENOENT)
+    g_warning ("Failed to remove %s: %s", path, g_strerror (errno));
+
+  g_hash_table_iter_init (&iter, self->keys);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&ref)) {
+    if (g_str_equal (ref, hash))
+      g_hash_table_iter_remove (&iter);
+  }
+
+  if (object) {
+    self->size -= object->size;
+    g_hash_table_remove (self->objects, hash);
+  }
+}
+
+
+static void
+evict (EvMediaCache *self)
+{
+  while (self->size > self->max_size) {
+    GHashTableIter iter;
+    const char *hash, *oldest = NULL;
+    EvMediaObject *object;
+    gint64 oldest_used = G_MAXINT64;
+
+    g_hash_table_iter_init (&iter, self->objects);
+    while (g_hash_table_iter_next (&iter, (gpointer *)&hash, (gpointer *)&object)) {
+      if (object->last_used < oldest_used) {
+        oldest = hash;
+        oldest_used = object->last_used;
+      }
+    }
+
+    if (!oldest)
+      break;
+
+    g_debug ("Evicting %s from media cache", oldest);
+    remove_object (self, oldest);
+    self->n_evicted++;
+  }
+}
+
+
+static void
+ev_media_cache_finalize (GObject *object)
+{
+  EvMediaCache *self = EV_MEDIA_CACHE (object);
+
+  /* Flush a pending save */
+  if (self->save_id) {
+    g_clear_handle_id (&self->save_id, g_source_remove);
+    save_index (self);
+  }
+
+  g_free (self->dir);
+  g_free (self->objects_dir);
+  g_free (self->index_path);
+  g_hash_table_unref (self->objects);
+  g_hash_table_unref (self->keys);
+
+  G_OBJECT_CLASS (ev_media_cache_parent_class)->finalize (object);
+}
+
+
+static void
+ev_media_cache_class_init (EvMediaCacheClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = ev_media_cache_finalize;
+}
+
+
+static void
+ev_media_cache_init (EvMediaCache *self)
+{
+  self->objects = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  self->keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
+
+/**
+ * ev_media_cache_new:
+ * @dir: The directory to store the cache in
+ * @max_size: The size in bytes above which content gets evicted
+ *
+ * Returns: A new media cache
+ */
+EvMediaCache *
+ev_media_cache_new (const char *dir, goffset max_size)
+{
+  EvMediaCache *self = g_object_new (EV_TYPE_MEDIA_CACHE, NULL);
+
+  self->dir = g_strdup (dir);
+  self->objects_dir = g_build_filename (dir, "objects", NULL);
+  self->index_path = g_build_filename (dir, "index.cfg", NULL);
+  self->max_size = max_size;
+
+  if (g_mkdir_with_parents (self->objects_dir, 0700) < 0)
+    g_warning ("Failed to create %s: %s", self->objects_dir, g_strerror (errno));
+
+  load_index (self);
+
+  return self;
+}
+
+/**
+ * ev_media_cache_lookup:
+ * @self: The media cache
+ * @key: The key the content was stored under
+ *
+ * Looks up cached content and marks it as recently used.
+ *
+ * Returns:(transfer full)(nullable): The file with the content
+ */
+GFile *
+ev_media_cache_lookup (EvMediaCache *self, const char *key)
+{
+  g_autofree char *path = NULL;
+  EvMediaObject *object;
+  const char *hash;
+
+  g_assert (EV_IS_MEDIA_CACHE (self));
+
+  hash = g_hash_table_lookup (self->keys, key);
+  object = hash ? g_hash_table_lookup (self->objects, hash) : NULL;
+  if (!object) {
+    self->n_misses++;
+    return NULL;
+  }
+
+  path = g_build_filename (self->objects_dir, hash, NULL);
+  if (!g_file_test (path, G_FILE_TEST_IS_REGULAR)) {
+    remove_object (self, hash);
+    queue_save_index (self);
+    self->n_misses++;
+    return NULL;
+  }
+
+  self->n_hits++;
+  self->bytes_saved += object->size;
+  object->last_used = g_get_real_time () / G_USEC_PER_SEC;
+  queue_save_index (self);
+
+  return g_file_new_for_path (path);
+}
+
+
+static void
+store_thread (GTask        *task,
+              gpointer      source_object,
+              gpointer      task_data,
+              GCancellable *cancellable)
+{
+  EvMediaCacheStore *store = task_data;
+  g_autoptr (GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_autoptr (GFileInputStream) in = NULL;
+  g_autoptr (GFileOutputStream) out = NULL;
+  g_autoptr (GFileInfo) info = NULL;
+  g_autoptr (GFile) tmp = NULL;
+  g_autoptr (GFile) target = NULL;
+  g_autofree char *uuid = g_uuid_string_random ();
+  g_autofree char *tmp_name = g_strdup_printf (".%s.tmp", uuid);
+  g_autofree guint8 *buf = g_malloc (MEDIA_CACHE_CHUNK_SIZE);
+  GError *err = NULL;
+  gssize n;
+
+  in = g_file_read (store->file, cancellable, &err);
+  if (!in) {
+    g_task_return_error (task, err);
+    return;
+  }
+
+  /* It would evict everything else and then itself */
+  info = g_file_input_stream_query_info (in, G_FILE_ATTRIBUTE_STANDARD_SIZE, cancellable, NULL);
+  if (info && g_file_info_get_size (info) > store->max_size) {
+    store->too_large = TRUE;
+    g_task_return_boolean (task, TRUE);
+    return;
+  }
+
+  /* Hash and copy in one pass, the temporary file is on the same file
+   * system so it can be renamed into place */
+  tmp = g_file_new_build_filename (store->dir, tmp_name, NULL);
+  out = g_file_replace (tmp, NULL, FALSE, G_FILE_CREATE_PRIVATE, cancellable, &err);
+  if (!out) {
+    g_task_return_error (task, err);
+    return;
+  }
+
+  while ((n = g_input_stream_read (G_INPUT_STREAM (in), buf, MEDIA_CACHE_CHUNK_SIZE,
+                                   cancellable, &err)) > 0) {
+    g_checksum_update (checksum, buf, n);
+    if (!g_output_stream_write_all (G_OUTPUT_STREAM (out), buf, n, NULL, cancellable, &err))
+      break;
+    store->size += n;
+  }
+
+  if (err || !g_output_stream_close (G_OUTPUT_STREAM (out), cancellable, &err)) {
+    g_file_delete (tmp, NULL, NULL);
+    g_task_return_error (task, err);
+    return;
+  }
+
+  store->hash = g_strdup (g_checksum_get_string (checksum));
+  target = g_file_new_build_filename (store->dir, store->hash, NULL);
+
+  /* Same content is already stored */
+  if (g_file_query_exists (target, cancellable)) {
+    g_file_delete (tmp, NULL, NULL);
+    g_task_return_boolean (task, TRUE);
+    return;
+  }
+
+  if (!g_file_move (tmp, target, G_FILE_COPY_OVERWRITE, cancellable, NULL, NULL, &err)) {
+    g_file_delete (tmp, NULL, NULL);
+    g_task_return_error (task, err);
+    return;
+  }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+
+static void
+on_store_thread_done (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+  EvMediaCache *self = EV_MEDIA_CACHE (source_object);
+  g_autoptr (GTask) task = G_TASK (user_data);
+  EvMediaCacheStore *store = g_task_get_task_data (G_TASK (result));
+  EvMediaObject *object;
+  GError *err = NULL;
+
+  if (!g_task_propagate_boolean (G_TASK (result), &err)) {
+    g_task_return_error (task, err);
+    return;
+  }
+
+  if (store->too_large) {
+    self->n_too_large++;
+    g_task_return_boolean (task, TRUE);
+    return;
+  }
+
+  object = g_hash_table_lookup (self->objects, store->hash);
+  if (object) {
+    self->n_deduplicated++;
+    self->bytes_deduplicated += store->size;
+  } else {
+    object = g_new0 (EvMediaObject, 1);
+    object->size = store->size;
+    g_hash_table_insert (self->objects, g_strdup (store->hash), object);
+    self->size += store->size;
+  }
+  object->last_used = g_get_real_time () / G_USEC_PER_SEC;
+  g_hash_table_insert (self->keys, g_strdup (store->key), g_strdup (store->hash));
+
+  evict (self);
+  queue_save_index (self);
+
+  g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * ev_media_cache_store_async:
+ * @self: The media cache
+ * @key: The key to store the content under
+ * @file: The file with the content
+ * @cancellable:(nullable): The cancellable
+ * @callback: The callback
+ * @user_data: The user data for `callback`
+ *
+ * Copies the content of `file` into the cache. Hashing and copying
+ * happens in a thread so large files don't block the main loop. Files
+ * larger than the cache's size limit are skipped.
+ */
+void
+ev_media_cache_store_async (EvMediaCache        *self,
+                            const char          *key,
+                            GFile               *file,
+                            GCancellable        *cancellable,
+                            GAsyncReadyCallback  callback,
+                            gpointer             user_data)
+{
+  g_autoptr (GTask) thread_task = NULL;
+  EvMediaCacheStore *store;
+  GTask *task;
+
+  g_assert (EV_IS_MEDIA_CACHE (self));
+  g_assert (G_IS_FILE (file));
+
+  task = g_task_new (self, cancellable, callback, user_data);
+
+  store = g_new0 (EvMediaCacheStore, 1);
+  store->key = g_strdup (key);
+  store->file = g_object_ref (file);
+  store->dir = g_strdup (self->objects_dir);
+  store->max_size = self->max_size;
+
+  thread_task = g_task_new (self, cancellable, on_store_thread_done, task);
+  g_task_set_task_data (thread_task, store, (GDestroyNotify) media_cache_store_free);
+  g_task_run_in_thread (thread_task, store_thread);
+}
+
+
+gboolean
+ev_media_cache_store_finish (EvMediaCache *self, GAsyncResult *result, GError **error)
+{
+  g_assert (EV_IS_MEDIA_CACHE (self));
+  g_assert (g_task_is_valid (result, self));
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/**
+ * ev_media_cache_clear:
+ * @self: The media cache
+ * @error: The error
+ *
+ * Removes all content from the cache. The counters are kept.
+ *
+ * Returns: `TRUE` on success
+ */
+gboolean
+ev_media_cache_clear (EvMediaCache *self, GError **error)
+{
+  g_autoptr (GPtrArray) hashes = g_ptr_array_new_with_free_func (g_free);
+  GHashTableIter iter;
+  const char *hash;
+
+  g_assert (EV_IS_MEDIA_CACHE (self));
+
+  g_hash_table_iter_init (&iter, self->objects);
+  while (g_hash_table_iter_next (&iter, (gpointer *)&hash, NULL))
+    g_ptr_array_add (hashes, g_strdup (hash));
+
+  for (guint i = 0; i < hashes->len; i++)
+    remove_object (self, g_ptr_array_index (hashes, i));
+
+  g_hash_table_remove_all (self->keys);
+  g_clear_handle_id (&self->save_id, g_source_remove);
+
+  if (g_unlink (self->index_path) < 0 && errno != ENOENT) {
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
+                 "Failed to remove %s: %s", self->index_path, g_strerror (errno));
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * ev_media_cache_format_stats:
+ * @self: The media cache
+ * @builder: The builder to add the stats to
+ *
+ * Adds the cache's size and hit rate.
+ */
+void
+ev_media_cache_format_stats (EvMediaCache *self, EvFormatBuilder *builder)
+{
+  guint64 lookups;
+
+  g_assert (EV_IS_MEDIA_CACHE (self));
+  g_assert (EV_IS_FORMAT_BUILDER (builder));
+
+  lookups = self->n_hits + self->n_misses;
+
+  ev_format_builder_add (builder, _("Directory"), self->dir);
+  ev_format_builder_take_value (builder, _("Size"),
+                                g_strdup_printf ("%" G_GOFFSET_FORMAT " of %" G_GOFFSET_FORMAT " bytes",
+                                                 self->size, self->max_size));
+  ev_format_builder_take_value (builder, _("Objects"),
+                                g_strdup_printf ("%u (%u keys)",
+                                                 g_hash_table_size (self->objects),
+                                                 g_hash_table_size (self->keys)));
+  ev_format_builder_take_value (builder, _("Hits"),
+                                g_strdup_printf ("%" G_GUINT64_FORMAT " (%.0f%%)", self->n_hits,
+                                                 lookups ? 100.0 * self->n_hits / lookups : 0.0));
+  ev_format_builder_take_value (builder, _("Misses"),
+                                g_strdup_printf ("%" G_GUINT64_FORMAT, self->n_misses));
+  ev_format_builder_take_value (builder, _("Bytes saved"),
+                                g_strdup_printf ("%" G_GUINT64_FORMAT, self->bytes_saved));
+  ev_format_builder_take_value (builder, _("Deduplicated"),
+                                g_strdup_printf ("%" G_GUINT64_FORMAT " (%" G_GUINT64_FORMAT " bytes)",
+                                                 self->n_deduplicated, self->bytes_deduplicated));
+  ev_format_builder_take_value (builder, _("Evicted"),
+                                g_strdup_printf ("%" G_GUINT64_FORMAT, self->n_evicted));
+  ev_format_builder_take_value (builder, _("Too large"),
+                                g_strdup_printf ("%" G_GUINT64_FORMAT, self->n_too_large));
+}
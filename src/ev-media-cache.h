@@ -0,0 +1,37 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "ev-format-builder.h"
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define EV_TYPE_MEDIA_CACHE (ev_media_cache_get_type ())
+
+G_DECLARE_FINAL_TYPE (EvMediaCache, ev_media_cache, EV, MEDIA_CACHE, GObject)
+
+EvMediaCache    *ev_media_cache_new              (const char          *dir,
+                                                  goffset              max_size);
+GFile           *ev_media_cache_lookup           (EvMediaCache        *self,
+                                                  const char          *key);
+void             ev_media_cache_store_async      (EvMediaCache        *self,
+                                                  const char          *key,
+                                                  GFile               *file,
+                                                  GCancellable        *cancellable,
+                                                  GAsyncReadyCallback  callback,
+                                                  gpointer             user_data);
+gboolean         ev_media_cache_store_finish     (EvMediaCache        *self,
+                                                  GAsyncResult        *result,
+                                                  GError             **error);
+gboolean         ev_media_cache_clear            (EvMediaCache        *self,
+                                                  GError             **error);
+void             ev_media_cache_format_stats     (EvMediaCache        *self,
+                                                  EvFormatBuilder     *builder);
+
+G_END_DECLS
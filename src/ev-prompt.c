@@ -8,8 +8,10 @@
 
 #include "ev-config.h"
 #include "ev-format-builder.h"
+#include "ev-loop-monitor.h"
 #include "ev-matrix.h"
 #include "ev-prompt.h"
+#include "ev-startup-profile.h"
 
 #include <glib-unix.h>
 #include <glib/gi18n.h>
@@ -20,6 +22,8 @@
 
 #undef DEBUG_COMPLETION
 
+#define HISTORY_SIZE 100
+
 /**
  * EvPrompt:
  *
@@ -32,6 +36,7 @@ static EditLine *el;
 static History *hist;
 static Tokenizer *tok;
 static GPtrArray *commands;
+static gboolean history_loaded;
 
 
 static EvCmd *
@@ -315,7 +320,9 @@ run_command (const char *av[], int ac)
         g_strv_builder_add (builder, av[k]);
 
       args = g_strv_builder_end (builder);
+      ev_loop_monitor_begin (ev_cmd (i)->name);
       out = (ev_cmd (i)->func)(args, &err);
+      ev_loop_monitor_end (ev_cmd (i)->name);
 
       if (out) {
         if (out->len)
@@ -338,6 +345,17 @@ run_command (const char *av[], int ac)
 }
 
 
+static gboolean on_stdin_ready (int fd, GIOCondition condition, gpointer data);
+
+
+static void
+watch_stdin (void)
+{
+  stdin_id = g_unix_fd_add (g_unix_input_stream_get_fd (G_UNIX_INPUT_STREAM (stream)),
+                            G_IO_IN, on_stdin_ready, NULL);
+}
+
+
 static gboolean
 on_stdin_ready (int fd, GIOCondition condition, gpointer data)
 {
@@ -363,8 +381,14 @@ on_stdin_ready (int fd, GIOCondition condition, gpointer data)
   if (strlen (buf) > 1)
     history (hist, &ev, H_ENTER, buf);
 
-  if (av[0] && av[0][0] == '/')
+  if (av[0] && av[0][0] == '/') {
+    /* Commands may iterate the main context while waiting for a
+     * request. Don't read input meanwhile so commands don't nest. */
+    g_clear_handle_id (&stdin_id, g_source_remove);
     run_command (av, ac);
+    if (stream)
+      watch_stdin ();
+  }
 
  done:
   /* FIXME: Is there a simpler way then resetting the whole state? */
@@ -374,29 +398,86 @@ on_stdin_ready (int fd, GIOCondition condition, gpointer data)
 }
 
 
+static History *
+history_new (void)
+{
+  History *h = history_init ();
+  HistEvent ev;
+
+  history (h, &ev, H_SETSIZE, HISTORY_SIZE);
+  history (h, &ev, H_SETUNIQUE, 1);
+
+  return h;
+}
+
+
+static void
+load_history_thread (GTask        *task,
+                     gpointer      source_object,
+                     gpointer      task_data,
+                     GCancellable *cancellable)
+{
+  const char *hist_path = task_data;
+  History *loaded = history_new ();
+  HistEvent ev;
+
+  if (g_file_test (hist_path, G_FILE_TEST_EXISTS))
+    history (loaded, &ev, H_LOAD, hist_path);
+
+  g_task_return_pointer (task, loaded, (GDestroyNotify) history_end);
+}
+
+
+static void
+on_history_loaded (GObject *source_object, GAsyncResult *result, gpointer user_data)
+{
+  History *loaded = g_task_propagate_pointer (G_TASK (result), NULL);
+  HistEvent ev, added;
+  int rv;
+
+  /* Prompt got destroyed meanwhile */
+  if (!hist) {
+    history_end (loaded);
+    return;
+  }
+
+  /* Keep what was entered while loading */
+  for (rv = history (hist, &ev, H_LAST); rv != -1; rv = history (hist, &ev, H_PREV))
+    history (loaded, &added, H_ENTER, ev.str);
+
+  history_end (hist);
+  hist = loaded;
+  el_set (el, EL_HIST, history, hist);
+  history_loaded = TRUE;
+
+  ev_startup_profile_end (EV_STARTUP_PHASE_HISTORY);
+}
+
+
 void
 ev_prompt_init (GPtrArray *commands_, const char *cache_dir)
 {
-  HistEvent ev;
-  g_autofree char *hist_path = NULL;
+  g_autoptr (GTask) task = NULL;
+
+  ev_startup_profile_begin (EV_STARTUP_PHASE_PROMPT);
 
   g_assert (!commands);
   commands = g_ptr_array_ref (commands_);
 
-  hist = history_init ();
-  history (hist, &ev, H_SETSIZE, 100);
-  history (hist, &ev, H_SETUNIQUE, 1);
-
-  hist_path = g_build_filename (cache_dir, "history", NULL);
-  if (g_file_test (hist_path, G_FILE_TEST_EXISTS))
-    history (hist, &ev, H_LOAD, hist_path);
+  /* Load the history in the background, the prompt is usable meanwhile */
+  ev_startup_profile_begin (EV_STARTUP_PHASE_HISTORY);
+  hist = history_new ();
+  task = g_task_new (NULL, NULL, on_history_loaded, NULL);
+  g_task_set_task_data (task, g_build_filename (cache_dir, "history", NULL), g_free);
+  g_task_run_in_thread (task, load_history_thread);
 
   tok  = tok_init (NULL);
   reset ();
 
   stream = g_unix_input_stream_new (STDIN_FILENO, FALSE);
-  stdin_id = g_unix_fd_add (g_unix_input_stream_get_fd (G_UNIX_INPUT_STREAM (stream)),
-                            G_IO_IN, on_stdin_ready, NULL);
+  watch_stdin ();
+
+  ev_startup_profile_end (EV_STARTUP_PHASE_PROMPT);
 }
 
 
@@ -409,8 +490,11 @@ ev_prompt_destroy (const char *cache_dir)
   if (!g_file_test (cache_dir, G_FILE_TEST_EXISTS))
     g_mkdir (cache_dir, 0700);
 
-  hist_path = g_build_filename (cache_dir, "history", NULL);
-  history (hist, &ev, H_SAVE, hist_path);
+  /* Don't clobber the saved history with a partial one */
+  if (history_loaded) {
+    hist_path = g_build_filename (cache_dir, "history", NULL);
+    history (hist, &ev, H_SAVE, hist_path);
+  }
 
   g_clear_pointer (&commands, g_ptr_array_unref);
   g_clear_pointer (&el, el_end);
@@ -422,6 +506,34 @@ ev_prompt_destroy (const char *cache_dir)
 }
 
 
+/**
+ * ev_prompt_print:
+ * @format: The printf style format string
+ *
+ * Print output that isn't the direct result of a command (e.g. the
+ * result of a long running operation) and redisplay the prompt
+ * including the current input.
+ */
+void
+ev_prompt_print (const char *format, ...)
+{
+  g_autofree char *msg = NULL;
+  va_list args;
+
+  va_start (args, format);
+  msg = g_strdup_vprintf (format, args);
+  va_end (args);
+
+  /* Clear the current input line, it's redrawn below */
+  g_print ("\r\033[K%s", msg);
+  if (!g_str_has_suffix (msg, "\n"))
+    g_print ("\n");
+
+  if (el)
+    el_set (el, EL_REFRESH);
+}
+
+
 static const EvCmdOpt help_opts[] = {
   {
     .name = "command",
@@ -61,5 +61,6 @@ typedef struct _EvCmd {
 void ev_prompt_init         (GPtrArray *commands, const char *cache_dir);
 void ev_prompt_destroy      (const char *cache_dir);
 void ev_prompt_add_commands (GPtrArray *commands);
+void ev_prompt_print        (const char *format, ...) G_GNUC_PRINTF (1, 2);
 
 G_END_DECLS
@@ -0,0 +1,165 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "ev-config.h"
+
+#include "ev-ring.h"
+
+#include <string.h>
+
+/**
+ * EvRing:
+ *
+ * A bounded FIFO of fixed size elements. All memory is allocated up
+ * front, pushing to a full ring evicts the oldest element. Elements are
+ * filled in place so the ring can be used on hot paths without
+ * allocating.
+ */
+struct _EvRing {
+  guint8         *data;
+  gsize           element_size;
+  guint           capacity;
+  guint           head;      /* Index of the oldest element */
+  guint           len;
+  guint64         n_evicted;
+  GDestroyNotify  clear_func;
+};
+
+
+static gpointer
+get_slot (EvRing *self, guint index)
+{
+  return self->data + (gsize)(index % self->capacity) * self->element_size;
+}
+
+/**
+ * ev_ring_new:
+ * @element_size: The size of a single element
+ * @capacity: The maximum number of elements
+ * @clear_func:(nullable): Invoked with a pointer to an element when it
+ *   gets dropped, evicted or cleared
+ *
+ * Returns: A new ring buffer
+ */
+EvRing *
+ev_ring_new (gsize element_size, guint capacity, GDestroyNotify clear_func)
+{
+  EvRing *self;
+
+  g_return_val_if_fail (element_size > 0, NULL);
+  g_return_val_if_fail (capacity > 0, NULL);
+
+  self = g_new0 (EvRing, 1);
+  self->data = g_malloc0_n (capacity, element_size);
+  self->element_size = element_size;
+  self->capacity = capacity;
+  self->clear_func = clear_func;
+
+  return self;
+}
+
+
+void
+ev_ring_free (EvRing *self)
+{
+  ev_ring_clear (self);
+  g_free (self->data);
+  g_free (self);
+}
+
+/**
+ * ev_ring_push:
+ * @self: The ring
+ *
+ * Appends a new element, evicting the oldest one if the ring is full.
+ *
+ * Returns:(transfer none): The zeroed element to fill in
+ */
+gpointer
+ev_ring_push (EvRing *self)
+{
+  gpointer slot;
+
+  if (self->len == self->capacity) {
+    ev_ring_drop (self);
+    self->n_evicted++;
+  }
+
+  slot = get_slot (self, self->head + self->len);
+  memset (slot, 0, self->element_size);
+  self->len++;
+
+  return slot;
+}
+
+/**
+ * ev_ring_peek:
+ * @self: The ring
+ * @n: The element to get, `0` is the oldest one
+ *
+ * Returns:(transfer none)(nullable): The element or %NULL if there's no such element
+ */
+gpointer
+ev_ring_peek (EvRing *self, guint n)
+{
+  if (n >= self->len)
+    return NULL;
+
+  return get_slot (self, self->head + n);
+}
+
+/**
+ * ev_ring_drop:
+ * @self: The ring
+ *
+ * Removes the oldest element.
+ */
+void
+ev_ring_drop (EvRing *self)
+{
+  if (!self->len)
+    return;
+
+  if (self->clear_func)
+    self->clear_func (get_slot (self, self->head));
+
+  self->head = (self->head + 1) % self->capacity;
+  self->len--;
+}
+
+
+void
+ev_ring_clear (EvRing *self)
+{
+  while (self->len)
+    ev_ring_drop (self);
+}
+
+
+guint
+ev_ring_get_length (EvRing *self)
+{
+  return self->len;
+}
+
+
+guint
+ev_ring_get_capacity (EvRing *self)
+{
+  return self->capacity;
+}
+
+/**
+ * ev_ring_get_n_evicted:
+ * @self: The ring
+ *
+ * Returns: How many elements got evicted since the ring was created
+ */
+guint64
+ev_ring_get_n_evicted (EvRing *self)
+{
+  return self->n_evicted;
+}
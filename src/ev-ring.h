@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EvRing EvRing;
+
+EvRing          *ev_ring_new                     (gsize           element_size,
+                                                  guint           capacity,
+                                                  GDestroyNotify  clear_func);
+void             ev_ring_free                    (EvRing         *self);
+gpointer         ev_ring_push                    (EvRing         *self);
+gpointer         ev_ring_peek                    (EvRing         *self,
+                                                  guint           n);
+void             ev_ring_drop                    (EvRing         *self);
+void             ev_ring_clear                   (EvRing         *self);
+guint            ev_ring_get_length              (EvRing         *self);
+guint            ev_ring_get_capacity            (EvRing         *self);
+guint64          ev_ring_get_n_evicted           (EvRing         *self);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EvRing, ev_ring_free)
+
+G_END_DECLS
@@ -0,0 +1,785 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "ev-config.h"
+
+#include "ev-scheduler.h"
+
+#include <glib/gi18n.h>
+
+#include "cmatrix.h"
+
+#define BUCKET_RATE             5.0   /* requests per second */
+#define BUCKET_BURST            10.0
+#define LANE_MAX_IN_FLIGHT      4
+#define MAX_RATE_LIMITED        5
+#define MAX_ATTEMPTS            4
+#define DEFAULT_RETRY_AFTER     1000  /* ms */
+#define DEFAULT_TIMEOUT         30000 /* ms */
+#define BACKOFF_BASE            500   /* ms */
+#define BACKOFF_MAX             16000 /* ms */
+
+/**
+ * EvScheduler:
+ *
+ * Schedules requests to homeservers. Each homeserver gets a token
+ * bucket limiting the request rate. When the server rate limits us
+ * nevertheless all requests to it pause, backing off exponentially,
+ * and the request is retried.
+ *
+ * Requests in the interactive lane are always dispatched before those
+ * in the bulk lane so bulk operations can't starve commands the user
+ * is waiting for.
+ *
+ * Every request has a deadline (configurable per request name) that
+ * starts when it's first dispatched, so a long queue in front of it
+ * doesn't count. Once it passes the request is cancelled. Idempotent
+ * requests are retried with exponential backoff on transient errors
+ * as long as the deadline allows.
+ */
+
+typedef struct {
+  char   *host;
+  double  tokens;
+  gint64  refilled;       /* µs */
+  gint64  blocked_until;  /* µs */
+  guint   rate_limited;
+} EvTokenBucket;
+
+typedef struct {
+  GQueue  queue;
+  guint   in_flight;
+  guint   max_depth;
+  guint   started;
+  guint   completed;
+  guint   failed;
+  guint   timed_out;
+  guint   retried;
+  guint   rate_limited;
+  gint64  wait_sum;       /* µs */
+  gint64  wait_max;       /* µs */
+} EvLane;
+
+typedef struct {
+  gboolean  done;
+  GError   *error;
+} EvSchedulerSync;
+
+struct _EvSchedulerJob {
+  EvScheduler         *scheduler;
+  EvTokenBucket       *bucket;
+  EvSchedulerLane      lane;
+  char                *name;
+  EvSchedulerFlags     flags;
+  EvSchedulerRunFunc  *run;
+  EvSchedulerDoneFunc *done;
+  gpointer             user_data;
+  EvSchedulerSync     *sync;
+
+  GCancellable        *cancellable;
+  gulong               cancel_id;
+  guint                timeout;     /* ms */
+  guint                timeout_id;
+  gboolean             timed_out;
+  gboolean             running;
+
+  guint                attempts;
+  gint64               queued;      /* µs */
+  gint64               started;     /* µs */
+  gint64               not_before;  /* µs */
+};
+
+struct _EvScheduler {
+  GObject       parent;
+
+  GCancellable *cancel;
+  gulong        cancel_id;
+  GHashTable   *buckets;
+  GHashTable   *timeouts;
+  EvLane        lanes[EV_SCHEDULER_N_LANES];
+  guint         wakeup_id;
+  gint64        wakeup_at;
+};
+G_DEFINE_TYPE (EvScheduler, ev_scheduler, G_TYPE_OBJECT)
+
+
+static void dispatch (EvScheduler *self);
+
+
+static void
+bucket_free (EvTokenBucket *bucket)
+{
+  g_free (bucket->host);
+  g_free (bucket);
+}
+
+
+static void
+bucket_refill (EvTokenBucket *bucket, gint64 now)
+{
+  bucket->tokens += (double)(now - bucket->refilled) * BUCKET_RATE / G_USEC_PER_SEC;
+  bucket->tokens = MIN (bucket->tokens, BUCKET_BURST);
+  bucket->refilled = now;
+}
+
+/* Returns 0 if a request can be made now, the time in µs until one can otherwise */
+static gint64
+bucket_get_delay (EvTokenBucket *bucket, gint64 now)
+{
+  if (bucket->blocked_until > now)
+    return bucket->blocked_until - now;
+
+  bucket_refill (bucket, now);
+  if (bucket->tokens >= 1.0)
+    return 0;
+
+  return (gint64)((1.0 - bucket->tokens) * G_USEC_PER_SEC / BUCKET_RATE) + 1;
+}
+
+
+static EvTokenBucket *
+get_bucket (EvScheduler *self, const char *host)
+{
+  EvTokenBucket *bucket;
+
+  host = host ?: "";
+  bucket = g_hash_table_lookup (self->buckets, host);
+  if (bucket)
+    return bucket;
+
+  bucket = g_new0 (EvTokenBucket, 1);
+  bucket->host = g_strdup (host);
+  bucket->tokens = BUCKET_BURST;
+  bucket->refilled = g_get_monotonic_time ();
+  g_hash_table_insert (self->buckets, bucket->host, bucket);
+
+  return bucket;
+}
+
+
+/* libcmatrix maps M_LIMIT_EXCEEDED to an error code but drops the
+ * server's retry_after_ms, so back off exponentially instead */
+static guint
+get_retry_after_ms (guint attempt)
+{
+  return DEFAULT_RETRY_AFTER << MIN (attempt - 1, 6);
+}
+
+/* Exponential backoff with jitter so retries of parallel requests spread out */
+static guint
+get_backoff_ms (guint attempt)
+{
+  guint delay = MIN (BACKOFF_BASE << MIN (attempt - 1, 10), BACKOFF_MAX);
+
+  return g_random_int_range (delay / 2, delay + 1);
+}
+
+
+static gboolean
+is_transient_error (const GError *error)
+{
+  if (error->domain == G_IO_ERROR) {
+    switch (error->code) {
+    case G_IO_ERROR_TIMED_OUT:
+    case G_IO_ERROR_CONNECTION_REFUSED:
+    case G_IO_ERROR_CONNECTION_CLOSED:
+    case G_IO_ERROR_BROKEN_PIPE:
+    case G_IO_ERROR_HOST_UNREACHABLE:
+    case G_IO_ERROR_NETWORK_UNREACHABLE:
+    case G_IO_ERROR_NOT_CONNECTED:
+      return TRUE;
+    default:
+      return FALSE;
+    }
+  }
+
+  return g_error_matches (error, G_RESOLVER_ERROR, G_RESOLVER_ERROR_TEMPORARY_FAILURE);
+}
+
+
+static void
+job_free (EvSchedulerJob *job)
+{
+  g_clear_handle_id (&job->timeout_id, g_source_remove);
+  if (job->cancel_id)
+    g_cancellable_disconnect (job->scheduler->cancel, job->cancel_id);
+  g_clear_object (&job->cancellable);
+  g_free (job->name);
+  g_free (job);
+}
+
+
+static void
+on_scheduler_cancelled (GCancellable *cancellable, gpointer user_data)
+{
+  EvSchedulerJob *job = user_data;
+
+  g_cancellable_cancel (job->cancellable);
+}
+
+
+static EvSchedulerJob *
+job_new (EvScheduler         *self,
+         const char          *host,
+         EvSchedulerLane      lane,
+         const char          *name,
+         EvSchedulerFlags     flags,
+         EvSchedulerRunFunc  *run,
+         EvSchedulerDoneFunc *done,
+         gpointer             user_data)
+{
+  EvSchedulerJob *job = g_new0 (EvSchedulerJob, 1);
+
+  job->scheduler = self;
+  job->bucket = get_bucket (self, host);
+  job->lane = lane;
+  job->name = g_strdup (name);
+  job->flags = flags;
+  job->run = run;
+  job->done = done;
+  job->user_data = user_data;
+  job->timeout = ev_scheduler_get_timeout (self, name);
+  job->cancellable = g_cancellable_new ();
+  job->cancel_id = g_cancellable_connect (self->cancel, G_CALLBACK (on_scheduler_cancelled),
+                                          job, NULL);
+
+  return job;
+}
+
+
+static void
+job_finish (EvScheduler *self, EvSchedulerJob *job, GError *error)
+{
+  g_autoptr (GError) err = error;
+  EvLane *lane = &self->lanes[job->lane];
+
+  g_clear_handle_id (&job->timeout_id, g_source_remove);
+
+  if (err) {
+    gint64 latency = g_get_monotonic_time () - job->queued;
+    GError *annotated;
+
+    if (job->timed_out)
+      lane->timed_out++;
+    lane->failed++;
+
+    annotated = g_error_new (err->domain, err->code,
+                             "%s (%u attempt%s, %.1f s)",
+                             err->message, job->attempts, job->attempts == 1 ? "" : "s",
+                             (double)latency / G_USEC_PER_SEC);
+    g_clear_error (&err);
+    err = annotated;
+  } else {
+    lane->completed++;
+  }
+
+  if (job->sync) {
+    job->sync->error = g_steal_pointer (&err);
+    job->sync->done = TRUE;
+  } else if (job->done) {
+    job->done (job, err, job->user_data);
+  }
+
+  job_free (job);
+}
+
+
+static gboolean
+on_job_timeout (gpointer user_data)
+{
+  EvSchedulerJob *job = user_data;
+  EvScheduler *self = job->scheduler;
+
+  job->timeout_id = 0;
+  job->timed_out = TRUE;
+
+  g_debug ("'%s' timed out after %u ms", job->name, job->timeout);
+
+  /* The request will return with an error */
+  if (job->running) {
+    g_cancellable_cancel (job->cancellable);
+    return G_SOURCE_REMOVE;
+  }
+
+  /* Still waiting in the queue */
+  g_queue_remove (&self->lanes[job->lane].queue, job);
+  job_finish (self, job, g_error_new (G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                                      "Timed out after %u ms", job->timeout));
+
+  return G_SOURCE_REMOVE;
+}
+
+
+static void
+job_start (EvScheduler *self, EvSchedulerJob *job, gint64 now)
+{
+  EvLane *lane = &self->lanes[job->lane];
+
+  if (!job->attempts) {
+    gint64 wait = now - job->queued;
+
+    job->started = now;
+    if (job->timeout)
+      job->timeout_id = g_timeout_add (job->timeout, on_job_timeout, job);
+    lane->started++;
+    lane->wait_sum += wait;
+    lane->wait_max = MAX (lane->wait_max, wait);
+  }
+
+  g_debug ("Running '%s', attempt %u", job->name, job->attempts + 1);
+
+  job->attempts++;
+  job->running = TRUE;
+  job->bucket->tokens -= 1.0;
+  lane->in_flight++;
+
+  /* Keep the scheduler alive while requests are in flight */
+  g_object_ref (self);
+  job->run (job, job->cancellable, job->user_data);
+}
+
+
+static void
+fail_queued_jobs (EvScheduler *self)
+{
+  for (int i = 0; i < EV_SCHEDULER_N_LANES; i++) {
+    EvSchedulerJob *job;
+
+    while ((job = g_queue_pop_head (&self->lanes[i].queue)))
+      job_finish (self, job, g_error_new (G_IO_ERROR, G_IO_ERROR_CANCELLED, "Cancelled"));
+  }
+}
+
+
+static gboolean
+on_wakeup (gpointer user_data)
+{
+  EvScheduler *self = EV_SCHEDULER (user_data);
+
+  self->wakeup_id = 0;
+  if (g_cancellable_is_cancelled (self->cancel))
+    fail_queued_jobs (self);
+  else
+    dispatch (self);
+
+  return G_SOURCE_REMOVE;
+}
+
+
+static void
+schedule_wakeup (EvScheduler *self, gint64 delay)
+{
+  gint64 at = g_get_monotonic_time () + delay;
+
+  if (self->wakeup_id && self->wakeup_at <= at)
+    return;
+
+  g_clear_handle_id (&self->wakeup_id, g_source_remove);
+  self->wakeup_at = at;
+  self->wakeup_id = g_timeout_add ((delay + 999) / 1000, on_wakeup, self);
+}
+
+
+static EvSchedulerJob *
+lane_pop_ready (EvLane *lane, gint64 now, gint64 *min_delay)
+{
+  for (GList *l = lane->queue.head; l; l = l->next) {
+    EvSchedulerJob *job = l->data;
+    gint64 delay;
+
+    /* Backing off after a transient error */
+    if (job->not_before > now) {
+      *min_delay = MIN (*min_delay, job->not_before - now);
+      continue;
+    }
+
+    delay = bucket_get_delay (job->bucket, now);
+    if (delay == 0) {
+      g_queue_delete_link (&lane->queue, l);
+      return job;
+    }
+    *min_delay = MIN (*min_delay, delay);
+  }
+
+  return NULL;
+}
+
+
+static void
+dispatch (EvScheduler *self)
+{
+  gint64 min_delay = G_MAXINT64;
+  gint64 now = g_get_monotonic_time ();
+
+  /* Queued requests won't be started anymore. Fail them from the main
+   * loop so their done functions don't run from within submit */
+  if (g_cancellable_is_cancelled (self->cancel)) {
+    schedule_wakeup (self, 0);
+    return;
+  }
+
+  for (int i = 0; i < EV_SCHEDULER_N_LANES; i++) {
+    EvLane *lane = &self->lanes[i];
+
+    while (lane->in_flight < LANE_MAX_IN_FLIGHT) {
+      EvSchedulerJob *job = lane_pop_ready (lane, now, &min_delay);
+
+      if (!job)
+        break;
+
+      job_start (self, job, now);
+    }
+
+    /* Lower priority lanes only run once the ones above are drained */
+    if (!g_queue_is_empty (&lane->queue))
+      break;
+  }
+
+  if (min_delay != G_MAXINT64)
+    schedule_wakeup (self, min_delay);
+}
+
+
+static void
+submit_job (EvScheduler *self, EvSchedulerJob *job)
+{
+  EvLane *lane = &self->lanes[job->lane];
+
+  job->queued = g_get_monotonic_time ();
+
+  g_queue_push_tail (&lane->queue, job);
+  lane->max_depth = MAX (lane->max_depth, lane->queue.length);
+
+  dispatch (self);
+}
+
+
+static void
+ev_scheduler_dispose (GObject *object)
+{
+  EvScheduler *self = EV_SCHEDULER (object);
+
+  g_clear_handle_id (&self->wakeup_id, g_source_remove);
+  for (int i = 0; i < EV_SCHEDULER_N_LANES; i++)
+    g_queue_clear_full (&self->lanes[i].queue, (GDestroyNotify) job_free);
+
+  if (self->cancel_id)
+    g_cancellable_disconnect (self->cancel, self->cancel_id);
+  self->cancel_id = 0;
+  g_clear_object (&self->cancel);
+  g_clear_pointer (&self->buckets, g_hash_table_unref);
+  g_clear_pointer (&self->timeouts, g_hash_table_unref);
+
+  G_OBJECT_CLASS (ev_scheduler_parent_class)->dispose (object);
+}
+
+
+static void
+on_cancelled (GCancellable *cancellable, gpointer user_data)
+{
+  EvScheduler *self = EV_SCHEDULER (user_data);
+
+  schedule_wakeup (self, 0);
+}
+
+
+static void
+ev_scheduler_class_init (EvSchedulerClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->dispose = ev_scheduler_dispose;
+}
+
+
+static void
+ev_scheduler_init (EvScheduler *self)
+{
+  self->buckets = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         NULL, (GDestroyNotify) bucket_free);
+  self->timeouts = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (int i = 0; i < EV_SCHEDULER_N_LANES; i++)
+    g_queue_init (&self->lanes[i].queue);
+}
+
+/**
+ * ev_scheduler_new:
+ * @cancellable: Cancellable to cancel all requests
+ *
+ * Once `cancellable` is cancelled running requests are cancelled and
+ * no further requests are started. Queued requests fail with
+ * %G_IO_ERROR_CANCELLED.
+ *
+ * Returns: A new scheduler
+ */
+EvScheduler *
+ev_scheduler_new (GCancellable *cancellable)
+{
+  EvScheduler *self = g_object_new (EV_TYPE_SCHEDULER, NULL);
+
+  self->cancel = g_object_ref (cancellable);
+  self->cancel_id = g_cancellable_connect (self->cancel, G_CALLBACK (on_cancelled), self, NULL);
+
+  return self;
+}
+
+/**
+ * ev_scheduler_submit:
+ * @self: The scheduler
+ * @host: The homeserver the request goes to
+ * @lane: The lane to queue the request in
+ * @name: The name of the request, used to look up the timeout
+ * @flags: Flags for the request
+ * @run: Function to start the request
+ * @done:(nullable): Function invoked when the request finished
+ * @user_data: User data passed to `run` and `done`
+ *
+ * Queues a request. It's started once its lane has capacity and the
+ * homeserver's rate limit allows for it.
+ */
+void
+ev_scheduler_submit (EvScheduler         *self,
+                     const char          *host,
+                     EvSchedulerLane      lane,
+                     const char          *name,
+                     EvSchedulerFlags     flags,
+                     EvSchedulerRunFunc  *run,
+                     EvSchedulerDoneFunc *done,
+                     gpointer             user_data)
+{
+  g_assert (EV_IS_SCHEDULER (self));
+  g_assert (run);
+
+  submit_job (self, job_new (self, host, lane, name, flags, run, done, user_data));
+}
+
+/**
+ * ev_scheduler_run_sync:
+ * @self: The scheduler
+ * @host: The homeserver the request goes to
+ * @name: The name of the request, used to look up the timeout
+ * @flags: Flags for the request
+ * @run: Function to start the request
+ * @user_data: User data passed to `run`
+ * @error: Location for the error
+ *
+ * Queues a request in the interactive lane and iterates the main
+ * context until it finished. The prompt doesn't read input while a
+ * command runs, so no other command starts meanwhile.
+ *
+ * Returns: %TRUE if the request succeeded, otherwise %FALSE
+ */
+gboolean
+ev_scheduler_run_sync (EvScheduler         *self,
+                       const char          *host,
+                       const char          *name,
+                       EvSchedulerFlags     flags,
+                       EvSchedulerRunFunc  *run,
+                       gpointer             user_data,
+                       GError             **error)
+{
+  EvSchedulerSync sync = { 0 };
+  EvSchedulerJob *job;
+
+  g_assert (EV_IS_SCHEDULER (self));
+  g_assert (run);
+
+  job = job_new (self, host, EV_SCHEDULER_LANE_INTERACTIVE, name, flags, run, NULL, user_data);
+  job->sync = &sync;
+  submit_job (self, job);
+
+  while (!sync.done)
+    g_main_context_iteration (NULL, TRUE);
+
+  if (sync.error) {
+    g_propagate_error (error, sync.error);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+/**
+ * ev_scheduler_set_timeout:
+ * @self: The scheduler
+ * @name: The request name
+ * @timeout: The timeout in milliseconds, `0` disables the timeout
+ *
+ * Sets the deadline for requests with the given name. It's armed when
+ * the request is first dispatched, so time spent waiting behind other
+ * requests or for rate limit tokens doesn't count, but retries and the
+ * backoff between them do.
+ */
+void
+ev_scheduler_set_timeout (EvScheduler *self, const char *name, guint timeout)
+{
+  g_assert (EV_IS_SCHEDULER (self));
+  g_assert (name);
+
+  g_hash_table_insert (self->timeouts, g_strdup (name), GUINT_TO_POINTER (timeout + 1));
+}
+
+
+guint
+ev_scheduler_get_timeout (EvScheduler *self, const char *name)
+{
+  gpointer timeout;
+
+  g_assert (EV_IS_SCHEDULER (self));
+
+  /* Stored off by one so a disabled timeout is distinguishable from none set */
+  timeout = g_hash_table_lookup (self->timeouts, name);
+  if (!timeout)
+    return DEFAULT_TIMEOUT;
+
+  return GPOINTER_TO_UINT (timeout) - 1;
+}
+
+/**
+ * ev_scheduler_job_return:
+ * @job: The job
+ * @error:(nullable)(transfer full): The error if the request failed
+ *
+ * Must be invoked by the job's run function once the request finished.
+ * Rate limited requests and idempotent requests that failed with a
+ * transient error are queued again, otherwise the job's done function
+ * is invoked and the job is freed.
+ */
+void
+ev_scheduler_job_return (EvSchedulerJob *job, GError *error)
+{
+  g_autoptr (GError) err = error;
+  EvScheduler *self = job->scheduler;
+  EvLane *lane = &self->lanes[job->lane];
+  gint64 now = g_get_monotonic_time ();
+
+  job->running = FALSE;
+  lane->in_flight--;
+
+  if (job->timed_out) {
+    g_clear_error (&err);
+    err = g_error_new (G_IO_ERROR, G_IO_ERROR_TIMED_OUT, "Timed out after %u ms", job->timeout);
+  } else if (err && !g_cancellable_is_cancelled (job->cancellable)) {
+    if (g_error_matches (err, CM_ERROR, CM_ERROR_LIMIT_EXCEEDED) &&
+        job->attempts < MAX_RATE_LIMITED) {
+      guint delay = get_retry_after_ms (job->attempts);
+
+      /* The limit applies to all requests to that server */
+      g_debug ("'%s' rate limited by %s, retrying in %u ms", job->name, job->bucket->host, delay);
+      job->bucket->blocked_until = MAX (job->bucket->blocked_until, now + delay * 1000);
+      job->bucket->rate_limited++;
+      lane->rate_limited++;
+      g_queue_push_head (&lane->queue, job);
+      goto out;
+    }
+
+    if ((job->flags & EV_SCHEDULER_FLAG_IDEMPOTENT) && is_transient_error (err) &&
+        job->attempts < MAX_ATTEMPTS) {
+      guint delay = get_backoff_ms (job->attempts);
+
+      g_debug ("'%s' failed: %s, retrying in %u ms", job->name, err->message, delay);
+      job->not_before = now + delay * 1000;
+      lane->retried++;
+      g_queue_push_head (&lane->queue, job);
+      goto out;
+    }
+  }
+
+  job_finish (self, job, g_steal_pointer (&err));
+
+ out:
+  dispatch (self);
+  g_object_unref (self);
+}
+
+
+gpointer
+ev_scheduler_job_get_user_data (EvSchedulerJob *job)
+{
+  return job->user_data;
+}
+
+
+guint
+ev_scheduler_job_get_attempts (EvSchedulerJob *job)
+{
+  return job->attempts;
+}
+
+/**
+ * ev_scheduler_job_get_latency:
+ * @job: The job
+ *
+ * Gets the time since the request was first started. This excludes the
+ * time spent in the queue but includes retries.
+ *
+ * Returns: The latency in µs
+ */
+gint64
+ev_scheduler_job_get_latency (EvSchedulerJob *job)
+{
+  if (!job->attempts)
+    return 0;
+
+  return g_get_monotonic_time () - job->started;
+}
+
+/**
+ * ev_scheduler_format_stats:
+ * @self: The scheduler
+ * @builder: The builder to add the stats to
+ *
+ * Adds queue depths, wait times and rate limiting information.
+ */
+void
+ev_scheduler_format_stats (EvScheduler *self, EvFormatBuilder *builder)
+{
+  const char *lane_names[EV_SCHEDULER_N_LANES] = { _("Interactive"), _("Bulk") };
+  GHashTableIter iter;
+  EvTokenBucket *bucket;
+  gint64 now = g_get_monotonic_time ();
+
+  g_assert (EV_IS_SCHEDULER (self));
+  g_assert (EV_IS_FORMAT_BUILDER (builder));
+
+  for (int i = 0; i < EV_SCHEDULER_N_LANES; i++) {
+    EvLane *lane = &self->lanes[i];
+
+    if (i != 0)
+      ev_format_builder_add_newline (builder);
+
+    ev_format_builder_add (builder, _("Lane"), lane_names[i]);
+    ev_format_builder_take_value (builder, _("Queued"),
+                                  g_strdup_printf ("%u (max %u)", lane->queue.length,
+                                                   lane->max_depth));
+    ev_format_builder_take_value (builder, _("In flight"), g_strdup_printf ("%u", lane->in_flight));
+    ev_format_builder_take_value (builder, _("Completed"), g_strdup_printf ("%u", lane->completed));
+    ev_format_builder_take_value (builder, _("Failed"), g_strdup_printf ("%u", lane->failed));
+    ev_format_builder_take_value (builder, _("Timed out"), g_strdup_printf ("%u", lane->timed_out));
+    ev_format_builder_take_value (builder, _("Retried"), g_strdup_printf ("%u", lane->retried));
+    ev_format_builder_take_value (builder, _("Rate limited"),
+                                  g_strdup_printf ("%u", lane->rate_limited));
+    ev_format_builder_take_value (builder, _("Wait time"),
+                                  g_strdup_printf ("mean %" G_GINT64_FORMAT " ms, max %" G_GINT64_FORMAT " ms",
+                                                   lane->started ? lane->wait_sum / lane->started / 1000 : 0,
+                                                   lane->wait_max / 1000));
+  }
+
+  g_hash_table_iter_init (&iter, self->buckets);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&bucket)) {
+    ev_format_builder_add_newline (builder);
+    ev_format_builder_add (builder, _("Homeserver"), bucket->host);
+    bucket_refill (bucket, now);
+    ev_format_builder_take_value (builder, _("Tokens"),
+                                  g_strdup_printf ("%.1f/%.0f", bucket->tokens, BUCKET_BURST));
+    ev_format_builder_take_value (builder, _("Rate limited"),
+                                  g_strdup_printf ("%u", bucket->rate_limited));
+    if (bucket->blocked_until > now) {
+      ev_format_builder_take_value (builder, _("Paused for"),
+                                    g_strdup_printf ("%" G_GINT64_FORMAT " ms", (bucket->blocked_until - now) / 1000));
+    }
+  }
+}
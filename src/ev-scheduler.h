@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "ev-format-builder.h"
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/**
+ * EvSchedulerLane:
+ *
+ * @EV_SCHEDULER_LANE_INTERACTIVE: Requests the user waits for
+ * @EV_SCHEDULER_LANE_BULK: Requests from long running bulk operations
+ */
+typedef enum {
+  EV_SCHEDULER_LANE_INTERACTIVE = 0,
+  EV_SCHEDULER_LANE_BULK        = 1,
+} EvSchedulerLane;
+
+#define EV_SCHEDULER_N_LANES 2
+
+/**
+ * EvSchedulerFlags:
+ *
+ * @EV_SCHEDULER_FLAG_NONE: No flags
+ * @EV_SCHEDULER_FLAG_IDEMPOTENT: The request can be retried on transient errors
+ */
+typedef enum {
+  EV_SCHEDULER_FLAG_NONE       = 0,
+  EV_SCHEDULER_FLAG_IDEMPOTENT = (1 << 0),
+} EvSchedulerFlags;
+
+typedef struct _EvSchedulerJob EvSchedulerJob;
+
+/**
+ * EvSchedulerRunFunc:
+ * @job: The job to run
+ * @cancellable: The cancellable to pass on to the request
+ * @user_data: The user data passed on submission
+ *
+ * Starts the (asynchronous) request. Once done the function needs
+ * to invoke [func@scheduler_job_return]. Might be invoked again when
+ * the request needs to be retried.
+ */
+typedef void EvSchedulerRunFunc (EvSchedulerJob *job, GCancellable *cancellable, gpointer user_data);
+
+/**
+ * EvSchedulerDoneFunc:
+ * @job: The finished job
+ * @error:(nullable): The error if the request failed
+ * @user_data: The user data passed on submission
+ *
+ * Invoked when the job finished and won't be retried anymore.
+ */
+typedef void EvSchedulerDoneFunc (EvSchedulerJob *job, const GError *error, gpointer user_data);
+
+#define EV_TYPE_SCHEDULER (ev_scheduler_get_type ())
+
+G_DECLARE_FINAL_TYPE (EvScheduler, ev_scheduler, EV, SCHEDULER, GObject)
+
+EvScheduler     *ev_scheduler_new                (GCancellable        *cancellable);
+void             ev_scheduler_submit             (EvScheduler         *self,
+                                                  const char          *host,
+                                                  EvSchedulerLane      lane,
+                                                  const char          *name,
+                                                  EvSchedulerFlags     flags,
+                                                  EvSchedulerRunFunc  *run,
+                                                  EvSchedulerDoneFunc *done,
+                                                  gpointer             user_data);
+gboolean         ev_scheduler_run_sync           (EvScheduler         *self,
+                                                  const char          *host,
+                                                  const char          *name,
+                                                  EvSchedulerFlags     flags,
+                                                  EvSchedulerRunFunc  *run,
+                                                  gpointer             user_data,
+                                                  GError             **error);
+void             ev_scheduler_set_timeout        (EvScheduler         *self,
+                                                  const char          *name,
+                                                  guint                timeout);
+guint            ev_scheduler_get_timeout        (EvScheduler         *self,
+                                                  const char          *name);
+void             ev_scheduler_format_stats       (EvScheduler         *self,
+                                                  EvFormatBuilder     *builder);
+
+void             ev_scheduler_job_return         (EvSchedulerJob      *job,
+                                                  GError              *error);
+gpointer         ev_scheduler_job_get_user_data  (EvSchedulerJob      *job);
+guint            ev_scheduler_job_get_attempts   (EvSchedulerJob      *job);
+gint64           ev_scheduler_job_get_latency    (EvSchedulerJob      *job);
+
+G_END_DECLS
@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "ev-config.h"
+
+#include "ev-application.h"
+#include "ev-format-builder.h"
+#include "ev-prompt.h"
+#include "ev-startup-profile.h"
+
+#include <glib/gi18n.h>
+
+#include <errno.h>
+
+#define PROFILE_LOG      "startup-profile.log"
+#define PROFILE_LOG_RUNS 10
+
+/**
+ * EvStartupProfile:
+ *
+ * Records how long the phases of startup take. Phases may overlap. The
+ * profile of each run is appended to a log in the cache dir on shutdown
+ * so cold and warm starts can be compared over time.
+ */
+
+typedef struct {
+  gint64 begin;  /* µs since startup */
+  gint64 end;    /* µs since startup */
+} EvPhaseTiming;
+
+static gint64 start_time;
+static gboolean cold;
+static guint n_clients, n_stale;
+static EvPhaseTiming phases[EV_STARTUP_N_PHASES];
+
+static const char *phase_names[EV_STARTUP_N_PHASES] = {
+  [EV_STARTUP_PHASE_PROMPT] = "prompt",
+  [EV_STARTUP_PHASE_CONFIG] = "config",
+  [EV_STARTUP_PHASE_HISTORY] = "history",
+  [EV_STARTUP_PHASE_DB_OPEN] = "db-open",
+  [EV_STARTUP_PHASE_CLIENT_RESTORE] = "client-restore",
+  [EV_STARTUP_PHASE_LOGIN] = "login",
+  [EV_STARTUP_PHASE_FIRST_SYNC] = "first-sync",
+};
+
+
+static gint64
+get_offset (void)
+{
+  return g_get_monotonic_time () - start_time;
+}
+
+/**
+ * ev_startup_profile_init:
+ *
+ * Marks the start of the process. All phases are relative to this.
+ */
+void
+ev_startup_profile_init (void)
+{
+  start_time = g_get_monotonic_time ();
+}
+
+
+void
+ev_startup_profile_begin (EvStartupPhase phase)
+{
+  g_assert (phase < EV_STARTUP_N_PHASES);
+
+  /* Only the first run of a phase is of interest */
+  if (phases[phase].begin)
+    return;
+
+  phases[phase].begin = get_offset ();
+}
+
+
+void
+ev_startup_profile_end (EvStartupPhase phase)
+{
+  g_assert (phase < EV_STARTUP_N_PHASES);
+
+  if (!phases[phase].begin || phases[phase].end)
+    return;
+
+  phases[phase].end = get_offset ();
+  g_debug ("Startup phase '%s' took %" G_GINT64_FORMAT " ms", phase_names[phase],
+           (phases[phase].end - phases[phase].begin) / 1000);
+}
+
+/**
+ * ev_startup_profile_set_cold:
+ * @cold_: Whether this is a cold start
+ *
+ * A cold start is one where no client could be restored from the
+ * database.
+ */
+void
+ev_startup_profile_set_cold (gboolean cold_)
+{
+  cold = cold_;
+}
+
+/**
+ * ev_startup_profile_set_clients:
+ * @n_clients_: The number of clients stored in the database
+ * @n_stale_: How many of them belong to no configured account
+ *
+ * libcmatrix loads all stored clients when opening the database so
+ * stale clients slow down startup.
+ */
+void
+ev_startup_profile_set_clients (guint n_clients_, guint n_stale_)
+{
+  n_clients = n_clients_;
+  n_stale = n_stale_;
+}
+
+/**
+ * ev_startup_profile_save:
+ * @cache_dir: The cache dir
+ *
+ * Appends the profile of this run to the profile log.
+ */
+void
+ev_startup_profile_save (const char *cache_dir)
+{
+  g_autoptr (GString) line = g_string_new ("");
+  g_autoptr (GError) err = NULL;
+  g_autofree char *path = NULL;
+  g_autoptr (GFile) file = NULL;
+  g_autoptr (GFileOutputStream) stream = NULL;
+
+  /* Didn't get far enough for a meaningful profile */
+  if (!phases[EV_STARTUP_PHASE_DB_OPEN].end)
+    return;
+
+  g_string_append_printf (line, "%" G_GINT64_FORMAT " %s", g_get_real_time () / G_USEC_PER_SEC,
+                          cold ? "cold" : "warm");
+  g_string_append_printf (line, " clients=%u stale=%u", n_clients, n_stale);
+  for (int i = 0; i < EV_STARTUP_N_PHASES; i++) {
+    if (!phases[i].end)
+      continue;
+
+    g_string_append_printf (line, " %s=%" G_GINT64_FORMAT, phase_names[i], phases[i].end / 1000);
+  }
+  g_string_append (line, "\n");
+
+  if (g_mkdir_with_parents (cache_dir, 0700) < 0) {
+    g_warning ("Failed to create %s: %s", cache_dir, g_strerror (errno));
+    return;
+  }
+
+  path = g_build_filename (cache_dir, PROFILE_LOG, NULL);
+  file = g_file_new_for_path (path);
+  stream = g_file_append_to (file, G_FILE_CREATE_PRIVATE, NULL, &err);
+  if (!stream || !g_output_stream_write_all (G_OUTPUT_STREAM (stream), line->str, line->len,
+                                             NULL, NULL, &err)) {
+    g_warning ("Failed to save startup profile: %s", err->message);
+  }
+}
+
+
+static void
+add_previous_runs (EvFormatBuilder *builder)
+{
+  g_autofree char *path = NULL, *contents = NULL;
+  g_auto (GStrv) lines = NULL;
+  gint64 sum[2] = { 0 }, n[2] = { 0 };
+  /* Client restore with and without stale clients */
+  gint64 restore_sum[2] = { 0 }, restore_n[2] = { 0 };
+  guint n_lines, first;
+  EvApplication *app = EV_APPLICATION (g_application_get_default ());
+
+  path = g_build_filename (ev_application_get_cache_dir (app), PROFILE_LOG, NULL);
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return;
+
+  lines = g_strsplit (g_strstrip (contents), "\n", -1);
+  n_lines = g_strv_length (lines);
+  first = n_lines > PROFILE_LOG_RUNS ? n_lines - PROFILE_LOG_RUNS : 0;
+
+  for (guint i = first; i < n_lines; i++) {
+    g_auto (GStrv) fields = g_strsplit (lines[i], " ", -1);
+    gboolean is_cold, has_stale;
+
+    if (g_strv_length (fields) < 2)
+      continue;
+
+    is_cold = g_str_equal (fields[1], "cold");
+    has_stale = FALSE;
+    for (int k = 2; fields[k]; k++) {
+      if (g_str_has_prefix (fields[k], "stale="))
+        has_stale = g_ascii_strtoll (fields[k] + strlen ("stale="), NULL, 10) > 0;
+    }
+
+    for (int k = 2; fields[k]; k++) {
+      if (g_str_has_prefix (fields[k], "first-sync=")) {
+        sum[is_cold] += g_ascii_strtoll (fields[k] + strlen ("first-sync="), NULL, 10);
+        n[is_cold]++;
+      } else if (g_str_has_prefix (fields[k], "client-restore=")) {
+        restore_sum[has_stale] += g_ascii_strtoll (fields[k] + strlen ("client-restore="), NULL, 10);
+        restore_n[has_stale]++;
+      }
+    }
+  }
+
+  ev_format_builder_add_newline (builder);
+  ev_format_builder_take_value (builder, _("Previous runs"),
+                                g_strdup_printf ("%u", n_lines - first));
+  if (n[0]) {
+    ev_format_builder_take_value (builder, _("Warm first sync"),
+                                  g_strdup_printf ("mean %" G_GINT64_FORMAT " ms over %" G_GINT64_FORMAT " runs", sum[0] / n[0], n[0]));
+  }
+  if (n[1]) {
+    ev_format_builder_take_value (builder, _("Cold first sync"),
+                                  g_strdup_printf ("mean %" G_GINT64_FORMAT " ms over %" G_GINT64_FORMAT " runs", sum[1] / n[1], n[1]));
+  }
+  if (restore_n[0]) {
+    ev_format_builder_take_value (builder, _("Clients restored"),
+                                  g_strdup_printf ("mean %" G_GINT64_FORMAT " ms over %" G_GINT64_FORMAT " runs without stale clients",
+                                                   restore_sum[0] / restore_n[0], restore_n[0]));
+  }
+  if (restore_n[1]) {
+    ev_format_builder_take_value (builder, _("Clients restored"),
+                                  g_strdup_printf ("mean %" G_GINT64_FORMAT " ms over %" G_GINT64_FORMAT " runs with stale clients",
+                                                   restore_sum[1] / restore_n[1], restore_n[1]));
+  }
+}
+
+
+static GString *
+ev_startup_profile_show (GStrv args, GError **err)
+{
+  g_autoptr (EvFormatBuilder) builder = ev_format_builder_new ();
+
+  ev_format_builder_set_indent (builder, INFO_INDENT);
+  ev_format_builder_add (builder, _("Start"), cold ? _("cold") : _("warm"));
+  ev_format_builder_take_value (builder, _("Stored clients"),
+                                g_strdup_printf (_("%u (%u stale)"), n_clients, n_stale));
+
+  for (int i = 0; i < EV_STARTUP_N_PHASES; i++) {
+    EvPhaseTiming *timing = &phases[i];
+    char *value;
+
+    if (!timing->begin)
+      value = g_strdup (_("not started"));
+    else if (!timing->end)
+      value = g_strdup_printf (_("started at %d ms, running"), (int) (timing->begin / 1000));
+    else
+      /* Gettext can't handle G_GINT64_FORMAT, startup takes far less than INT_MAX ms */
+      value = g_strdup_printf (_("%d ms (%d ms - %d ms)"),
+                               (int) ((timing->end - timing->begin) / 1000),
+                               (int) (timing->begin / 1000), (int) (timing->end / 1000));
+
+    ev_format_builder_take_value (builder, phase_names[i], value);
+  }
+
+  ev_format_builder_add_newline (builder);
+  if (phases[EV_STARTUP_PHASE_PROMPT].end) {
+    ev_format_builder_take_value (builder, _("Time to prompt"),
+                                  g_strdup_printf ("%" G_GINT64_FORMAT " ms", phases[EV_STARTUP_PHASE_PROMPT].end / 1000));
+  }
+  if (phases[EV_STARTUP_PHASE_FIRST_SYNC].end) {
+    ev_format_builder_take_value (builder, _("Time to first sync"),
+                                  g_strdup_printf ("%" G_GINT64_FORMAT " ms", phases[EV_STARTUP_PHASE_FIRST_SYNC].end / 1000));
+  }
+
+  add_previous_runs (builder);
+
+  return ev_format_builder_end (builder);
+}
+
+
+static EvCmd startup_profile_commands[] = {
+  {
+    .name = "startup-profile",
+    .help_summary = N_("Show how long the phases of startup took"),
+    .func = ev_startup_profile_show,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+void
+ev_startup_profile_add_commands (GPtrArray *commands)
+{
+  for (int i = 0; startup_profile_commands[i].name; i++)
+    g_ptr_array_add (commands, &startup_profile_commands[i]);
+}
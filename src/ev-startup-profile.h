@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * EvStartupPhase:
+ *
+ * @EV_STARTUP_PHASE_PROMPT: Until the prompt accepts input
+ * @EV_STARTUP_PHASE_CONFIG: Parsing the account configuration
+ * @EV_STARTUP_PHASE_HISTORY: Loading the command history
+ * @EV_STARTUP_PHASE_DB_OPEN: Opening the database
+ * @EV_STARTUP_PHASE_CLIENT_RESTORE: Restoring or creating the client
+ * @EV_STARTUP_PHASE_LOGIN: Until the client is logged in
+ * @EV_STARTUP_PHASE_FIRST_SYNC: Until the first sync response arrived
+ */
+typedef enum {
+  EV_STARTUP_PHASE_PROMPT,
+  EV_STARTUP_PHASE_CONFIG,
+  EV_STARTUP_PHASE_HISTORY,
+  EV_STARTUP_PHASE_DB_OPEN,
+  EV_STARTUP_PHASE_CLIENT_RESTORE,
+  EV_STARTUP_PHASE_LOGIN,
+  EV_STARTUP_PHASE_FIRST_SYNC,
+} EvStartupPhase;
+
+#define EV_STARTUP_N_PHASES (EV_STARTUP_PHASE_FIRST_SYNC + 1)
+
+void ev_startup_profile_init         (void);
+void ev_startup_profile_begin        (EvStartupPhase phase);
+void ev_startup_profile_end          (EvStartupPhase phase);
+void ev_startup_profile_set_cold     (gboolean cold);
+void ev_startup_profile_set_clients  (guint    n_clients,
+                                      guint    n_stale);
+void ev_startup_profile_save         (const char *cache_dir);
+void ev_startup_profile_add_commands (GPtrArray *commands);
+
+G_END_DECLS
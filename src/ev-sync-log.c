@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "ev-config.h"
+
+#include "ev-prompt.h"
+#include "ev-ring.h"
+#include "ev-sync-log.h"
+
+#include <glib/gi18n.h>
+
+#define SYNC_LOG_BATCHES       128
+#define SYNC_LOG_EVENTS        1024
+#define SYNC_LOG_ID_LEN        80   /* Longer ids get truncated */
+#define SYNC_LOG_ERROR_LEN     128
+#define SYNC_LOG_DEFAULT_SHOWN 10
+
+/**
+ * EvSyncLog:
+ *
+ * A journal of the most recent sync batches and their events. Both are
+ * kept in preallocated rings of fixed size records so recording doesn't
+ * allocate.
+ */
+
+typedef struct {
+  guint64  seq;
+  gint64   received;  /* µs, real time */
+  guint    n_events;
+  int      error_code;
+  char     user_id[SYNC_LOG_ID_LEN];
+  char     room_id[SYNC_LOG_ID_LEN];
+  char     error[SYNC_LOG_ERROR_LEN];
+} EvSyncLogBatch;
+
+typedef struct {
+  guint64      seq;   /* The batch the event arrived in */
+  CmEventType  type;
+  char         id[SYNC_LOG_ID_LEN];
+} EvSyncLogEvent;
+
+static EvRing *batches;
+static EvRing *events;
+static guint64 seq;
+
+
+void
+ev_sync_log_init (void)
+{
+  batches = ev_ring_new (sizeof (EvSyncLogBatch), SYNC_LOG_BATCHES, NULL);
+  events = ev_ring_new (sizeof (EvSyncLogEvent), SYNC_LOG_EVENTS, NULL);
+}
+
+
+void
+ev_sync_log_destroy (void)
+{
+  g_clear_pointer (&batches, ev_ring_free);
+  g_clear_pointer (&events, ev_ring_free);
+}
+
+/**
+ * ev_sync_log_record:
+ * @user_id: The account the batch is for
+ * @room:(nullable): The room the events belong to
+ * @events:(nullable): The events
+ * @error:(nullable): The sync error
+ *
+ * Records a sync callback invocation.
+ */
+void
+ev_sync_log_record (const char *user_id, CmRoom *room, GPtrArray *events_, const GError *error)
+{
+  EvSyncLogBatch *batch;
+
+  if (!batches)
+    return;
+
+  batch = ev_ring_push (batches);
+  batch->seq = ++seq;
+  batch->received = g_get_real_time ();
+  g_strlcpy (batch->user_id, user_id ?: "", sizeof (batch->user_id));
+  if (room)
+    g_strlcpy (batch->room_id, cm_room_get_id (room) ?: "", sizeof (batch->room_id));
+  if (error) {
+    batch->error_code = error->code;
+    g_strlcpy (batch->error, error->message ?: "", sizeof (batch->error));
+  }
+
+  if (!events_)
+    return;
+
+  batch->n_events = events_->len;
+  for (guint i = 0; i < events_->len; i++) {
+    CmEvent *event = g_ptr_array_index (events_, i);
+    EvSyncLogEvent *entry = ev_ring_push (events);
+
+    entry->seq = batch->seq;
+    entry->type = cm_event_get_m_type (event);
+    g_strlcpy (entry->id, cm_event_get_id (event) ?: "", sizeof (entry->id));
+  }
+}
+
+
+static void
+format_batch (GString *out, EvSyncLogBatch *batch, GEnumClass *type_class)
+{
+  g_autoptr (GDateTime) dt = g_date_time_new_from_unix_local (batch->received / G_USEC_PER_SEC);
+  g_autofree char *time = g_date_time_format (dt, "%H:%M:%S");
+  guint n_retained = 0;
+
+  g_string_append_printf (out, "%*s#%" G_GUINT64_FORMAT " %s.%03" G_GINT64_FORMAT " %s %s",
+                          INFO_INDENT, "", batch->seq, time,
+                          (batch->received % G_USEC_PER_SEC) / 1000,
+                          batch->user_id,
+                          batch->room_id[0] ? batch->room_id : "-");
+  if (batch->n_events)
+    g_string_append_printf (out, " %u events", batch->n_events);
+  if (batch->error[0])
+    g_string_append_printf (out, " error %d: %s", batch->error_code, batch->error);
+  g_string_append_c (out, '\n');
+
+  for (guint i = 0; i < ev_ring_get_length (events); i++) {
+    EvSyncLogEvent *event = ev_ring_peek (events, i);
+    GEnumValue *value;
+
+    if (event->seq != batch->seq)
+      continue;
+
+    n_retained++;
+    value = g_enum_get_value (type_class, event->type);
+    g_string_append_printf (out, "%*s%s %s\n", INFO_INDENT * 2, "", event->id,
+                            value ? value->value_nick : "unknown");
+  }
+
+  if (n_retained < batch->n_events) {
+    g_string_append_printf (out, "%*s(%u events no longer in the log)\n", INFO_INDENT * 2, "",
+                            batch->n_events - n_retained);
+  }
+}
+
+
+static GString *
+ev_sync_log_show (GStrv args, GError **err)
+{
+  g_autoptr (GString) out = g_string_new ("");
+  g_autoptr (GEnumClass) type_class = NULL;
+  g_autoptr (GPtrArray) shown = g_ptr_array_new ();
+  const char *room_id = NULL;
+  guint64 n = SYNC_LOG_DEFAULT_SHOWN;
+  gboolean have_n = FALSE;
+
+  for (guint i = 0; args[i]; i++) {
+    if (g_str_equal (args[i], "--room")) {
+      if (!args[i + 1]) {
+        g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Missing value for '%s'", args[i]);
+        return NULL;
+      }
+      room_id = args[++i];
+    } else if (!have_n) {
+      if (!g_ascii_string_to_unsigned (args[i], 10, 1, SYNC_LOG_BATCHES, &n, err))
+        return NULL;
+      have_n = TRUE;
+    } else {
+      g_set_error (err, G_IO_ERROR, G_IO_ERROR_FAILED, "Unknown argument '%s'", args[i]);
+      return NULL;
+    }
+  }
+
+  if (!batches)
+    return g_string_new ("No sync log");
+
+  /* Newest first while collecting, printed oldest first */
+  for (guint i = ev_ring_get_length (batches); i > 0 && shown->len < n; i--) {
+    EvSyncLogBatch *batch = ev_ring_peek (batches, i - 1);
+
+    if (room_id && g_strcmp0 (batch->room_id, room_id) != 0)
+      continue;
+
+    g_ptr_array_add (shown, batch);
+  }
+
+  if (!shown->len)
+    return g_string_new ("No matching sync batches");
+
+  type_class = g_type_class_ref (CM_TYPE_EVENT_TYPE);
+  for (guint i = shown->len; i > 0; i--)
+    format_batch (out, g_ptr_array_index (shown, i - 1), type_class);
+
+  g_string_append_printf (out, "\n%*s%u batches and %u events logged, %" G_GUINT64_FORMAT
+                          " batches and %" G_GUINT64_FORMAT " events evicted",
+                          INFO_INDENT, "",
+                          ev_ring_get_length (batches), ev_ring_get_length (events),
+                          ev_ring_get_n_evicted (batches), ev_ring_get_n_evicted (events));
+
+  return g_steal_pointer (&out);
+}
+
+
+static const EvCmdOpt sync_log_opts[] = {
+  {
+    .name = "count",
+    .desc = "The number of most recent sync batches to show",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  {
+    .name = "--room",
+    .desc = "Only show batches for the room with the given id",
+    .flags = EV_CMD_OPT_FLAG_OPTIONAL,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+static EvCmd sync_log_commands[] = {
+  {
+    .name = "sync-log",
+    .help_summary = N_("Show the most recently synced batches and events - no request is made to the server"),
+    .func = ev_sync_log_show,
+    .opts = sync_log_opts,
+  },
+  /* Sentinel */
+  { NULL }
+};
+
+
+void
+ev_sync_log_add_commands (GPtrArray *commands)
+{
+  for (int i = 0; sync_log_commands[i].name; i++)
+    g_ptr_array_add (commands, &sync_log_commands[i]);
+}
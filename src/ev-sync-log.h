@@ -0,0 +1,23 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "cmatrix.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+void ev_sync_log_init         (void);
+void ev_sync_log_destroy      (void);
+void ev_sync_log_record       (const char   *user_id,
+                               CmRoom       *room,
+                               GPtrArray    *events,
+                               const GError *error);
+void ev_sync_log_add_commands (GPtrArray    *commands);
+
+G_END_DECLS
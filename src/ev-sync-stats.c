@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "ev-config.h"
+
+#include "ev-sync-stats.h"
+
+#include <glib/gi18n.h>
+
+#include "cmatrix.h"
+
+/* Events older than this are history delivered on (initial) sync rather
+ * than new messages */
+#define SYNC_STATS_BACKFILL_MS (5 * 60 * 1000)
+
+/**
+ * ev_sync_stats_record:
+ * @self: The stats
+ * @events:(nullable): The events of the batch
+ *
+ * Records a sync batch as received now.
+ */
+void
+ev_sync_stats_record (EvSyncStats *self, GPtrArray *events)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 now_ms = g_get_real_time () / 1000;
+  gint64 sec = now / G_USEC_PER_SEC;
+  guint slot = sec % EV_SYNC_STATS_WINDOW;
+  guint n = events ? events->len : 0;
+
+  if (self->last)
+    ev_histogram_add (&self->interval, (now - self->last) / 1000);
+  else
+    self->first = now;
+  self->last = now;
+
+  self->n_batches++;
+  self->n_events += n;
+  ev_histogram_add (&self->batch_size, n);
+
+  if (self->window_sec[slot] != sec) {
+    self->window_sec[slot] = sec;
+    self->window[slot] = 0;
+  }
+  self->window[slot] += n;
+
+  for (guint i = 0; i < n; i++) {
+    CmEvent *event = g_ptr_array_index (events, i);
+    gint64 ts = cm_event_get_time_stamp (event);
+
+    if (ts <= 0)
+      continue;
+
+    if (now_ms - ts > SYNC_STATS_BACKFILL_MS) {
+      self->n_backfill++;
+      continue;
+    }
+
+    ev_histogram_add (&self->lag, now_ms - ts);
+  }
+}
+
+/**
+ * ev_sync_stats_get_rate:
+ * @self: The stats
+ *
+ * Returns: The events per second over the last minute
+ */
+double
+ev_sync_stats_get_rate (EvSyncStats *self)
+{
+  gint64 sec = g_get_monotonic_time () / G_USEC_PER_SEC;
+  gint64 span;
+  guint64 sum = 0;
+
+  if (!self->first)
+    return 0.0;
+
+  for (guint i = 0; i < EV_SYNC_STATS_WINDOW; i++) {
+    if (self->window_sec[i] > sec - EV_SYNC_STATS_WINDOW)
+      sum += self->window[i];
+  }
+
+  span = CLAMP (sec - self->first / G_USEC_PER_SEC + 1, 1, EV_SYNC_STATS_WINDOW);
+  return (double) sum / span;
+}
+
+/**
+ * ev_sync_stats_get_mean_rate:
+ * @self: The stats
+ *
+ * Returns: The events per second since the first batch
+ */
+double
+ev_sync_stats_get_mean_rate (EvSyncStats *self)
+{
+  gint64 span;
+
+  if (!self->first)
+    return 0.0;
+
+  span = MAX (g_get_monotonic_time () - self->first, G_USEC_PER_SEC);
+  return (double) self->n_events * G_USEC_PER_SEC / span;
+}
+
+
+void
+ev_sync_stats_format (EvSyncStats *self, EvFormatBuilder *builder)
+{
+  ev_format_builder_take_value (builder, _("Batches"),
+                                g_strdup_printf ("%" G_GUINT64_FORMAT, self->n_batches));
+  ev_format_builder_take_value (builder, _("Events"),
+                                g_strdup_printf ("%" G_GUINT64_FORMAT " (%" G_GUINT64_FORMAT " backfilled)",
+                                                 self->n_events, self->n_backfill));
+  ev_format_builder_take_value (builder, _("Events/s"),
+                                g_strdup_printf (_("%.1f last minute, %.1f overall"),
+                                                 ev_sync_stats_get_rate (self),
+                                                 ev_sync_stats_get_mean_rate (self)));
+  ev_format_builder_take_value (builder, _("Batch size"),
+                                ev_histogram_format (&self->batch_size, NULL));
+  ev_format_builder_take_value (builder, _("Batch interval"),
+                                ev_histogram_format (&self->interval, " ms"));
+  ev_format_builder_take_value (builder, _("Delivery lag"),
+                                ev_histogram_format (&self->lag, " ms"));
+}
@@ -0,0 +1,44 @@
+/*
+ * Copyright (C) 2024 The Phosh Developers
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "ev-format-builder.h"
+#include "ev-histogram.h"
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define EV_SYNC_STATS_WINDOW 60 /* seconds */
+
+/**
+ * EvSyncStats:
+ *
+ * Throughput and delivery lag of the sync stream. Zero initialized
+ * memory is an empty record.
+ */
+typedef struct {
+  guint64     n_batches;
+  guint64     n_events;
+  guint64     n_backfill;    /* Too old to count towards the lag */
+  gint64      first;         /* µs, monotonic */
+  gint64      last;          /* µs, monotonic */
+  guint       window[EV_SYNC_STATS_WINDOW];      /* Events per second */
+  gint64      window_sec[EV_SYNC_STATS_WINDOW];  /* The second a slot is for */
+  EvHistogram batch_size;
+  EvHistogram interval;      /* ms between batches */
+  EvHistogram lag;           /* ms from origin_server_ts to local receipt */
+} EvSyncStats;
+
+void             ev_sync_stats_record            (EvSyncStats     *self,
+                                                  GPtrArray       *events);
+double           ev_sync_stats_get_rate          (EvSyncStats     *self);
+double           ev_sync_stats_get_mean_rate     (EvSyncStats     *self);
+void             ev_sync_stats_format            (EvSyncStats     *self,
+                                                  EvFormatBuilder *builder);
+
+G_END_DECLS
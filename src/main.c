@@ -8,6 +8,7 @@
 
 #include "ev-config.h"
 #include "ev-application.h"
+#include "ev-startup-profile.h"
 
 #include <glib/gi18n.h>
 #include <glib-unix.h>
@@ -30,6 +31,7 @@ main (int argc, char *argv[])
   g_autoptr (EvApplication) app = NULL;
   int ret;
 
+  ev_startup_profile_init ();
   cm_init (TRUE);
 
   bind_textdomain_codeset (GETTEXT_PACKAGE, "UTF-8");